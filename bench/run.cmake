@@ -0,0 +1,137 @@
+# Runs each benchmark named in BENCHMARKS through the interpreter and as a
+# native executable, printing the wall-clock time of each and failing if
+# the two print different things. Then compares
+# the interpreter's pools and regions with plain malloc and free on the
+# ALLOCATION ones, and lowers a large generated program to report the
+# native backend's own speed.
+# Invoked by the `bench` target.
+string(REPLACE "," ";" BENCHMARKS "${BENCHMARKS}")
+string(REPLACE "," ";" BYTECODE_ONLY "${BYTECODE_ONLY}")
+string(REPLACE "," ";" ALLOCATION "${ALLOCATION}")
+
+# sets VAR to what the command printed
+function(timed label var)
+	string(TIMESTAMP start "%s%f")
+	execute_process(COMMAND ${ARGN}
+		OUTPUT_VARIABLE output
+		RESULT_VARIABLE result)
+	string(TIMESTAMP end "%s%f")
+	math(EXPR ms "(${end} - ${start}) / 1000")
+	string(STRIP "${output}" output)
+	if(NOT result EQUAL 0)
+		message(SEND_ERROR "${label}: failed with ${result}")
+	endif()
+	message("${label}: ${ms} ms (${output})")
+	set(${var} "${output}" PARENT_SCOPE)
+endfunction()
+
+foreach(name ${BENCHMARKS})
+	# built here rather than next to the sources
+	file(COPY ${DIR}/${name}.voom DESTINATION ${OUT})
+	timed("${name} bytecode" expected ${VOOM} run ${OUT}/${name}.voom)
+	list(FIND BYTECODE_ONLY ${name} skip)
+	if(NOT skip EQUAL -1)
+		continue()
+	endif()
+	execute_process(COMMAND ${VOOM} build ${OUT}/${name}.voom
+		OUTPUT_QUIET
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(SEND_ERROR "${name}: native build failed")
+		continue()
+	endif()
+	timed("${name} native" output ${OUT}/${name})
+	if(NOT output STREQUAL expected)
+		message(SEND_ERROR "${name}: native printed ${output}, bytecode ${expected}")
+	endif()
+endforeach()
+
+# the time, and the peak heap and RSS from --heap-stats
+foreach(name ${ALLOCATION})
+	foreach(mode "" "--malloc")
+		string(TIMESTAMP start "%s%f")
+		execute_process(COMMAND ${VOOM} ${mode} --heap-stats run ${OUT}/${name}.voom
+			OUTPUT_QUIET
+			ERROR_VARIABLE stats
+			RESULT_VARIABLE result)
+		string(TIMESTAMP end "%s%f")
+		math(EXPR ms "(${end} - ${start}) / 1000")
+		if(NOT result EQUAL 0)
+			message(SEND_ERROR "${name} ${mode}: failed with ${result}")
+			continue()
+		endif()
+		string(STRIP "${stats}" stats)
+		if(NOT mode)
+			set(mode "pools and regions")
+		endif()
+		message("${name}, ${mode}: ${ms} ms\n${stats}")
+	endforeach()
+endforeach()
+
+# many small functions calling each other
+set(source "")
+foreach(i RANGE 1 5000)
+	math(EXPR prev "${i} - 1")
+	string(APPEND source "fn f${i}(a: int, b: int): int {\n")
+	string(APPEND source "  x = a * ${i} + b;\n")
+	string(APPEND source "  if x > 1000 { x = x % 1000; }\n")
+	string(APPEND source "  for k in range(3) { x += k; }\n")
+	string(APPEND source "  return f${prev}(x, b + 1);\n")
+	string(APPEND source "}\n")
+endforeach()
+string(APPEND source "fn f0(a: int, b: int): int { return a + b; }\nprint(f5000(1, 2));\n")
+file(WRITE ${OUT}/functions.voom "${source}")
+execute_process(COMMAND ${VOOM} build ${OUT}/functions.voom
+	OUTPUT_VARIABLE output
+	RESULT_VARIABLE result)
+string(STRIP "${output}" output)
+message("native backend: ${output}")
+
+# what the optimizer does to the same program, pass by pass
+execute_process(COMMAND ${VOOM} opt ${OUT}/functions.voom
+	OUTPUT_VARIABLE output)
+message("${output}")
+
+# A 10k-file project, each unit importing the two below it, to show what
+# --memory-budget does to the peak RSS.
+set(units 10000)
+file(MAKE_DIRECTORY ${OUT}/units)
+math(EXPR last "${units} - 1")
+foreach(i RANGE ${last})
+	set(source "")
+	set(calls "")
+	foreach(k 1 2)
+		math(EXPR child "2 * ${i} + ${k}")
+		if(child LESS units)
+			string(APPEND source "import \"u${child}.voom\";\n")
+			string(APPEND calls "  x = x + f${child}(a + 1) % 1000;\n")
+		endif()
+	endforeach()
+	foreach(p RANGE 7)
+		math(EXPR n "${p} + 2")
+		string(APPEND source "fn pad${i}_${p}(a: int): int {\n")
+		string(APPEND source "  x = a;\n")
+		string(APPEND source "  for k in range(${n}) { x = x * 3 + k; if x > 100000 { x = x % 997; } }\n")
+		string(APPEND source "  return x;\n")
+		string(APPEND source "}\n")
+	endforeach()
+	string(APPEND source "fn f${i}(a: int): int {\n  x = pad${i}_0(a) + pad${i}_7(a);\n${calls}  return x % 100000;\n}\n")
+	if(i EQUAL 0)
+		string(APPEND source "print(f0(1));\n")
+	endif()
+	file(WRITE ${OUT}/units/u${i}.voom "${source}")
+endforeach()
+foreach(budget "" "--memory-budget=8")
+	execute_process(COMMAND ${VOOM} ${budget} opt ${OUT}/units/u0.voom
+		OUTPUT_VARIABLE output
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(SEND_ERROR "${units} units ${budget}: failed with ${result}")
+		continue()
+	endif()
+	string(REGEX MATCH "units  [^\n]*\npeak rss[^\n]*" output "${output}")
+	if(NOT budget)
+		set(budget "no budget")
+	endif()
+	message("${units} units, ${budget}:\n${output}")
+endforeach()
@@ -0,0 +1,279 @@
+// Fuzzes the tokenizer and parser for crashes, and for inputs that take
+// more than linear time.
+//
+// A seed is scaled up by repeating it, or if it has a `$` in it, by
+// nesting it in place of the `$`, so that `f($)` becomes f(f(f(...))).
+// Anything after a second `$` comes once at the end, so `$()$;` becomes
+// ()()()...;
+// The cost of an input is the least CPU time of a few runs of tokenize()
+// and parse(), done the way the compiler does them, and a seed's growth
+// is how much more each byte costs at 16 times the size, over the same
+// for plain statements. That stays near 1 for linear work and goes to 16
+// for quadratic, whatever the cache and the allocator do with the larger
+// size. Too much growth, or too many ns per byte to begin with, fails a
+// seed.
+//
+//   voom_fuzz corpus/           checks every seed in corpus/
+//   voom_fuzz --runs=N corpus/  then mutates them N times, adding the
+//                               worst cases it finds, minimized, to corpus/
+//
+// The seed being tried is written to voom_fuzz_input.voom first, so a
+// crash leaves it behind. Built with VOOM_LIBFUZZER, this is a libFuzzer
+// target instead, which treats costing too much as a crash.
+
+#include "../src/compilation_unit.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace {
+
+// bytes at the smaller scale
+const size_t scale_bytes = 4 << 10;
+const size_t scale_factor = 16;
+const double growth_limit = 4;
+// Plain statements take under 200, and a byte that is an error on its own
+// around 2000, for printing the message.
+const double cost_limit = 10000;
+// longer seeds get cut, so that scaling them says something
+const size_t max_seed = 64;
+const char* input_file = "voom_fuzz_input.voom";
+
+// the parser's errors would swamp everything else
+class NullBuffer : public std::streambuf {
+protected:
+  int overflow(int c) override { return c; }
+};
+
+std::string scale(const std::string& seed, size_t size) {
+  size_t hole = seed.find('$');
+  size_t end = (hole == std::string::npos ? hole : seed.find('$', hole + 1));
+  std::string before = seed.substr(0, hole);
+  std::string after = (hole == std::string::npos ? "" : seed.substr(hole + 1, end - hole - 1));
+  size_t count = size / std::max<size_t>(before.size() + after.size(), 1) + 1;
+  std::string out;
+  out.reserve(count * seed.size());
+  for (size_t i = 0; i < count; i++) out += before;
+  for (size_t i = 0; i < count; i++) out += after;
+  if (end != std::string::npos) out += seed.substr(end + 1);
+  return out;
+}
+
+void parse(const std::string& source) {
+  CompilationUnit cu("fuzz.voom", source.data(), source.size());
+  cu.tokenize();
+  cu.parse(true);
+  cu.parse_bodies();
+}
+
+double seconds(const std::string& source, int runs) {
+  double best = 0;
+  for (int i = 0; i < runs; i++) {
+    std::clock_t start = std::clock();
+    parse(source);
+    double t = double(std::clock() - start) / CLOCKS_PER_SEC;
+    if (i == 0 || t < best) best = t;
+  }
+  return best;
+}
+
+struct Cost {
+  // at the larger scale
+  double ns_per_byte = 0;
+  double growth = 0;
+};
+
+// what linear growth looks like on this machine
+double baseline = 1;
+
+Cost measure(const std::string& seed, size_t size = scale_bytes, int runs = 7) {
+  Cost cost;
+  std::string small = scale(seed, size);
+  std::string large = scale(seed, scale_factor * size);
+  // nothing in it to scale
+  if (large.size() == small.size()) return cost;
+  double per_small = seconds(small, runs) / small.size();
+  double per_large = seconds(large, runs) / large.size();
+  cost.ns_per_byte = per_large * 1e9;
+  cost.growth = per_large / std::max(per_small, 1e-12) / baseline;
+  return cost;
+}
+
+void calibrate() {
+  baseline = 1;
+  baseline = measure("a = b + c;\n").growth;
+}
+
+bool too_costly(const Cost& cost) {
+  return cost.growth > growth_limit || cost.ns_per_byte > cost_limit;
+}
+
+bool costly(const std::string& seed) {
+  // a cheap look first, since nearly everything is linear
+  if (!too_costly(measure(seed, scale_bytes / 4, 1))) return false;
+  return too_costly(measure(seed));
+}
+
+// drops bytes for as long as what's left still costs too much
+std::string minimize(std::string seed) {
+  for (size_t i = 0; i < seed.size();) {
+    std::string shorter = seed.substr(0, i) + seed.substr(i + 1);
+    if (!shorter.empty() && costly(shorter)) seed = shorter;
+    else i++;
+  }
+  return seed;
+}
+
+const char* pieces[] = {
+  "(", ")", "[", "]", "{", "}", ";", ",", ".", ":", "$", " ", "\n", "#",
+  "a", "1", "1.5", "\"s\"", "\"\\\"", "null",
+  "+", "-", "*", "<", "<<", "==", "=", "+=", "++", "!", "~", "?", "??", "|",
+  "and", "not", "in", "as",
+  "fn ", "if ", "elif ", "else ", "for ", "while ", "do ", "switch ", "case ",
+  "return ", "yield ", "defer ", "delete ", "break;", "struct ", "enum ",
+  "import ",
+};
+
+std::string mutate(std::string seed, std::mt19937& rng) {
+  size_t count = 1 + rng() % 4;
+  for (size_t n = 0; n < count; n++) {
+    size_t at = (seed.empty() ? 0 : rng() % (seed.size() + 1));
+    size_t length = std::min<size_t>(1 + rng() % 4, seed.size() - at);
+    switch (rng() % 4) {
+    case 0:
+      seed.insert(at, pieces[rng() % (sizeof(pieces) / sizeof(pieces[0]))]);
+      break;
+    case 1:
+      seed.erase(at, length);
+      break;
+    case 2:
+      seed.insert(at, seed.substr(at, length));
+      break;
+    case 3:
+      if (at < seed.size()) seed[at] = (char)(rng() % 128);
+      break;
+    }
+  }
+  if (seed.size() > max_seed) seed.resize(max_seed);
+  return seed;
+}
+
+std::string read_file(const std::filesystem::path& path) {
+  std::ifstream in(path, std::ios::binary);
+  std::stringstream ss;
+  ss << in.rdbuf();
+  return ss.str();
+}
+
+void write_file(const std::filesystem::path& path, const std::string& data) {
+  std::ofstream out(path, std::ios::binary);
+  out << data;
+}
+
+// Regression check: every seed must stay linear.
+int check(const std::vector<std::filesystem::path>& files) {
+  int failed = 0;
+  for (auto& path : files) {
+    std::string seed = read_file(path);
+    write_file(input_file, seed);
+    Cost cost = measure(seed);
+    bool bad = too_costly(cost);
+    std::cout << std::left << std::setw(28) << path.filename().string() << std::right;
+    std::cout << std::fixed << std::setprecision(1) << std::setw(8) << cost.ns_per_byte;
+    std::cout << " ns/byte, growth " << std::setprecision(2) << cost.growth;
+    std::cout << (bad ? "  TOO COSTLY" : "") << std::endl;
+    if (bad) failed++;
+  }
+  std::remove(input_file);
+  return failed;
+}
+
+int explore(const std::filesystem::path& corpus, std::vector<std::string> seeds, size_t runs) {
+  if (seeds.empty()) seeds.push_back("a = b + c;\n");
+  std::mt19937 rng(seeds.size());
+  size_t found = 0;
+  for (size_t run = 0; run < runs; run++) {
+    std::string seed = mutate(seeds[rng() % seeds.size()], rng);
+    if (seed.empty()) continue;
+    write_file(input_file, seed);
+    parse(seed);
+    if (!costly(seed)) continue;
+    seed = minimize(seed);
+    std::stringstream name;
+    name << std::hex << hash_bytes(seed.data(), seed.size()) << ".voom";
+    if (std::filesystem::exists(corpus / name.str())) continue;
+    write_file(corpus / name.str(), seed);
+    seeds.push_back(seed);
+    found++;
+    Cost cost = measure(seed);
+    std::cout << name.str() << ": " << cost.ns_per_byte << " ns/byte, growth " << cost.growth << std::endl;
+  }
+  std::remove(input_file);
+  std::cout << found << " new worst cases in " << runs << " runs" << std::endl;
+  return 0;
+}
+
+NullBuffer null_buffer;
+
+}
+
+#ifdef VOOM_LIBFUZZER
+
+extern "C" int LLVMFuzzerInitialize(int*, char***) {
+  std::cerr.rdbuf(&null_buffer);
+  calibrate();
+  return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  std::string seed((const char*)data, size);
+  parse(seed);
+  if (size && size <= max_seed && costly(seed)) std::abort();
+  return 0;
+}
+
+#else
+
+int main(int argc, char** argv) {
+  char* name = argv[0];
+  size_t runs = 0;
+  const char* option = "--runs=";
+  if (argc == 3 && std::strncmp(argv[1], option, strlen(option)) == 0) {
+    runs = std::strtoul(argv[1] + strlen(option), nullptr, 10);
+    argv++;
+    argc--;
+  }
+  if (argc != 2) {
+    std::cerr << "Usage: " << name << " [--runs=N] corpus_dir" << std::endl;
+    return 1;
+  }
+  std::filesystem::path corpus = argv[1];
+  std::vector<std::filesystem::path> files;
+  for (auto& entry : std::filesystem::directory_iterator(corpus)) {
+    if (entry.path().extension() == ".voom") files.push_back(entry.path());
+  }
+  std::sort(files.begin(), files.end());
+  std::cerr.rdbuf(&null_buffer);
+  calibrate();
+  int failed = check(files);
+  if (runs) {
+    std::vector<std::string> seeds;
+    for (auto& path : files) seeds.push_back(read_file(path));
+    explore(corpus, seeds, runs);
+  }
+  if (failed) std::cout << failed << " of " << files.size() << " cost too much" << std::endl;
+  return failed ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef __VOOM_BYTECODE_H__
+#define __VOOM_BYTECODE_H__
+
+#include "types.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Types are fully known at compile time, so a register holds a bare
+// 64-bit value and the opcode says how to read it. Nullable types reserve
+// one bit pattern of their base representation (see NullRepr), which
+// keeps `int?` as cheap as `int`.
+union Value {
+  int64_t i;
+  double f;
+  void* p;
+};
+
+struct Str {
+  int64_t length;
+  char data[];
+};
+
+struct Array {
+  int64_t length;
+  Value data[];
+};
+
+// the null value of each representation
+enum NullRepr {
+  NULL_POINTER, // str, arrays, structs
+  NULL_INT,     // int, enums
+  NULL_FLOAT,
+  NULL_BOOL,
+};
+
+static const int64_t null_bits[] = {
+  0,
+  INT64_MIN,
+  0x7ff4000000000001, // a signalling NaN that arithmetic never produces
+  2,
+};
+
+// a = destination register unless noted, b and c are operands.
+// Jump targets are always in c.
+#define VOOM_OPCODES(X) \
+  X(NOP)      /* */                                \
+  X(MOVE)     /* a = b */                          \
+  X(LOADI)    /* a = immediate b */                \
+  X(LOADK)    /* a = constants[b] */               \
+  X(LOADNULL) /* a = null of NullRepr b */         \
+  X(LOADFN)   /* a = function b */                 \
+  X(ADDI) X(SUBI) X(MULI) X(DIVI) X(MODI)          \
+  X(ADDK)     /* a = b + immediate c */            \
+  X(SHL) X(SHR) X(BAND) X(BOR) X(BXOR)             \
+  X(NEGI) X(BNOT) X(NOT)                           \
+  X(ADDF) X(SUBF) X(MULF) X(DIVF) X(MODF) X(NEGF)  \
+  X(ITOF) X(FTOI)                                  \
+  X(EQI) X(NEI) X(LTI) X(LEI)                      \
+  X(EQF) X(NEF) X(LTF) X(LEF)                      \
+  X(EQS) X(NES) X(LTS) X(LES)                      \
+  X(CONCAT)                                        \
+  X(LCONCAT)  /* CONCAT into the region */         \
+  X(ISNULL)   /* a = b is null of NullRepr c */    \
+  X(ORNULLP)  /* a = b, or c if b is null */       \
+  X(ORNULLI)  /*   ... of each NullRepr */         \
+  X(ORNULLF)  /* */                                \
+  X(ORNULLB)  /* */                                \
+  X(SHASH)    /* a = str_hash(b, seed c) */        \
+  X(BITTEST)  /* a = bit b of constants[c] */      \
+  X(JMP)      /* goto c */                         \
+  X(JT)       /* if a goto c */                    \
+  X(JF)       /* if !a goto c */                   \
+  X(JUMPTAB)  /* goto tables[b][a], or else c */   \
+  X(CALL)     /* a = function b(c, c+1, ...) */    \
+  X(CALLR)    /* a = (c-1)(c, ... c+b-1) */        \
+  X(RET)      /* return a */                       \
+  X(RETV)     /* return nothing */                 \
+  X(GENSTART) /* frame a = generator b(c, ...) */  \
+  X(RESUME)   /* a = next of generator b at c */   \
+  X(GENLIVE)  /* a = generator b at c goes on */   \
+  X(YIELD)    /* suspend with a, see suspended */  \
+  X(DONE)     /* finish a generator */             \
+  X(GENNEW)   /* a = pooled generator b(c, ...) */ \
+  X(RESUMEP)  /* a = next of pooled b, run at c */ \
+  X(GENFREE)  /* frame a freed; c if in place */   \
+  X(NEWSTRUCT) /* a = {c, c+1, ... c+b-1} */       \
+  X(LNEWSTRUCT) /* NEWSTRUCT into the region */    \
+  X(GETFIELD) /* a = b.fields[c] */                \
+  X(SETFIELD) /* a.fields[b] = c */                \
+  X(NEWARRAY) /* a = [c, c+1, ... c+b-1] */        \
+  X(LNEWARRAY) /* NEWARRAY into the region */      \
+  X(RANGE)    /* a = [b, b+1, ... c-1] */          \
+  X(LRANGE)   /* RANGE into the region */          \
+  X(INDEX)    /* a = b[c] */                       \
+  X(SETINDEX) /* a[b] = c */                       \
+  X(LEN)      /* a = length of array b */          \
+  X(SLEN)     /* a = length of str b */            \
+  X(SINDEX)   /* a = b[c] as a str */              \
+  X(INARR)    /* a = b in array c, by value */     \
+  X(INARRS)   /* a = b in array of str c */        \
+  X(SFIND)    /* a = b is a substring of c */      \
+  X(DELETE)   /* free a, of size b (see below) */  \
+  X(MARK)     /* a = where the region is up to */  \
+  X(RELEASE)  /* free the region back to mark a */ \
+  X(PRINT)    /* print a of type b, then char c */
+
+// DELETE's b is the size of a struct in words, or 0 for an array, which
+// carries its own. Region objects are never deleted.
+enum Opcode {
+#define X(name) BC_##name,
+  VOOM_OPCODES(X)
+#undef X
+};
+
+struct Instruction {
+  uint16_t op;
+  int32_t a = 0;
+  int32_t b = 0;
+  int32_t c = 0;
+};
+
+// Where a JUMPTAB goes for the values low, low + 1, ...
+struct JumpTable {
+  int64_t low = 0;
+  std::vector<int32_t> targets;
+};
+
+// What SHASH computes for a str (null hashes to 0), and what a switch on
+// strs picks its slots by: hash_bytes() from a seeded start, with the high
+// half folded in so that the low bits are usable.
+inline int64_t str_hash(const char* data, int64_t length, int64_t seed) {
+  uint64_t h = hash_bytes(data, length, 0xcbf29ce484222325 ^ (uint64_t)seed);
+  return h ^ (h >> 32);
+}
+
+// Generators run in a frame owned by the loop that iterates them, and
+// each RESUME jumps straight back in. Register `params` of the frame says
+// where: 0 once finished, otherwise 1 + the instruction to continue at.
+// As emitted, a frame is one register standing for it. lower_ir() turns
+// it into a window of registers in the caller (GENSTART, RESUME), or for
+// a generator that ends up iterating itself, a pooled copy that RESUMEP
+// moves onto the stack while it runs (GENNEW, RESUMEP, GENFREE).
+// A frame left suspended inside one of its generator's own loops holds
+// the frame of that loop's generator too, which has to be freed with it:
+// a pooled one through the register `at`, one in place at `at` itself.
+struct Suspended {
+  uint32_t function;
+  int32_t at;
+  bool pooled;
+};
+
+struct Function {
+  std::string name;
+  uint32_t params = 0;
+  uint32_t registers = 0;
+  bool generator = false;
+  std::vector<Instruction> code;
+  // source line of each instruction, for runtime errors
+  std::vector<size_t> lines;
+  std::vector<JumpTable> tables;
+  // what each YIELD leaves suspended, if anything needs freeing
+  std::vector<std::vector<Suspended>> suspended;
+};
+
+struct Program {
+  std::vector<Function> functions;
+  std::vector<Value> constants;
+  // the top-level code of each unit, dependencies first
+  std::vector<uint32_t> init;
+  // (unit, FUNCTION token) -> index into functions
+  std::map<std::pair<const void*, size_t>, uint32_t> function_index;
+  // strings referred to by constants
+  std::vector<void*> owned;
+
+  Program() = default;
+  Program(const Program&) = delete;
+  ~Program();
+  uint32_t add_constant(Value v);
+  uint32_t add_string(const char* data, size_t length);
+};
+
+class Heap;
+
+// runs every init function in order, returns the process exit code
+int interpret(Program& program, Heap& heap);
+
+NullRepr null_repr(TypeId type);
+
+#endif
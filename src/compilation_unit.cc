@@ -1,36 +1,97 @@
 #include "compilation_unit.h"
 
+#include <mutex>
+
+static std::mutex error_lock;
+// lets lazily parsed bodies tell whether they had errors of their own
+static thread_local size_t error_count = 0;
+// Deep enough for any program, shallow enough for the stack of every
+// phase that recurses on brackets or on the tree.
+static const size_t max_nesting = 256;
+static const uint32_t max_depth = 4096;
+
 CompilationUnit::CompilationUnit(std::filesystem::path filename) {
   this->filename = filename;
+  if (read_source()) {
+    status = UNIT_READ;
+    source_hash = hash_bytes(text, length);
+  }
+}
+
+CompilationUnit::CompilationUnit(std::filesystem::path filename, const char* source, size_t length) {
+  this->filename = filename;
+  this->length = length;
+  text = new char[length];
+  std::memcpy(text, source, length);
+  status = UNIT_READ;
+  source_hash = hash_bytes(text, length);
+}
+
+CompilationUnit::~CompilationUnit() {
+  close_interface();
+  release_source();
+}
+
+bool CompilationUnit::read_source() {
   std::error_code ec;
   length = std::filesystem::file_size(filename, ec);
   if (ec.value()) {
     std::cerr << "Unable to stat " << filename << std::endl;
     status = UNIT_ERROR;
-    this->errors = true;
-  } else {
-    text = new char[length];
-    FILE* fin = fopen(filename.c_str(), "rb");
-    auto read = fread(text, sizeof(char), length, fin);
-    fclose(fin);
-    if (read != length) {
-      std::cerr << "Unable to read all of " << filename << std::endl;
-      status = UNIT_ERROR;
-      this->errors = true;
-    } else {
-      status = UNIT_READ;
-    }
+    errors = true;
+    return false;
   }
+  text = new char[length];
+  FILE* fin = fopen(filename.c_str(), "rb");
+  auto read = fread(text, sizeof(char), length, fin);
+  fclose(fin);
+  if (read != length) {
+    std::cerr << "Unable to read all of " << filename << std::endl;
+    status = UNIT_ERROR;
+    errors = true;
+    return false;
+  }
+  return true;
 }
 
-CompilationUnit::~CompilationUnit() {
+size_t CompilationUnit::source_bytes() {
+  return (text ? length : 0) + tokens.capacity() * sizeof(Token*) + tokens.size() * sizeof(Token);
+}
+
+void CompilationUnit::release_source() {
   delete[] text;
+  text = nullptr;
   for (auto& tok : tokens) {
     delete tok;
   }
+  tokens.clear();
+  tokens.shrink_to_fit();
+}
+
+bool CompilationUnit::reload_source() {
+  if (text || from_interface || status == UNIT_ERROR) return !errors;
+  UnitStatus was = status;
+  if (!read_source()) return false;
+  if (hash_bytes(text, length) != source_hash) {
+    std::cerr << filename << " changed during the build" << std::endl;
+    status = UNIT_ERROR;
+    errors = true;
+    return false;
+  }
+  tokenize();
+  parse(lazy);
+  status = was;
+  // bodies are checked against the signatures, which live on the tokens
+  for (size_t i = 1; i < functions.size(); i++) {
+    auto tok = tokens[functions[i]];
+    tok->value_type = globals[token_string(tok->child1)].type;
+  }
+  return !errors;
 }
 
 void CompilationUnit::report_error(size_t token_index, const char* msg) {
+  std::lock_guard<std::mutex> l(error_lock);
+  error_count++;
   std::cerr << filename << " line " << tokens[token_index]->line_number << ": ";
   std::cerr << msg << " (token " << token_index << ")" << std::endl;
   errors = true;
@@ -171,6 +232,9 @@ void CompilationUnit::check_keyword() {
     } break;
   case 'i':
     switch (buf[1]) {
+    case 'f':
+      if (len == 2) tok->type = TOKEN_IF;
+      break;
     case 'm':
       if (ident == "import") tok->type = TOKEN_IMPORT;
       break;
@@ -218,13 +282,14 @@ void CompilationUnit::check_keyword() {
 }
 
 #define SPLIT_TOKEN(idx) {                         \
-  if (idx > len) {                                 \
+  if (len > (idx)) {                               \
     Token* tok2 = new Token;                       \
     tok2->text.data = &(tok->text.data[(idx)]);    \
     tok2->text.count = (tok->text.count - (idx));  \
     tok2->line_number = tok->line_number;          \
     tok2->byte_number = tok->byte_number + (idx);  \
     tok2->type = TOKEN_OP;                         \
+    tok->text.count = (idx);                       \
     tokens.push_back(tok2);                        \
     check_operator();                              \
     return;                                        \
@@ -251,7 +316,10 @@ void CompilationUnit::check_operator() {
     if (len > 1 && buf[1] == '=') {
       tok->op = OP_NEQ;
       SPLIT_TOKEN(2);
-    } else SPLIT_TOKEN(1);
+    } else {
+      tok->op = OP_UNARY_NOT;
+      SPLIT_TOKEN(1);
+    }
     break;
   case '%':
     tok->op = OP_MOD;
@@ -364,7 +432,10 @@ void CompilationUnit::check_operator() {
   case '|':
     tok->op = OP_BIT_OR;
     if (len > 1) {
-      if (buf[1] == '|') {
+      if (buf[1] == '>') {
+        tok->op = OP_PIPE;
+        SPLIT_TOKEN(2);
+      } else if (buf[1] == '|') {
         tok->op = OP_OR;
         MAYBE_ASSIGN(2);
       } else {
@@ -510,7 +581,9 @@ void CompilationUnit::dump_token(size_t i, Token* tok) {
     std::cerr << "WAAAT? (" << tok->type << ") ";
   }
   std::cerr << tok->text << " p " << tok->parent;
-  std::cerr << " c1 " << tok->child1 << " c2 " << tok->child2 << std::endl;
+  std::cerr << " c1 " << tok->child1 << " c2 " << tok->child2;
+  if (tok->value_type) std::cerr << " : " << type_table.name(tok->value_type);
+  std::cerr << std::endl;
 }
 
 void CompilationUnit::dumpTokens() {
@@ -520,9 +593,17 @@ void CompilationUnit::dumpTokens() {
 void CompilationUnit::match_brackets() {
   std::vector<size_t> stack;
   for (size_t i = 0; i < tokens.size(); i++) {
+    // the innermost bracket around a token is on top of the stack as it
+    // goes by, including for the brackets themselves
+    if (!stack.empty()) tokens[i]->parent = stack.back();
     if (tokens[i]->type != TOKEN_BRACKET) continue;
     auto b = tokens[i]->text;
-    if (b == "{") {
+    if ((b == "{" || b == "(" || b == "[") && stack.size() == max_nesting) {
+      // the parser and everything after it recurse on brackets
+      report_error(i, "brackets nested too deeply");
+      stack.clear();
+      break;
+    } else if (b == "{") {
       stack.push_back(i);
       tokens[i]->op = OP_BRACE;
     } else if (b == "(") {
@@ -535,9 +616,6 @@ void CompilationUnit::match_brackets() {
                ((tokens[stack.back()]->op == OP_BRACE && b == "}") ||
                 (tokens[stack.back()]->op == OP_PAREN && b == ")") ||
                 (tokens[stack.back()]->op == OP_BRACKET && b == "]"))) {
-      for (size_t j = stack.back()+1; j <= i; j++) {
-        if (!tokens[j]->parent) tokens[j]->parent = stack.back();
-      }
       tokens[stack.back()]->child2 = i;
       stack.pop_back();
     } else {
@@ -548,11 +626,39 @@ void CompilationUnit::match_brackets() {
   tokens[0]->child2 = tokens.size()-1;
 }
 
-void CompilationUnit::parse_expression(size_t start, bool toplevel) {
-  if (tokens[start]->child2 == start+1) return;
-  tokens[start]->child1 = start+1;
+int CompilationUnit::precedence(size_t i) {
+  // assignments bind more loosely than anything else, including commas
+  if (tokens[i]->type == TOKEN_STATEMENT_OP) return 0x10;
+  return tokens[i]->op >> 4;
+}
+
+void CompilationUnit::attach_operand(size_t holder, size_t& root, size_t& cur, size_t i) {
+  if (!cur) {
+    root = i;
+    tokens[i]->parent = holder;
+  } else if (tokens[cur]->role == ROLE_OPERATOR && !tokens[cur]->child2) {
+    tokens[cur]->child2 = i;
+    tokens[i]->parent = cur;
+  } else {
+    report_error(i, "missing operator");
+    return;
+  }
+  cur = i;
+}
+
+void CompilationUnit::replace_node(size_t holder, size_t& root, size_t old, size_t node) {
+  size_t parent = tokens[old]->parent;
+  tokens[node]->parent = parent;
+  tokens[old]->parent = node;
+  if (parent == holder) root = node;
+  else if (tokens[parent]->child1 == old) tokens[parent]->child1 = node;
+  else tokens[parent]->child2 = node;
+}
+
+size_t CompilationUnit::parse_range(size_t holder, size_t start, size_t end, bool toplevel) {
+  size_t root = 0;
   size_t cur = 0;
-  for (size_t i = start+1; i < tokens[start]->child2; i++) {
+  for (size_t i = start; i < end; i++) {
     auto tok = tokens[i];
     switch (tok->type) {
     case TOKEN_CONSTANT:
@@ -560,132 +666,461 @@ void CompilationUnit::parse_expression(size_t start, bool toplevel) {
     case TOKEN_NUM:
     case TOKEN_STR:
       tok->role = ROLE_OPERAND;
-      if (!cur) cur = i;
-      else if (tokens[cur]->role == ROLE_OPERATOR && !tokens[cur]->child2) {
-        tokens[cur]->child2 = i;
-        tok->parent = cur;
-        cur = i;
-      }
-      else report_error(i, "missing operator");
+      attach_operand(holder, root, cur, i);
       break;
-    case TOKEN_BRACKET:
-      tok->role = ROLE_OPERAND;
-      if (tok->op == OP_BRACE) {
-        parse_statements(i);
-        if (!cur) cur = i;
-        else if (tokens[cur]->type == TOKEN_OP && !tokens[cur]->child2) {
-          tokens[cur]->child2 = i;
+    case TOKEN_BRACKET: {
+      size_t close = tok->child2;
+      if (tok->op == OP_BRACE) parse_statements(i);
+      else parse_expression(i, false);
+      if (cur && tokens[cur]->role != ROLE_OPERATOR && tok->op != OP_BRACE) {
+        // calls and indexing apply to the whole chain of accesses before them
+        size_t p = cur;
+        while (tokens[p]->parent != holder &&
+               tokens[tokens[p]->parent]->op == OP_ACCESS &&
+               tokens[tokens[p]->parent]->child2 == p) {
+          p = tokens[p]->parent;
         }
-        else report_error(i, "missing operator");
+        tok->role = (tok->op == OP_PAREN ? ROLE_CALL : ROLE_ACCESS);
+        tok->child2 = tok->child1;
+        tok->child1 = p;
+        replace_node(holder, root, p, i);
+        cur = i;
       } else {
-        parse_expression(i, false);
-        if (!cur) cur = i;
-        else if (tokens[cur]->role == ROLE_OPERATOR && !tokens[cur]->child2) {
-          tokens[cur]->child2 = i;
-        } else {
-          size_t p = cur;
-          for (; tokens[p]->type == TOKEN_OP; p = tokens[p]->child2);
-          tok->role = (tok->op == OP_PAREN ? ROLE_CALL : ROLE_ACCESS);
-          tok->child2 = tok->child1;
-          tok->child1 = p;
-          size_t parent = tokens[p]->parent;
-          tok->parent = parent;
-          tokens[p]->parent = i;
-          if (p == cur) cur = i;
-          if (tokens[parent]->child1 == p) tokens[parent]->child1 = i;
-          if (tokens[parent]->child2 == p) tokens[parent]->child2 = i;
-        }
+        tok->role = ROLE_OPERAND;
+        attach_operand(holder, root, cur, i);
       }
-      cur = i;
-      i = tok->child2;
-      break;
+      i = close;
+    } break;
     case TOKEN_COMMA:
       tok->op = OP_COMMA;
+    case TOKEN_STATEMENT_OP:
     case TOKEN_OP:
+      if (tok->type == TOKEN_STATEMENT_OP && !toplevel) {
+        report_error(i, "unexpected assignment in expression");
+      }
       tok->role = ROLE_OPERATOR;
-      if (!cur) report_error(i, "missing left operand"); // TODO: unary
-      else if (tokens[cur]->role == ROLE_OPERATOR) report_error(i, "unexpected operator");
-      else if (tokens[cur]->role == ROLE_OPERAND) {
-        while (tokens[tokens[cur]->parent]->role == ROLE_OPERATOR &&
-               (tokens[tokens[cur]->parent]->op >> 4) <= (tok->op >> 4)) {
+      if (!cur || (tokens[cur]->role == ROLE_OPERATOR && !tokens[cur]->child2)) {
+        if (tok->type != TOKEN_OP) {
+          report_error(i, "missing left operand");
+          break;
+        }
+        switch (tok->op) {
+        case OP_ADD: tok->op = OP_UNARY_PLUS; break;
+        case OP_SUB: tok->op = OP_UNARY_MINUS; break;
+        case OP_NOT:
+        case OP_UNARY_NOT:
+        case OP_BIT_NOT:
+          break;
+        default:
+          report_error(i, "missing left operand");
+          continue;
+        }
+        attach_operand(holder, root, cur, i);
+      } else if (tok->op == OP_CHECK_NULL || tok->op == OP_INC || tok->op == OP_DEC) {
+        // postfix operators bind as tightly as calls
+        size_t p = cur;
+        while (tokens[p]->parent != holder &&
+               tokens[tokens[p]->parent]->op == OP_ACCESS &&
+               tokens[tokens[p]->parent]->child2 == p) {
+          p = tokens[p]->parent;
+        }
+        tok->role = ROLE_EXPRESSION;
+        tok->child1 = p;
+        replace_node(holder, root, p, i);
+        cur = i;
+      } else {
+        size_t op = i;
+        if (tok->op == OP_NOT && i+1 < end && tokens[i+1]->type == TOKEN_OP &&
+            tokens[i+1]->op == OP_IN) {
+          tok->op = OP_NOT_IN;
+          tokens[i+1]->role = ROLE_OPERATOR;
+          tokens[i+1]->parent = op;
+          i++;
+        }
+        while (tokens[cur]->parent != holder &&
+               tokens[tokens[cur]->parent]->role == ROLE_OPERATOR &&
+               precedence(tokens[cur]->parent) <= precedence(op)) {
           cur = tokens[cur]->parent;
         }
-        tok->parent = tokens[cur]->parent;
-        if (tok->parent == start) tokens[start]->child1 = i;
-        else tokens[tok->parent]->child2 = i;
         tok->child1 = cur;
-        tokens[cur]->parent = i;
-        cur = i;
+        replace_node(holder, root, cur, op);
+        cur = op;
       }
       break;
-    case TOKEN_STATEMENT_OP:
-      if (!toplevel) report_error(i, "unexpected assignment in expression");
-      break;
     default:
       report_error(i, "unexpected token");
     }
   }
+  if (cur && tokens[cur]->role == ROLE_OPERATOR && !tokens[cur]->child2) {
+    report_error(cur, "missing right operand");
+  }
+  return root;
+}
+
+void CompilationUnit::parse_expression(size_t start, bool toplevel) {
+  tokens[start]->child1 = parse_range(start, start+1, tokens[start]->child2, toplevel);
+}
+
+size_t CompilationUnit::find_semicolon(size_t start, size_t end) {
+  for (size_t i = start; i < end; i++) {
+    if (tokens[i]->type == TOKEN_SEMICOLON) return i;
+    if (tokens[i]->type == TOKEN_BRACKET) i = tokens[i]->child2;
+  }
+  return end;
+}
+
+size_t CompilationUnit::find_brace(size_t start, size_t end) {
+  for (size_t i = start; i < end; i++) {
+    if (tokens[i]->type == TOKEN_SEMICOLON) return end;
+    if (tokens[i]->type != TOKEN_BRACKET) continue;
+    if (tokens[i]->op == OP_BRACE) return i;
+    i = tokens[i]->child2;
+  }
+  return end;
+}
+
+bool CompilationUnit::expect(size_t i, TokenType type, const char* msg) {
+  if (tokens[i]->type == type) return true;
+  report_error(i, msg);
+  return false;
+}
+
+#define SKIP_STATEMENT() {             \
+  i = find_semicolon(i, end) + 1;      \
+  return 0;                            \
+}
+
+#define PARSE_BODY(body) {             \
+  tokens[(body)]->role = ROLE_BLOCK;   \
+  tokens[(body)]->parent = head;       \
+  tok->child2 = (body);                \
+  parse_statements((body));            \
+  i = tokens[(body)]->child2 + 1;      \
+}
+
+size_t CompilationUnit::parse_statement(size_t block, size_t& i) {
+  size_t end = tokens[block]->child2;
+  size_t head = i;
+  auto tok = tokens[i];
+  switch (tok->type) {
+  case TOKEN_SEMICOLON:
+    i++;
+    return 0;
+  case TOKEN_BRACKET:
+    if (tok->op != OP_BRACE) break;
+    tok->role = ROLE_BLOCK;
+    parse_statements(i);
+    i = tok->child2 + 1;
+    return head;
+  case TOKEN_BREAK:
+  case TOKEN_CONTINUE:
+    // semicolon
+    tok->role = ROLE_STATEMENT;
+    i++;
+    if (!expect(i, TOKEN_SEMICOLON, "expected semicolon")) SKIP_STATEMENT();
+    tokens[i++]->parent = head;
+    return head;
+  case TOKEN_CLASS:
+  case TOKEN_WITH:
+    report_error(i, "unsupported statement");
+    SKIP_STATEMENT();
+  case TOKEN_DO: {
+    // block while expression semicolon
+    tok->role = ROLE_STATEMENT;
+    i++;
+    if (tokens[i]->op != OP_BRACE) {
+      report_error(i, "expected block");
+      SKIP_STATEMENT();
+    }
+    PARSE_BODY(i);
+    if (!expect(i, TOKEN_WHILE, "expected while")) SKIP_STATEMENT();
+    tokens[i]->parent = head;
+    tokens[i]->role = ROLE_STATEMENT;
+    size_t semi = find_semicolon(i, end);
+    if (semi == end) {
+      report_error(i, "expected semicolon");
+      SKIP_STATEMENT();
+    }
+    tok->child1 = parse_range(head, i+1, semi, false);
+    tokens[semi]->parent = head;
+    i = semi + 1;
+    return head;
+  }
+  case TOKEN_ELSE:
+    // block
+    tok->role = ROLE_STATEMENT;
+    i++;
+    if (tokens[i]->op != OP_BRACE) {
+      report_error(i, "expected block");
+      SKIP_STATEMENT();
+    }
+    PARSE_BODY(i);
+    return head;
+  case TOKEN_ENUM:
+  case TOKEN_STRUCT: {
+    // identifier block
+    tok->role = ROLE_STATEMENT;
+    i++;
+    if (!expect(i, TOKEN_IDENT, "expected name")) SKIP_STATEMENT();
+    tok->child1 = i;
+    tokens[i++]->parent = head;
+    if (tokens[i]->op != OP_BRACE) {
+      report_error(i, "expected block");
+      SKIP_STATEMENT();
+    }
+    size_t body = i;
+    tokens[body]->role = ROLE_BLOCK;
+    tokens[body]->parent = head;
+    tok->child2 = body;
+    if (tok->type == TOKEN_STRUCT) parse_statements(body);
+    else parse_expression(body, false);
+    i = tokens[body]->child2 + 1;
+    return head;
+  }
+  case TOKEN_FUNCTION: {
+    // identifier (params) (: expression) block
+    tok->role = ROLE_STATEMENT;
+    i++;
+    if (!expect(i, TOKEN_IDENT, "expected function name")) SKIP_STATEMENT();
+    size_t name = i++;
+    tok->child1 = name;
+    tokens[name]->parent = head;
+    if (tokens[i]->op != OP_PAREN) {
+      report_error(i, "expected parameter list");
+      SKIP_STATEMENT();
+    }
+    parse_expression(i, false);
+    tokens[name]->child1 = i;
+    tokens[i]->parent = name;
+    i = tokens[i]->child2 + 1;
+    size_t body = find_brace(i, end);
+    if (body == end) {
+      report_error(head, "expected function body");
+      SKIP_STATEMENT();
+    }
+    if (tokens[i]->type == TOKEN_OP && tokens[i]->op == OP_COLON) {
+      tokens[i]->parent = name;
+      tokens[name]->child2 = parse_range(name, i+1, body, false);
+    } else if (i != body) {
+      report_error(i, "expected return type or function body");
+    }
+    if (lazy) {
+      // brace matching already gives us the extent, so skip to the end
+      tokens[body]->role = ROLE_UNPARSED;
+      tokens[body]->parent = head;
+      tok->child2 = body;
+      i = tokens[body]->child2 + 1;
+      return head;
+    }
+    PARSE_BODY(body);
+    return head;
+  }
+  case TOKEN_IMPORT:
+    // str semicolon
+    tok->role = ROLE_STATEMENT;
+    i++;
+    if (!expect(i, TOKEN_STR, "expected module name")) SKIP_STATEMENT();
+    tok->child1 = i;
+    tokens[i++]->parent = head;
+    if (!expect(i, TOKEN_SEMICOLON, "expected semicolon")) SKIP_STATEMENT();
+    tokens[i++]->parent = head;
+    return head;
+  case TOKEN_CASE:
+  case TOKEN_ELIF:
+  case TOKEN_FOR:
+  case TOKEN_IF:
+  case TOKEN_SWITCH:
+  case TOKEN_WHILE: {
+    // expression block
+    tok->role = ROLE_STATEMENT;
+    i++;
+    size_t body = find_brace(i, end);
+    if (body == end) {
+      report_error(head, "expected block");
+      SKIP_STATEMENT();
+    }
+    if (tok->type == TOKEN_FOR && i + 1 < body && tokens[i]->type == TOKEN_IDENT &&
+        tokens[i+1]->type == TOKEN_OP && tokens[i+1]->op == OP_IN) {
+      // `in` takes everything after it, however loosely that binds
+      size_t in = i + 1;
+      tokens[i]->role = ROLE_OPERAND;
+      tokens[i]->parent = in;
+      tokens[in]->role = ROLE_OPERATOR;
+      tokens[in]->parent = head;
+      tokens[in]->child1 = i;
+      tokens[in]->child2 = parse_range(in, in + 1, body, false);
+      if (!tokens[in]->child2) report_error(in, "missing right operand");
+      tok->child1 = in;
+    } else {
+      tok->child1 = parse_range(head, i, body, false);
+      if (!tok->child1) report_error(head, "expected expression");
+    }
+    PARSE_BODY(body);
+    return head;
+  }
+  case TOKEN_DEFER:
+    // statement
+    tok->role = ROLE_STATEMENT;
+    i++;
+    if (tokens[i]->type == TOKEN_DEFER) {
+      // which would otherwise recurse once for each
+      report_error(i, "defer of a defer");
+      SKIP_STATEMENT();
+    }
+    tok->child1 = parse_statement(block, i);
+    if (tok->child1) tokens[tok->child1]->parent = head;
+    else report_error(head, "expected statement");
+    return head;
+  case TOKEN_DELETE:
+  case TOKEN_RETURN:
+  case TOKEN_YIELD: {
+    // expression semicolon
+    tok->role = ROLE_STATEMENT;
+    i++;
+    size_t semi = find_semicolon(i, end);
+    if (semi == end) {
+      report_error(head, "expected semicolon");
+      SKIP_STATEMENT();
+    }
+    tok->child1 = parse_range(head, i, semi, false);
+    tokens[semi]->parent = head;
+    i = semi + 1;
+    return head;
+  }
+  default:
+    break;
+  }
+  // expression semicolon
+  // The semicolon stands in for the statement so that assignments and
+  // calls can be walked the same way as keyword statements.
+  size_t semi = find_semicolon(i, end);
+  if (semi == end) {
+    report_error(i, "expected semicolon");
+    i = end;
+    return 0;
+  }
+  tokens[semi]->role = ROLE_STATEMENT;
+  tokens[semi]->op = OP_SEMICOLON;
+  tokens[semi]->child1 = parse_range(semi, i, semi, true);
+  i = semi + 1;
+  return semi;
 }
 
+#undef SKIP_STATEMENT
+#undef PARSE_BODY
+
 void CompilationUnit::parse_statements(size_t start) {
-  size_t cur = 0;
-  size_t statement_start = 0;
-  for (size_t i = start+1; i < tokens[start]->child2; i++) {
-    auto tok = tokens[i];
-    if (tok->parent != start) continue;
+  size_t prev = 0;
+  size_t i = start+1;
+  while (i < tokens[start]->child2) {
+    size_t head = parse_statement(start, i);
+    if (!head) continue;
+    TokenType type = tokens[head]->type;
+    if (type == TOKEN_ELIF || type == TOKEN_ELSE) {
+      TokenType prev_type = (prev ? tokens[prev]->type : TOKEN_NULL);
+      if (prev_type != TOKEN_IF && prev_type != TOKEN_ELIF &&
+          !(type == TOKEN_ELSE && prev_type == TOKEN_CASE)) {
+        report_error(head, "else without if");
+      }
+    }
+    if (prev) tokens[prev]->next = head;
+    else tokens[start]->child1 = head;
+    prev = head;
+  }
+}
+
+void CompilationUnit::check_depth(size_t first, size_t last) {
+  // A long chain of operators is as deep as it is long. Each token's depth
+  // is its parent's plus one, found by walking up to the nearest known one.
+  // Lists are flattened without recursing, so commas don't count.
+  std::vector<uint32_t> depth(last - first + 1, 0);
+  depth[0] = 1;
+  std::vector<size_t> path;
+  for (size_t i = first + 1; i <= last; i++) {
+    size_t t = i;
+    for (; t > first && t <= last && !depth[t - first]; t = tokens[t]->parent) {
+      path.push_back(t);
+    }
+    uint32_t d = (t >= first && t <= last ? depth[t - first] : 1);
+    for (; !path.empty(); path.pop_back()) {
+      if (tokens[path.back()]->type != TOKEN_COMMA) d++;
+      depth[path.back() - first] = d;
+    }
+    if (depth[i - first] > max_depth) {
+      report_error(i, "expression nested too deeply");
+      return;
+    }
+  }
+}
+
+bool CompilationUnit::parse_body(size_t fn) {
+  size_t body = tokens[fn]->child2;
+  if (tokens[body]->role != ROLE_UNPARSED) return true;
+  size_t before = error_count;
+  tokens[body]->role = ROLE_BLOCK;
+  parse_statements(body);
+  if (error_count == before) check_depth(body, tokens[body]->child2);
+  return error_count == before;
+}
+
+void CompilationUnit::parse(bool lazy) {
+  this->lazy = lazy;
+  match_brackets();
+  if (!errors) parse_statements(0);
+  if (!errors) check_depth(0, tokens.size()-1);
+  if (!errors) status = UNIT_PARSE;
+}
+
+void CompilationUnit::parse_bodies() {
+  if (status != UNIT_PARSE) return;
+  for (size_t s = tokens[0]->child1; s; s = tokens[s]->next) {
+    if (tokens[s]->type == TOKEN_FUNCTION) parse_body(s);
+  }
+}
+
+std::vector<std::filesystem::path> CompilationUnit::imported_files() {
+  std::vector<std::filesystem::path> ret;
+  if (status < UNIT_PARSE || status == UNIT_ERROR) return ret;
+  for (size_t s = tokens[0]->child1; s; s = tokens[s]->next) {
+    if (tokens[s]->type != TOKEN_IMPORT) continue;
+    String name = tokens[tokens[s]->child1]->text;
+    // strip the quotes
+    std::string path(name.data+1, name.count-2);
+    ret.push_back((filename.parent_path() / path).lexically_normal());
+  }
+  return ret;
+}
+
+void CompilationUnit::dump_outline() {
+  std::cout << filename << std::endl;
+  if (status != UNIT_PARSE) return;
+  for (size_t s = tokens[0]->child1; s; s = tokens[s]->next) {
+    auto tok = tokens[s];
+    size_t end;
     switch (tok->type) {
-    case TOKEN_BRACKET:
-      if (tok->op == OP_BRACE) parse_statements(i);
-      else parse_expression(i, true);
-      i = tok->child2;
-      break;
-    case TOKEN_BREAK:
-    case TOKEN_CONTINUE:
-      // (identifier) semicolon
-      break;
-    case TOKEN_CASE:
-      break;
-    case TOKEN_CLASS:
-      break;
-    case TOKEN_DELETE:
-      break;
-    case TOKEN_DO:
-      break;
-    case TOKEN_ELIF:
-      break;
-    case TOKEN_ELSE:
+    case TOKEN_IMPORT:
+      end = tokens[tok->child1]->byte_number + tokens[tok->child1]->text.count;
       break;
     case TOKEN_ENUM:
-    case TOKEN_STRUCT:
-      // identifier block
-      break;
     case TOKEN_FUNCTION:
-      break;
-    case TOKEN_IMPORT:
-      // str semicolon
-      break;
-    case TOKEN_SEMICOLON:
-      break;
-    case TOKEN_FOR:
-    case TOKEN_SWITCH:
-    case TOKEN_WHILE:
-      // (identifier) expression block
-      break;
-    case TOKEN_WITH:
-      break;
-    case TOKEN_DEFER:
-    case TOKEN_RETURN:
-    case TOKEN_YIELD:
-      // expression semicolon
+    case TOKEN_STRUCT:
+      end = tokens[tok->child2]->byte_number;
       break;
     default:
-      // expression piece
-      ;
+      continue;
+    }
+    // print the declaration as written, minus the line breaks
+    std::cout << "  ";
+    bool space = false;
+    for (size_t i = tok->byte_number; i < end; i++) {
+      if (get_type(text[i]) == CHAR_SPACE) {
+        space = true;
+        continue;
+      }
+      if (space) std::cout << ' ';
+      space = false;
+      std::cout << text[i];
     }
+    std::cout << std::endl;
   }
 }
-
-void CompilationUnit::parse() {
-  match_brackets();
-  if (!errors) parse_statements(0);
-}
@@ -1,9 +1,16 @@
 #ifndef __VOOM_COMPILATION_UNIT_H__
 #define __VOOM_COMPILATION_UNIT_H__
 
+#include "bytecode.h"
 #include "string.h"
+#include "types.h"
 
+#include <atomic>
 #include <filesystem>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
 #include <vector>
 
 enum UnitStatus {
@@ -19,6 +26,7 @@ class CompilationUnit {
 private:
   char* text = nullptr;
   size_t length = 0;
+  bool read_source();
 
   enum TokenType {
     TOKEN_NULL,
@@ -38,6 +46,7 @@ private:
     TOKEN_FOR,
     TOKEN_FUNCTION,
     TOKEN_IDENT,
+    TOKEN_IF,
     TOKEN_IMPORT,
     TOKEN_NUM,
     TOKEN_OP,
@@ -71,7 +80,7 @@ private:
     OP_SUB         = 0x31,
     // shifts
     OP_LSHIFT      = 0x40,
-    OP_RSHIFT      = 0x40,
+    OP_RSHIFT      = 0x41,
     // bitwise
     OP_BIT_AND     = 0x50,
     OP_BIT_OR      = 0x51,
@@ -118,6 +127,8 @@ private:
     ROLE_BLOCK,
     ROLE_CALL,
     ROLE_ACCESS,
+    // a function body that parse_body() hasn't reached yet
+    ROLE_UNPARSED,
   };
 
   struct Token {
@@ -127,27 +138,235 @@ private:
     size_t parent = 0;
     size_t child1 = 0;
     size_t child2 = 0;
-    TokenType type;
-    Operator op;
-    TokenRole role;
+    // next statement in the enclosing block
+    size_t next = 0;
+    TokenType type = TOKEN_NULL;
+    Operator op = OP_UNK;
+    TokenRole role = ROLE_OPERAND;
+    // set by the type checker on expression nodes
+    TypeId value_type = TypeTable::null_type;
   };
   std::vector<Token*> tokens;
+  // leave function bodies for parse_body()
+  bool lazy = false;
   void report_error(size_t token_index, const char* msg);
   void check_keyword();
   void check_operator();
+  int precedence(size_t token_index);
+  void attach_operand(size_t holder, size_t& root, size_t& cur, size_t i);
+  void replace_node(size_t holder, size_t& root, size_t old, size_t node);
+  size_t parse_range(size_t holder, size_t start, size_t end, bool toplevel);
   void parse_expression(size_t parent, bool toplevel);
+  size_t find_semicolon(size_t start, size_t end);
+  size_t find_brace(size_t start, size_t end);
+  bool expect(size_t i, TokenType type, const char* msg);
+  size_t parse_statement(size_t block, size_t& i);
   void parse_statements(size_t parent);
+  bool parse_body(size_t fn);
+  // reports trees too deep for the phases that recurse on them
+  void check_depth(size_t first, size_t last);
   void match_brackets();
   void dump_token(size_t, Token*);
+
+  enum SymbolKind {
+    SYMBOL_VAR,
+    SYMBOL_FUNCTION,
+    SYMBOL_TYPE,
+  };
+
+  struct Symbol {
+    SymbolKind kind;
+    TypeId type;
+    size_t token;
+    CompilationUnit* unit = nullptr;
+  };
+
+  struct CheckContext {
+    std::vector<std::map<std::string, Symbol>> scopes;
+    TypeId return_type = TypeTable::void_type;
+    // what a generator yields, null elsewhere
+    TypeId yield_type = TypeTable::null_type;
+    int loop_depth = 0;
+    // in a deferred statement, which can't return
+    bool deferred = false;
+  };
+
+  std::map<std::string, Symbol> globals;
+  // mapped by open_interface()
+  char* interface_data = nullptr;
+  size_t interface_size = 0;
+  // FUNCTION tokens, plus 0 for the top-level statements
+  std::vector<size_t> functions;
+
+  std::string token_string(size_t i);
+  void flatten_commas(size_t tok, std::vector<size_t>& out);
+  const Symbol* lookup_global(const std::string& name);
+  const Symbol* lookup(CheckContext& ctx, const std::string& name);
+  void declare(CheckContext& ctx, size_t name, SymbolKind kind, TypeId type);
+  bool assignable(TypeId from, TypeId to);
+  TypeId resolve_type(size_t tok);
+  TypeId binary_type(Operator op, TypeId a, TypeId b);
+  TypeId check_builtin_call(CheckContext& ctx, size_t call, const std::string& name);
+  TypeId check_call(CheckContext& ctx, size_t call);
+  TypeId check_access(CheckContext& ctx, size_t tok);
+  bool iterated(size_t tok);
+  TypeId check_pipe(CheckContext& ctx, size_t tok);
+  TypeId check_operator_types(CheckContext& ctx, size_t tok);
+  TypeId check_expression(CheckContext& ctx, size_t tok, TypeId expected);
+  void check_assignment(CheckContext& ctx, size_t tok);
+  void check_statement(CheckContext& ctx, size_t stmt);
+  void check_block(CheckContext& ctx, size_t block);
+  bool always_returns(size_t stmt);
+  bool breaks_out(size_t stmt);
+
+  struct EmitContext {
+    Program* program;
+    Function* fn;
+    // variable name -> register
+    std::vector<std::map<std::string, uint32_t>> scopes;
+    uint32_t next_register = 0;
+    TypeId return_type = TypeTable::void_type;
+    TypeId yield_type = TypeTable::null_type;
+    // jumps to patch once the enclosing loop is finished
+    std::vector<std::vector<size_t>> breaks;
+    std::vector<std::vector<size_t>> continues;
+    // the frame register and function of each enclosing loop over a
+    // generator, whose frame a return has to free
+    std::vector<std::pair<uint32_t, uint32_t>> generators;
+    // What leaving each enclosing block takes: its deferred statements,
+    // newest last, then a RELEASE if anything was put in its region. The
+    // MARK at the start and each RELEASE are NOPs until then.
+    struct Cleanup {
+      std::vector<size_t> defers;
+      // how many of scopes a deferred statement sees
+      size_t scopes = 0;
+      // the register the region is marked in, -1 without regions
+      int32_t mark = -1;
+      size_t mark_at = 0;
+      std::vector<size_t> releases;
+      bool used = false;
+    };
+    std::vector<Cleanup> cleanups;
+    // cleanups.size() at the start of each enclosing loop
+    std::vector<size_t> loop_cleanups;
+    // generators keep no regions, since they suspend in the middle of one
+    bool regions = false;
+    // allocations that don't outlive the block they're made in
+    std::set<size_t> local;
+  };
+
+  // a constant that a switch or `in` dispatches on, and which of the
+  // caller's jump lists a match goes to
+  struct CaseKey {
+    int64_t value = 0;
+    std::string text;
+    size_t target = 0;
+  };
+
+  TypeKind kind_of(size_t tok);
+  uint32_t alloc_register(EmitContext& ctx);
+  size_t emit(EmitContext& ctx, Opcode op, int32_t a, int32_t b, int32_t c, size_t tok);
+  void patch(EmitContext& ctx, size_t jump);
+  int32_t local_register(EmitContext& ctx, size_t name);
+  void declare_local(EmitContext& ctx, size_t name, uint32_t reg);
+  Opcode arith_opcode(Operator op, TypeKind kind);
+  void emit_zero(EmitContext& ctx, uint32_t dest, TypeId type, size_t tok);
+  void emit_constant(EmitContext& ctx, size_t tok, uint32_t dest);
+  void emit_int(EmitContext& ctx, uint32_t dest, int64_t v, size_t tok);
+  bool case_key(EmitContext& ctx, size_t tok, TypeKind kind, CaseKey& key);
+  void emit_search(EmitContext& ctx, uint32_t value, const std::vector<CaseKey>& keys, size_t lo, size_t hi,
+                   std::vector<std::vector<size_t>>& jumps, size_t tok);
+  bool emit_hashed(EmitContext& ctx, uint32_t value, const std::vector<CaseKey>& keys,
+                   std::vector<std::vector<size_t>>& jumps, size_t tok);
+  void emit_dispatch(EmitContext& ctx, uint32_t value, TypeKind kind, std::vector<CaseKey> keys,
+                     std::vector<std::vector<size_t>>& jumps, size_t tok);
+  bool emit_in_constants(EmitContext& ctx, size_t tok, uint32_t dest);
+  bool cheap(EmitContext& ctx, size_t tok);
+  uint32_t emit_value(EmitContext& ctx, size_t tok);
+  uint32_t emit_value_typed(EmitContext& ctx, size_t tok, TypeId target);
+  void emit_into(EmitContext& ctx, size_t tok, uint32_t dest);
+  void emit_typed(EmitContext& ctx, size_t tok, uint32_t dest, TypeId target);
+  void emit_access(EmitContext& ctx, size_t tok, uint32_t dest);
+  void emit_comparison(EmitContext& ctx, size_t tok, uint32_t dest);
+  void emit_operator(EmitContext& ctx, size_t tok, uint32_t dest);
+  void emit_call(EmitContext& ctx, size_t tok, uint32_t dest);
+  void emit_assignment(EmitContext& ctx, size_t tok);
+  void emit_loop_end(EmitContext& ctx, size_t body, size_t cond_at);
+  void emit_iteration(EmitContext& ctx, size_t seq, size_t tok, const std::function<void(uint32_t)>& each);
+  void emit_stage(EmitContext& ctx, size_t pipe, const std::function<void(uint32_t)>& each);
+  void emit_for(EmitContext& ctx, size_t stmt);
+  void emit_switch(EmitContext& ctx, size_t stmt);
+  bool allocates(size_t tok);
+  void visit_values(size_t tok, bool consumed, const std::function<void(size_t, bool)>& use);
+  void find_local_variable(EmitContext& ctx, size_t stmt);
+  bool local(EmitContext& ctx, size_t tok);
+  void open_cleanup(EmitContext& ctx, size_t tok);
+  void emit_cleanup(EmitContext& ctx, size_t index, size_t tok);
+  void emit_cleanups(EmitContext& ctx, size_t depth, size_t tok);
+  void close_cleanup(EmitContext& ctx, size_t tok);
+  uint32_t emit_loop_condition(EmitContext& ctx, size_t cond);
+  size_t emit_statement(EmitContext& ctx, size_t stmt);
+  void emit_block(EmitContext& ctx, size_t block);
+  void emit_function(Program& program, size_t index);
 public:
   std::filesystem::path filename;
   UnitStatus status = UNIT_NULL;
-  bool errors = false;
+  std::atomic<bool> errors = false;
+  std::vector<CompilationUnit*> imports;
+  uint64_t source_hash = 0;
+  // source_hash combined with the key of every import, 0 if not known
+  uint64_t key = 0;
+  bool from_interface = false;
   CompilationUnit(std::filesystem::path filename);
+  // source that isn't in a file (the fuzzer's), so it can't be released
+  CompilationUnit(std::filesystem::path filename, const char* source, size_t length);
   ~CompilationUnit();
+
+  // The source and tokens are only needed while a phase works on the unit.
+  // Other units see just its globals, imports and key, which stay, so the
+  // rest can be released in between and read and parsed again when the
+  // next phase comes to it.
+  bool loaded() const { return text != nullptr; }
+  // roughly what release_source() frees
+  size_t source_bytes();
+  void release_source();
+  // back to the state release_source() left, false on errors
+  bool reload_source();
   void tokenize();
   void dumpTokens();
-  void parse();
+  // With lazy set, only declarations and signatures are parsed here and
+  // each function body is parsed the first time something needs it.
+  void parse(bool lazy = false);
+  void parse_bodies();
+  std::vector<std::filesystem::path> imported_files();
+  void dump_outline();
+
+  // Type checking happens in three phases so that every unit knows the
+  // names and then the signatures of everything it imports before any
+  // function body is looked at. Bodies only read the unit's globals, so
+  // check_function() may be called for several functions at once.
+  void declare_types();
+  void check_signatures();
+  size_t function_count();
+  void check_function(size_t index);
+  void finish_typecheck();
+
+  // Lowering to bytecode. Every unit declares its functions before any
+  // are emitted, so calls across units can refer to them by index.
+  void declare_functions(Program& program);
+  void emit_functions(Program& program);
+
+  // Module interfaces hold the exported declarations of a checked unit,
+  // so importers can map them in instead of parsing the source.
+  void compute_key();
+  std::filesystem::path interface_path();
+  // Returns false if there is no usable interface for the current source.
+  // Otherwise fills in the imports it was built against, which the caller
+  // must check before calling read_interface().
+  bool open_interface(std::vector<std::pair<std::filesystem::path, uint64_t>>& deps);
+  void read_interface();
+  void close_interface();
+  bool write_interface();
 };
 
 #endif
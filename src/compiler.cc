@@ -1,34 +1,276 @@
 #include "compiler.h"
+#include "heap.h"
+#include "native.h"
+
+#include <sys/resource.h>
+
+#include <atomic>
+#include <functional>
+#include <set>
+#include <thread>
 
 Compiler::Compiler(String start_file) {
-  maybe_add_file(start_file);
+  std::string s(start_file.data, start_file.count);
+  maybe_add_file(std::filesystem::path(s).lexically_normal());
 }
 
 Compiler::~Compiler() {
+  for (auto& cu : compilation_units) delete cu;
+}
+
+bool Compiler::use(CompilationUnit* cu) {
+  auto found = resident_at.find(cu);
+  if (found != resident_at.end()) {
+    resident.splice(resident.begin(), resident, found->second);
+    return true;
+  }
+  if (cu->from_interface || cu->status == UNIT_ERROR) return !cu->errors;
+  if (!cu->loaded()) {
+    reloaded++;
+    if (!cu->reload_source()) return false;
+  }
+  size_t bytes = cu->source_bytes();
+  footprint[cu] = bytes;
+  resident.push_front({cu, bytes});
+  resident_at[cu] = resident.begin();
+  resident_bytes += bytes;
+  // this one stays, even if it is over the budget on its own
+  while (memory_budget && resident_bytes > memory_budget && resident.size() > 1) {
+    release(resident.back().first);
+  }
+  return true;
+}
+
+void Compiler::release(CompilationUnit* cu) {
+  auto found = resident_at.find(cu);
+  if (found != resident_at.end()) {
+    resident_bytes -= found->second->second;
+    resident.erase(found->second);
+    resident_at.erase(found);
+  }
+  // a unit with errors is never read back, so its messages keep their tokens
+  if (cu->errors || !cu->loaded()) return;
+  cu->release_source();
+  released++;
+}
+
+static size_t peak_rss() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  // in kilobytes
+  return usage.ru_maxrss / 1024;
+}
+
+void Compiler::print_memory(std::ostream& out) {
+  out << "units       " << compilation_units.size() << " loaded, " << released << " released, ";
+  out << reloaded << " reloaded" << std::endl;
+  out << "peak rss    " << peak_rss() << " MB";
+  if (memory_budget) out << " (budget " << (memory_budget >> 20) << " MB)";
+  out << std::endl;
+}
+
+void Compiler::load_source(CompilationUnit* cu) {
+  cu->tokenize();
+  if (cu->errors) {
+    std::cout << cu->filename << " HAS ERRORS" << std::endl;
+  }
+  // function bodies get parsed by whichever checker thread gets to them
+  cu->parse(true);
+  use(cu);
+  for (auto& path : cu->imported_files()) {
+    cu->imports.push_back(maybe_add_file(path));
+  }
+  cu->compute_key();
+}
+
+void Compiler::load() {
+  // the start file itself always comes from source
+  load_source(compilation_units[0]);
 }
 
 int Compiler::compile() {
-  for (auto& cu : compilation_units) {
-    std::cout << cu->filename << std::endl;
-    cu->tokenize();
-    if (cu->errors) {
-      std::cout << "HAS ERRORS" << std::endl;
-    }
-    cu->parse();
+  use_interfaces = true;
+  load();
+  check_declarations();
+  bool errors = false;
+  check_bodies(compilation_units, [&](CompilationUnit* cu) {
+    cu->write_interface();
     cu->dumpTokens();
+    errors = errors || cu->errors;
+    // the interface is all that importers need from now on
+    release(cu);
+  });
+  return errors ? 1 : 0;
+}
+
+int Compiler::outline() {
+  load();
+  bool errors = false;
+  for (auto& cu : compilation_units) {
+    use(cu);
+    cu->dump_outline();
+    errors = errors || cu->errors;
+  }
+  return errors ? 1 : 0;
+}
+
+bool Compiler::lower(Program& program, PassManager& passes) {
+  // the backends need every body, so interfaces are no use here
+  load();
+  check_declarations();
+  bool errors = false;
+  for (auto& cu : compilation_units) errors = errors || cu->errors;
+  // Every function gets its index before any are emitted, so that calls
+  // across units can refer to them.
+  for (auto& cu : compilation_units) {
+    if (!errors && use(cu)) cu->declare_functions(program);
   }
+  // Bodies with errors are still checked, to report them all. Imports
+  // come first, so whatever a unit calls is already optimized when it is.
+  std::vector<CompilationUnit*> order = dependency_order();
+  check_bodies(order, [&](CompilationUnit* cu) {
+    errors = errors || cu->errors;
+    if (errors) return;
+    cu->emit_functions(program);
+    errors = errors || cu->errors;
+    // the bytecode is all that's needed from now on
+    release(cu);
+    if (errors) return;
+    // only one unit's IR is held at a time
+    passes.run(program, program.function_index[{cu, 0}], cu->function_count());
+  });
+  if (errors) return false;
+  // imports run their top-level code before their importers
+  for (auto& cu : order) program.init.push_back(program.function_index[{cu, 0}]);
+  return true;
+}
+
+int Compiler::run() {
+  Program program;
+  PassManager passes;
+  add_default_passes(passes);
+  if (!lower(program, passes)) return 1;
+  Heap heap;
+  heap.plain = plain_malloc;
+  int status = interpret(program, heap);
+  if (heap_stats) heap.print_stats(std::cerr);
+  return status;
+}
+
+int Compiler::optimize() {
+  Program program;
+  PassManager passes;
+  add_default_passes(passes);
+  if (!lower(program, passes)) return 1;
+  passes.print_stats(std::cout);
+  print_memory(std::cout);
+  return 0;
+}
+
+int Compiler::build() {
+  Program program;
+  PassManager passes;
+  add_default_passes(passes);
+  if (!lower(program, passes)) return 1;
+  std::filesystem::path out = compilation_units[0]->filename;
+  out.replace_extension();
+  if (out == compilation_units[0]->filename) out += ".out";
+  NativeStats stats;
+  if (!write_native(program, out, stats)) return 1;
+  std::cout << out.string() << ": " << stats.functions << " functions, ";
+  std::cout << stats.code_bytes << " bytes of code in " << stats.seconds * 1000 << " ms (";
+  std::cout << (size_t)(stats.functions / stats.seconds) << " functions/s)" << std::endl;
   return 0;
 }
 
-void Compiler::maybe_add_file(String filename) {
-  std::string s(filename.data, filename.count);
-  std::filesystem::path p(s);
+void Compiler::check_declarations() {
+  for (auto& cu : compilation_units) {
+    if (use(cu)) cu->declare_types();
+  }
+  for (auto& cu : compilation_units) {
+    if (use(cu)) cu->check_signatures();
+  }
+}
+
+std::vector<CompilationUnit*> Compiler::dependency_order() {
+  std::vector<CompilationUnit*> order;
+  std::set<CompilationUnit*> seen;
+  std::function<void(CompilationUnit*)> visit = [&](CompilationUnit* cu) {
+    if (!seen.insert(cu).second) return;
+    for (auto& unit : cu->imports) visit(unit);
+    order.push_back(cu);
+  };
+  visit(compilation_units[0]);
+  return order;
+}
+
+void Compiler::check_bodies(const std::vector<CompilationUnit*>& units,
+                            const std::function<void(CompilationUnit*)>& checked) {
+  for (size_t first = 0; first < units.size();) {
+    std::vector<CompilationUnit*> batch;
+    size_t bytes = 0;
+    for (; first < units.size(); first++) {
+      CompilationUnit* cu = units[first];
+      size_t need = footprint[cu];
+      if (memory_budget && !batch.empty() && bytes + need > memory_budget) break;
+      bytes += need;
+      batch.push_back(cu);
+    }
+    // Once every signature is known, bodies can be checked in any order.
+    std::vector<std::pair<CompilationUnit*, size_t>> work;
+    for (auto& cu : batch) {
+      if (!use(cu)) continue;
+      for (size_t i = 0; i < cu->function_count(); i++) work.push_back({cu, i});
+    }
+    std::atomic<size_t> next = 0;
+    auto worker = [&]() {
+      for (size_t i = next++; i < work.size(); i = next++) {
+        work[i].first->check_function(work[i].second);
+      }
+    };
+    size_t count = std::min<size_t>(std::thread::hardware_concurrency(), work.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < count; i++) threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads) t.join();
+    for (auto& cu : batch) {
+      cu->finish_typecheck();
+      checked(cu);
+    }
+  }
+}
+
+CompilationUnit* Compiler::maybe_add_file(std::filesystem::path p) {
   // TODO: search directories
-  if (loaded_paths.find(p) != loaded_paths.end()) return;
-  loaded_paths.insert(p);
+  auto found = loaded_paths.find(p);
+  if (found != loaded_paths.end()) return found->second;
   CompilationUnit* cu = new CompilationUnit(p);
+  loaded_paths[p] = cu;
+  compilation_units.push_back(cu);
+  // The start file is added by the constructor, before anything is loaded.
+  if (compilation_units.size() == 1) return cu;
   if (cu->errors) {
     // TODO: report error
+    return cu;
   }
-  compilation_units.push_back(cu);
+  std::vector<std::pair<std::filesystem::path, uint64_t>> deps;
+  if (use_interfaces && cu->open_interface(deps)) {
+    // usable only if everything it was built against is unchanged
+    bool fresh = true;
+    for (auto& dep : deps) {
+      CompilationUnit* unit = maybe_add_file(dep.first);
+      cu->imports.push_back(unit);
+      fresh = fresh && unit->key == dep.second;
+    }
+    if (fresh) {
+      cu->read_interface();
+      // the source was only read to check the interface against it
+      cu->release_source();
+      return cu;
+    }
+    cu->close_interface();
+    cu->imports.clear();
+  }
+  load_source(cu);
+  return cu;
 }
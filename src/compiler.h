@@ -2,7 +2,9 @@
 #define __VOOM_COMPILER_H__
 
 #include "compilation_unit.h"
+#include "ir.h"
 
+#include <list>
 #include <map>
 #include <set>
 #include <vector>
@@ -10,13 +12,60 @@
 class Compiler {
 private:
   std::vector<CompilationUnit*> compilation_units;
-  std::set<std::filesystem::path> loaded_paths;
+  std::map<std::filesystem::path, CompilationUnit*> loaded_paths;
 
-  void maybe_add_file(String filename);
+  // imports are loaded from their interface files when possible
+  bool use_interfaces = false;
+
+  // Units with their source loaded, most recently used first, with what
+  // each holds. Over memory_budget, the least recently used are released.
+  typedef std::list<std::pair<CompilationUnit*, size_t>> Resident;
+  Resident resident;
+  std::map<CompilationUnit*, Resident::iterator> resident_at;
+  size_t resident_bytes = 0;
+  // what each unit held when it was last loaded
+  std::map<CompilationUnit*, size_t> footprint;
+  size_t released = 0;
+  size_t reloaded = 0;
+
+  // loads the unit's source again if it was released, false on errors
+  bool use(CompilationUnit* cu);
+  void release(CompilationUnit* cu);
+  void print_memory(std::ostream& out);
+
+  CompilationUnit* maybe_add_file(std::filesystem::path p);
+  void load_source(CompilationUnit* cu);
+  void load();
+  // types and signatures of every unit
+  void check_declarations();
+  // every unit, after the ones it imports
+  std::vector<CompilationUnit*> dependency_order();
+  // The bodies of `units`, as many at a time as fit in the budget. Each
+  // unit is passed to `checked` once its bodies are, while it is loaded.
+  void check_bodies(const std::vector<CompilationUnit*>& units,
+                    const std::function<void(CompilationUnit*)>& checked);
+  // load, check and lower everything to bytecode, optimizing each unit
+  // as soon as it is, false on errors
+  bool lower(Program& program, PassManager& passes);
 public:
+  // bytes of source and tokens to keep loaded at once, 0 for no limit
+  size_t memory_budget = 0;
+  // run() allocates with plain malloc() and free(), for comparison
+  bool plain_malloc = false;
+  // run() prints what the heap did when the program is done
+  bool heap_stats = false;
+
   Compiler(String start_file);
   ~Compiler();
   int compile();
+  // print the imports and declarations of each unit without parsing bodies
+  int outline();
+  // compile to bytecode and interpret it
+  int run();
+  // optimize the bytecode and report what each pass did
+  int optimize();
+  // compile to a native executable next to the start file
+  int build();
 };
 
 #endif
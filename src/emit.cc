@@ -0,0 +1,1382 @@
+#include "compilation_unit.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+TypeKind CompilationUnit::kind_of(size_t tok) {
+  return type_table.get(tokens[tok]->value_type).kind;
+}
+
+uint32_t CompilationUnit::alloc_register(EmitContext& ctx) {
+  uint32_t r = ctx.next_register++;
+  if (ctx.next_register > ctx.fn->registers) ctx.fn->registers = ctx.next_register;
+  return r;
+}
+
+size_t CompilationUnit::emit(EmitContext& ctx, Opcode op, int32_t a, int32_t b, int32_t c, size_t tok) {
+  Instruction in;
+  in.op = op;
+  in.a = a;
+  in.b = b;
+  in.c = c;
+  ctx.fn->code.push_back(in);
+  ctx.fn->lines.push_back(tokens[tok]->line_number);
+  return ctx.fn->code.size() - 1;
+}
+
+void CompilationUnit::patch(EmitContext& ctx, size_t jump) {
+  ctx.fn->code[jump].c = ctx.fn->code.size();
+}
+
+int32_t CompilationUnit::local_register(EmitContext& ctx, size_t name) {
+  std::string s = token_string(name);
+  for (auto it = ctx.scopes.rbegin(); it != ctx.scopes.rend(); it++) {
+    auto found = it->find(s);
+    if (found != it->end()) return found->second;
+  }
+  return -1;
+}
+
+void CompilationUnit::declare_local(EmitContext& ctx, size_t name, uint32_t reg) {
+  ctx.scopes.back()[token_string(name)] = reg;
+}
+
+Opcode CompilationUnit::arith_opcode(Operator op, TypeKind kind) {
+  bool f = (kind == TYPE_FLOAT);
+  switch (op) {
+  case OP_ADD:
+    if (kind == TYPE_STR) return BC_CONCAT;
+    return f ? BC_ADDF : BC_ADDI;
+  case OP_SUB: return f ? BC_SUBF : BC_SUBI;
+  case OP_MUL: return f ? BC_MULF : BC_MULI;
+  case OP_DIV: return f ? BC_DIVF : BC_DIVI;
+  case OP_MOD: return f ? BC_MODF : BC_MODI;
+  case OP_LSHIFT: return BC_SHL;
+  case OP_RSHIFT: return BC_SHR;
+  case OP_BIT_AND: return BC_BAND;
+  case OP_BIT_OR: return BC_BOR;
+  case OP_BIT_XOR: return BC_BXOR;
+  // bools are 0 or 1, so these don't need their own opcodes
+  case OP_AND: return BC_BAND;
+  case OP_OR: return BC_BOR;
+  case OP_XOR: return BC_NEI;
+  default: return BC_NOP;
+  }
+}
+
+void CompilationUnit::emit_zero(EmitContext& ctx, uint32_t dest, TypeId type, size_t tok) {
+  const Type& t = type_table.get(type);
+  Value v;
+  switch (t.kind) {
+  case TYPE_FLOAT:
+    v.f = 0;
+    emit(ctx, BC_LOADK, dest, ctx.program->add_constant(v), 0, tok);
+    break;
+  case TYPE_STR:
+    emit(ctx, BC_LOADK, dest, ctx.program->add_string("", 0), 0, tok);
+    break;
+  case TYPE_ARRAY:
+    emit(ctx, BC_NEWARRAY, dest, 0, 0, tok);
+    break;
+  case TYPE_NULLABLE:
+  case TYPE_STRUCT:
+    emit(ctx, BC_LOADNULL, dest, null_repr(type), 0, tok);
+    break;
+  default:
+    emit(ctx, BC_LOADI, dest, 0, 0, tok);
+  }
+}
+
+// the contents of a str literal
+static std::string unescape(const std::string& text) {
+  std::string s;
+  for (size_t i = 1; i + 1 < text.size(); i++) {
+    if (text[i] != '\\') {
+      s += text[i];
+      continue;
+    }
+    switch (text[++i]) {
+    case 'n': s += '\n'; break;
+    case 't': s += '\t'; break;
+    case 'r': s += '\r'; break;
+    case '0': s += '\0'; break;
+    default: s += text[i];
+    }
+  }
+  return s;
+}
+
+void CompilationUnit::emit_int(EmitContext& ctx, uint32_t dest, int64_t v, size_t tok) {
+  if (v == (int32_t)v) {
+    emit(ctx, BC_LOADI, dest, v, 0, tok);
+    return;
+  }
+  Value k;
+  k.i = v;
+  emit(ctx, BC_LOADK, dest, ctx.program->add_constant(k), 0, tok);
+}
+
+void CompilationUnit::emit_constant(EmitContext& ctx, size_t tok, uint32_t dest) {
+  auto t = tokens[tok];
+  std::string text = token_string(tok);
+  Value v;
+  switch (t->type) {
+  case TOKEN_NUM:
+    if (t->value_type == TypeTable::float_type) {
+      v.f = std::strtod(text.c_str(), nullptr);
+      emit(ctx, BC_LOADK, dest, ctx.program->add_constant(v), 0, tok);
+    } else {
+      emit_int(ctx, dest, std::strtoll(text.c_str(), nullptr, 0), tok);
+    }
+    break;
+  case TOKEN_STR: {
+    std::string s = unescape(text);
+    emit(ctx, BC_LOADK, dest, ctx.program->add_string(s.data(), s.size()), 0, tok);
+  } break;
+  default:
+    if (text == "null") emit(ctx, BC_LOADNULL, dest, NULL_POINTER, 0, tok);
+    else emit(ctx, BC_LOADI, dest, text == "true", 0, tok);
+  }
+}
+
+// a constant or a local: no effects, can't fail, and costs nothing
+bool CompilationUnit::cheap(EmitContext& ctx, size_t tok) {
+  auto t = tokens[tok];
+  switch (t->type) {
+  case TOKEN_CONSTANT:
+  case TOKEN_NUM:
+  case TOKEN_STR:
+    return true;
+  case TOKEN_IDENT:
+    return local_register(ctx, tok) >= 0;
+  case TOKEN_BRACKET:
+    return t->op == OP_PAREN && t->role == ROLE_OPERAND && cheap(ctx, t->child1);
+  default:
+    return false;
+  }
+}
+
+uint32_t CompilationUnit::emit_value(EmitContext& ctx, size_t tok) {
+  if (tokens[tok]->type == TOKEN_IDENT) {
+    int32_t r = local_register(ctx, tok);
+    if (r >= 0) return r;
+  } else if (tokens[tok]->op == OP_PAREN && tokens[tok]->role == ROLE_OPERAND) {
+    return emit_value(ctx, tokens[tok]->child1);
+  }
+  uint32_t r = alloc_register(ctx);
+  emit_into(ctx, tok, r);
+  return r;
+}
+
+uint32_t CompilationUnit::emit_value_typed(EmitContext& ctx, size_t tok, TypeId target) {
+  if (tokens[tok]->value_type != TypeTable::nulltype_type) return emit_value(ctx, tok);
+  uint32_t r = alloc_register(ctx);
+  emit(ctx, BC_LOADNULL, r, null_repr(target), 0, tok);
+  return r;
+}
+
+// A bare `null` has no representation until we know where it's going.
+void CompilationUnit::emit_typed(EmitContext& ctx, size_t tok, uint32_t dest, TypeId target) {
+  if (tokens[tok]->value_type == TypeTable::nulltype_type) {
+    emit(ctx, BC_LOADNULL, dest, null_repr(target), 0, tok);
+  } else {
+    emit_into(ctx, tok, dest);
+  }
+}
+
+// dest is only written once every operand has been read, so it is safe
+// for dest to be a variable that the expression uses
+void CompilationUnit::emit_into(EmitContext& ctx, size_t tok, uint32_t dest) {
+  auto t = tokens[tok];
+  uint32_t mark = ctx.next_register;
+  switch (t->type) {
+  case TOKEN_CONSTANT:
+  case TOKEN_NUM:
+  case TOKEN_STR:
+    emit_constant(ctx, tok, dest);
+    break;
+  case TOKEN_IDENT: {
+    int32_t r = local_register(ctx, tok);
+    if (r < 0) {
+      const Symbol* sym = lookup_global(token_string(tok));
+      uint32_t index = ctx.program->function_index[{sym->unit, sym->token}];
+      emit(ctx, BC_LOADFN, dest, index, 0, tok);
+    } else if ((uint32_t)r != dest) {
+      emit(ctx, BC_MOVE, dest, r, 0, tok);
+    }
+  } break;
+  case TOKEN_BRACKET:
+    if (t->role == ROLE_CALL) {
+      emit_call(ctx, tok, dest);
+    } else if (t->role == ROLE_ACCESS) {
+      uint32_t base = emit_value(ctx, t->child1);
+      uint32_t index = emit_value(ctx, t->child2);
+      Opcode op = (kind_of(t->child1) == TYPE_STR ? BC_SINDEX : BC_INDEX);
+      emit(ctx, op, dest, base, index, tok);
+    } else if (t->op == OP_PAREN) {
+      emit_into(ctx, t->child1, dest);
+    } else {
+      // array literal: elements go in consecutive registers
+      std::vector<size_t> elems;
+      flatten_commas(t->child1, elems);
+      TypeId elem = type_table.get(t->value_type).inner;
+      uint32_t first = ctx.next_register;
+      for (auto e : elems) {
+        uint32_t r = alloc_register(ctx);
+        emit_typed(ctx, e, r, elem);
+        ctx.next_register = r + 1;
+      }
+      emit(ctx, local(ctx, tok) ? BC_LNEWARRAY : BC_NEWARRAY, dest, elems.size(), first, tok);
+    }
+    break;
+  case TOKEN_OP:
+    emit_operator(ctx, tok, dest);
+    break;
+  default:
+    report_error(tok, "cannot generate code for this");
+  }
+  ctx.next_register = mark;
+}
+
+void CompilationUnit::emit_access(EmitContext& ctx, size_t tok, uint32_t dest) {
+  auto t = tokens[tok];
+  size_t lhs = t->child1;
+  std::string field = token_string(t->child2);
+  const Type& lt = type_table.get(tokens[lhs]->value_type);
+  if (lt.kind == TYPE_ENUM && tokens[lhs]->type == TOKEN_IDENT && local_register(ctx, lhs) < 0) {
+    // Enum.Value
+    for (size_t i = 0; i < lt.names.size(); i++) {
+      if (lt.names[i] == field) emit(ctx, BC_LOADI, dest, i, 0, tok);
+    }
+    return;
+  }
+  // x?.y is null if x is
+  bool propagate = (tokens[lhs]->op == OP_CHECK_NULL && tokens[lhs]->role == ROLE_EXPRESSION);
+  size_t object = (propagate ? tokens[lhs]->child1 : lhs);
+  const Type& st = type_table.get(propagate ? lt.inner : tokens[lhs]->value_type);
+  int32_t index = 0;
+  for (size_t i = 0; i < st.names.size(); i++) {
+    if (st.names[i] == field) index = i;
+  }
+  uint32_t obj = emit_value(ctx, object);
+  if (!propagate) {
+    emit(ctx, BC_GETFIELD, dest, obj, index, tok);
+    return;
+  }
+  uint32_t cond = alloc_register(ctx);
+  emit(ctx, BC_ISNULL, cond, obj, NULL_POINTER, tok);
+  size_t is_null = emit(ctx, BC_JT, cond, 0, 0, tok);
+  emit(ctx, BC_GETFIELD, dest, obj, index, tok);
+  size_t end = emit(ctx, BC_JMP, 0, 0, 0, tok);
+  patch(ctx, is_null);
+  emit(ctx, BC_LOADNULL, dest, null_repr(t->value_type), 0, tok);
+  patch(ctx, end);
+}
+
+void CompilationUnit::emit_comparison(EmitContext& ctx, size_t tok, uint32_t dest) {
+  auto t = tokens[tok];
+  size_t lhs = t->child1;
+  size_t rhs = t->child2;
+  bool negate = (t->op == OP_NEQ);
+  if (t->op == OP_EQ || t->op == OP_NEQ) {
+    // x == null
+    bool lnull = (tokens[lhs]->value_type == TypeTable::nulltype_type);
+    bool rnull = (tokens[rhs]->value_type == TypeTable::nulltype_type);
+    if (lnull != rnull) {
+      size_t other = (lnull ? rhs : lhs);
+      uint32_t v = emit_value(ctx, other);
+      emit(ctx, BC_ISNULL, dest, v, null_repr(tokens[other]->value_type), tok);
+      if (negate) emit(ctx, BC_NOT, dest, dest, 0, tok);
+      return;
+    }
+  }
+  TypeId type = (tokens[lhs]->value_type == TypeTable::nulltype_type ?
+                 tokens[rhs]->value_type : tokens[lhs]->value_type);
+  const Type& lt = type_table.get(type);
+  TypeKind kind = lt.kind;
+  // nullable floats compare by bits so that null == null
+  if (kind == TYPE_NULLABLE) kind = (lt.inner == TypeTable::str_type ? TYPE_STR : TYPE_INT);
+  uint32_t l = emit_value_typed(ctx, lhs, type);
+  uint32_t r = emit_value_typed(ctx, rhs, type);
+  Opcode op = BC_NOP;
+  switch (t->op) {
+  case OP_EQ:
+  case OP_NEQ:
+    if (kind == TYPE_FLOAT) op = (negate ? BC_NEF : BC_EQF);
+    else if (kind == TYPE_STR) op = (negate ? BC_NES : BC_EQS);
+    else op = (negate ? BC_NEI : BC_EQI);
+    break;
+  case OP_GT:
+  case OP_LT:
+    op = (kind == TYPE_FLOAT ? BC_LTF : kind == TYPE_STR ? BC_LTS : BC_LTI);
+    break;
+  case OP_GTE:
+  case OP_LTE:
+    op = (kind == TYPE_FLOAT ? BC_LEF : kind == TYPE_STR ? BC_LES : BC_LEI);
+    break;
+  default:
+    break;
+  }
+  if (t->op == OP_GT || t->op == OP_GTE) emit(ctx, op, dest, r, l, tok);
+  else emit(ctx, op, dest, l, r, tok);
+}
+
+void CompilationUnit::emit_operator(EmitContext& ctx, size_t tok, uint32_t dest) {
+  auto t = tokens[tok];
+  TypeId type = t->value_type;
+  if (!t->child1) {
+    // prefix
+    switch (t->op) {
+    case OP_UNARY_PLUS:
+      emit_into(ctx, t->child2, dest);
+      break;
+    case OP_UNARY_MINUS:
+      emit(ctx, type == TypeTable::float_type ? BC_NEGF : BC_NEGI, dest,
+           emit_value(ctx, t->child2), 0, tok);
+      break;
+    case OP_BIT_NOT:
+      emit(ctx, BC_BNOT, dest, emit_value(ctx, t->child2), 0, tok);
+      break;
+    default:
+      emit(ctx, BC_NOT, dest, emit_value(ctx, t->child2), 0, tok);
+    }
+    return;
+  }
+  switch (t->op) {
+  case OP_ACCESS:
+    emit_access(ctx, tok, dest);
+    return;
+  case OP_CHECK_NULL:
+    emit_into(ctx, t->child1, dest);
+    return;
+  case OP_CAST: {
+    TypeKind from = kind_of(t->child1);
+    TypeKind to = type_table.get(type).kind;
+    uint32_t v = emit_value(ctx, t->child1);
+    if (from != TYPE_FLOAT && to == TYPE_FLOAT) emit(ctx, BC_ITOF, dest, v, 0, tok);
+    else if (from == TYPE_FLOAT && to != TYPE_FLOAT) emit(ctx, BC_FTOI, dest, v, 0, tok);
+    else if (v != dest) emit(ctx, BC_MOVE, dest, v, 0, tok);
+  } return;
+  case OP_AND:
+  case OP_OR: {
+    // short circuit
+    uint32_t l = emit_value(ctx, t->child1);
+    size_t skip = emit(ctx, t->op == OP_AND ? BC_JF : BC_JT, l, 0, 0, tok);
+    emit_into(ctx, t->child2, dest);
+    size_t end = emit(ctx, BC_JMP, 0, 0, 0, tok);
+    patch(ctx, skip);
+    emit(ctx, BC_LOADI, dest, t->op == OP_OR, 0, tok);
+    patch(ctx, end);
+  } return;
+  case OP_PIPE: {
+    // sum or count, in the loop of the whole pipe
+    uint32_t acc = alloc_register(ctx);
+    bool sum = (token_string(t->child2) == "sum");
+    emit_zero(ctx, acc, type, tok);
+    emit_iteration(ctx, t->child1, tok, [&](uint32_t x) {
+      if (!sum) emit(ctx, BC_ADDK, acc, acc, 1, tok);
+      else emit(ctx, type == TypeTable::float_type ? BC_ADDF : BC_ADDI, acc, acc, x, tok);
+    });
+    emit(ctx, BC_MOVE, dest, acc, 0, tok);
+  } return;
+  case OP_IF_NULL: {
+    if (cheap(ctx, t->child2)) {
+      // nothing to skip, so pick one without a branch
+      static const Opcode select[] = {BC_ORNULLP, BC_ORNULLI, BC_ORNULLF, BC_ORNULLB};
+      uint32_t l = emit_value(ctx, t->child1);
+      uint32_t r = emit_value_typed(ctx, t->child2, type);
+      emit(ctx, select[null_repr(tokens[t->child1]->value_type)], dest, l, r, tok);
+      return;
+    }
+    uint32_t l = emit_value(ctx, t->child1);
+    uint32_t cond = alloc_register(ctx);
+    emit(ctx, BC_ISNULL, cond, l, null_repr(tokens[t->child1]->value_type), tok);
+    size_t is_null = emit(ctx, BC_JT, cond, 0, 0, tok);
+    emit(ctx, BC_MOVE, dest, l, 0, tok);
+    size_t end = emit(ctx, BC_JMP, 0, 0, 0, tok);
+    patch(ctx, is_null);
+    emit_typed(ctx, t->child2, dest, type);
+    patch(ctx, end);
+  } return;
+  case OP_IN:
+  case OP_NOT_IN: {
+    if (emit_in_constants(ctx, tok, dest)) return;
+    const Type& seq = type_table.get(tokens[t->child2]->value_type);
+    uint32_t x = emit_value_typed(ctx, t->child1, seq.inner);
+    uint32_t s = emit_value(ctx, t->child2);
+    Opcode op = BC_INARR;
+    if (seq.kind == TYPE_STR) op = BC_SFIND;
+    else if (seq.inner == TypeTable::str_type) op = BC_INARRS;
+    emit(ctx, op, dest, x, s, tok);
+    if (t->op == OP_NOT_IN) emit(ctx, BC_NOT, dest, dest, 0, tok);
+  } return;
+  case OP_EQ:
+  case OP_NEQ:
+  case OP_LT:
+  case OP_LTE:
+  case OP_GT:
+  case OP_GTE:
+    emit_comparison(ctx, tok, dest);
+    return;
+  default:
+    break;
+  }
+  uint32_t l = emit_value(ctx, t->child1);
+  auto r = tokens[t->child2];
+  if ((t->op == OP_ADD || t->op == OP_SUB) && type == TypeTable::int_type &&
+      r->type == TOKEN_NUM) {
+    // x + constant
+    int64_t n = std::strtoll(token_string(t->child2).c_str(), nullptr, 0);
+    if (t->op == OP_SUB) n = -n;
+    if (n == (int32_t)n) {
+      emit(ctx, BC_ADDK, dest, l, n, tok);
+      return;
+    }
+  }
+  Opcode op = arith_opcode(t->op, type_table.get(type).kind);
+  if (op == BC_CONCAT && local(ctx, tok)) op = BC_LCONCAT;
+  emit(ctx, op, dest, l, emit_value(ctx, t->child2), tok);
+}
+
+void CompilationUnit::emit_call(EmitContext& ctx, size_t tok, uint32_t dest) {
+  auto t = tokens[tok];
+  size_t callee = t->child1;
+  std::vector<size_t> args;
+  flatten_commas(t->child2, args);
+  const Symbol* sym = nullptr;
+  if (tokens[callee]->type == TOKEN_IDENT && local_register(ctx, callee) < 0) {
+    std::string name = token_string(callee);
+    sym = lookup_global(name);
+    if (!sym && name == "print") {
+      for (size_t i = 0; i < args.size(); i++) {
+        uint32_t v = emit_value(ctx, args[i]);
+        char after = (i + 1 == args.size() ? '\n' : ' ');
+        emit(ctx, BC_PRINT, v, tokens[args[i]]->value_type, after, tok);
+      }
+      if (args.empty()) {
+        emit(ctx, BC_LOADK, dest, ctx.program->add_string("", 0), 0, tok);
+        emit(ctx, BC_PRINT, dest, TypeTable::str_type, '\n', tok);
+      }
+      return;
+    } else if (!sym && name == "len") {
+      Opcode op = (kind_of(args[0]) == TYPE_STR ? BC_SLEN : BC_LEN);
+      emit(ctx, op, dest, emit_value(ctx, args[0]), 0, tok);
+      return;
+    } else if (!sym && name == "range") {
+      uint32_t start = alloc_register(ctx);
+      if (args.size() == 1) emit(ctx, BC_LOADI, start, 0, 0, tok);
+      else emit_into(ctx, args[0], start);
+      emit(ctx, local(ctx, tok) ? BC_LRANGE : BC_RANGE, dest, start, emit_value(ctx, args.back()), tok);
+      return;
+    }
+  }
+  const Type& ft = type_table.get(sym ? sym->type : tokens[callee]->value_type);
+  // an indirect callee goes just below its arguments
+  if (!sym || sym->kind == SYMBOL_VAR) emit_into(ctx, callee, alloc_register(ctx));
+  // arguments go in consecutive registers at the top of the frame
+  uint32_t first = ctx.next_register;
+  for (size_t i = 0; i < args.size(); i++) {
+    uint32_t r = alloc_register(ctx);
+    emit_typed(ctx, args[i], r, ft.members[i]);
+    ctx.next_register = r + 1;
+  }
+  if (sym && sym->kind == SYMBOL_TYPE) {
+    emit(ctx, local(ctx, tok) ? BC_LNEWSTRUCT : BC_NEWSTRUCT, dest, args.size(), first, tok);
+  } else if (sym && sym->kind == SYMBOL_FUNCTION) {
+    uint32_t index = ctx.program->function_index[{sym->unit, sym->token}];
+    emit(ctx, BC_CALL, dest, index, first, tok);
+  } else {
+    emit(ctx, BC_CALLR, dest, args.size(), first, tok);
+  }
+}
+
+void CompilationUnit::emit_assignment(EmitContext& ctx, size_t tok) {
+  auto t = tokens[tok];
+  uint32_t mark = ctx.next_register;
+  if (t->type == TOKEN_OP && t->op == OP_COLON) {
+    // x: type;
+    uint32_t r = alloc_register(ctx);
+    emit_zero(ctx, r, t->value_type, tok);
+    declare_local(ctx, t->child1, r);
+    return;
+  }
+  if (t->type != TOKEN_STATEMENT_OP) {
+    // only here for its side effects
+    emit_into(ctx, tok, alloc_register(ctx));
+    ctx.next_register = mark;
+    return;
+  }
+  size_t lhs = t->child1;
+  size_t rhs = t->child2;
+  if (tokens[lhs]->type == TOKEN_OP && tokens[lhs]->op == OP_COLON) {
+    // x: type = value;
+    uint32_t r = alloc_register(ctx);
+    emit_typed(ctx, rhs, r, tokens[lhs]->value_type);
+    declare_local(ctx, tokens[lhs]->child1, r);
+    return;
+  }
+  if (tokens[lhs]->type == TOKEN_IDENT && local_register(ctx, lhs) < 0) {
+    // the first assignment declares it
+    uint32_t r = alloc_register(ctx);
+    emit_typed(ctx, rhs, r, tokens[lhs]->value_type);
+    declare_local(ctx, lhs, r);
+    return;
+  }
+  TypeId type = tokens[lhs]->value_type;
+  Opcode op = BC_NOP;
+  uint32_t v = 0;
+  if (t->op == OP_INC || t->op == OP_DEC) {
+    op = BC_ADDK;
+  } else if (t->op != OP_UNK) {
+    op = arith_opcode(t->op, type_table.get(type).kind);
+    v = emit_value(ctx, rhs);
+  }
+  int32_t delta = (t->op == OP_DEC ? -1 : 1);
+  if (tokens[lhs]->type == TOKEN_IDENT) {
+    uint32_t r = local_register(ctx, lhs);
+    if (op == BC_NOP) emit_typed(ctx, rhs, r, type);
+    else if (op == BC_ADDK) emit(ctx, op, r, r, delta, tok);
+    else emit(ctx, op, r, r, v, tok);
+    ctx.next_register = mark;
+    return;
+  }
+  // fields and array elements: read, modify, write
+  Opcode load = BC_GETFIELD;
+  Opcode store = BC_SETFIELD;
+  uint32_t obj = 0;
+  uint32_t index = 0;
+  if (tokens[lhs]->type == TOKEN_OP) {
+    std::string field = token_string(tokens[lhs]->child2);
+    const Type& st = type_table.get(tokens[tokens[lhs]->child1]->value_type);
+    for (size_t i = 0; i < st.names.size(); i++) {
+      if (st.names[i] == field) index = i;
+    }
+    obj = emit_value(ctx, tokens[lhs]->child1);
+  } else {
+    load = BC_INDEX;
+    store = BC_SETINDEX;
+    obj = emit_value(ctx, tokens[lhs]->child1);
+    index = emit_value(ctx, tokens[lhs]->child2);
+  }
+  uint32_t value = alloc_register(ctx);
+  if (op == BC_NOP) {
+    emit_typed(ctx, rhs, value, type);
+  } else {
+    emit(ctx, load, value, obj, index, tok);
+    if (op == BC_ADDK) emit(ctx, op, value, value, delta, tok);
+    else emit(ctx, op, value, value, v, tok);
+  }
+  emit(ctx, store, obj, index, value, tok);
+  ctx.next_register = mark;
+}
+
+// Loops are laid out with the condition at the bottom, so each iteration
+// takes one conditional jump and no unconditional ones.
+void CompilationUnit::emit_loop_end(EmitContext& ctx, size_t body, size_t cond_at) {
+  for (auto j : ctx.continues.back()) ctx.fn->code[j].c = cond_at;
+  ctx.continues.pop_back();
+  for (auto j : ctx.breaks.back()) patch(ctx, j);
+  ctx.breaks.pop_back();
+  ctx.loop_cleanups.pop_back();
+  (void)body;
+}
+
+// Emits a loop over seq, handing each() the register that holds every
+// element. A jump added to ctx.continues.back() skips to the next one,
+// and to ctx.breaks.back() leaves the loop.
+void CompilationUnit::emit_iteration(EmitContext& ctx, size_t seq, size_t s,
+                                     const std::function<void(uint32_t)>& each) {
+  auto t = tokens[seq];
+  if (t->type == TOKEN_OP && t->op == OP_PIPE) {
+    emit_stage(ctx, seq, each);
+    return;
+  }
+  if (kind_of(seq) == TYPE_SEQUENCE) {
+    // the loop owns the generator's frame, and resumes it until it's done
+    std::vector<size_t> args;
+    flatten_commas(t->child2, args);
+    const Symbol* sym = lookup_global(token_string(t->child1));
+    uint32_t index = ctx.program->function_index[{sym->unit, sym->token}];
+    const Type& ft = type_table.get(sym->type);
+    uint32_t frame = alloc_register(ctx);
+    uint32_t x = alloc_register(ctx);
+    uint32_t live = alloc_register(ctx);
+    uint32_t first = ctx.next_register;
+    for (size_t i = 0; i < args.size(); i++) {
+      uint32_t r = alloc_register(ctx);
+      emit_typed(ctx, args[i], r, ft.members[i]);
+      ctx.next_register = r + 1;
+    }
+    emit(ctx, BC_GENSTART, frame, index, first, s);
+    ctx.next_register = first;
+    size_t next = emit(ctx, BC_RESUME, x, index, frame, s);
+    emit(ctx, BC_GENLIVE, live, index, frame, s);
+    size_t done = emit(ctx, BC_JF, live, 0, 0, s);
+    ctx.breaks.emplace_back();
+    ctx.continues.emplace_back();
+    ctx.loop_cleanups.push_back(ctx.cleanups.size());
+    ctx.generators.push_back({frame, index});
+    each(x);
+    ctx.generators.pop_back();
+    emit(ctx, BC_JMP, 0, 0, next, s);
+    patch(ctx, done);
+    emit_loop_end(ctx, next, next);
+    emit(ctx, BC_GENFREE, frame, index, 0, s);
+    return;
+  }
+  uint32_t i = alloc_register(ctx);
+  uint32_t end = alloc_register(ctx);
+  uint32_t cond = alloc_register(ctx);
+  uint32_t x = alloc_register(ctx);
+  uint32_t arr = 0;
+  Opcode load = BC_NOP;
+  bool counted = false;
+  if (t->role == ROLE_CALL && tokens[t->child1]->type == TOKEN_IDENT &&
+      token_string(t->child1) == "range" && local_register(ctx, t->child1) < 0 &&
+      !lookup_global("range")) {
+    // range(...) counts without building the array
+    std::vector<size_t> args;
+    flatten_commas(t->child2, args);
+    if (args.size() == 1) emit(ctx, BC_LOADI, i, 0, 0, s);
+    else emit_into(ctx, args[0], i);
+    emit_into(ctx, args.back(), end);
+    counted = true;
+  } else {
+    arr = alloc_register(ctx);
+    emit_into(ctx, seq, arr);
+    emit(ctx, BC_LOADI, i, 0, 0, s);
+    bool str = (kind_of(seq) == TYPE_STR);
+    emit(ctx, str ? BC_SLEN : BC_LEN, end, arr, 0, s);
+    load = (str ? BC_SINDEX : BC_INDEX);
+  }
+  size_t to_cond = emit(ctx, BC_JMP, 0, 0, 0, s);
+  size_t body = ctx.fn->code.size();
+  // the element is a copy, so the loop body can't change the iteration
+  if (counted) emit(ctx, BC_MOVE, x, i, 0, s);
+  else emit(ctx, load, x, arr, i, s);
+  ctx.breaks.emplace_back();
+  ctx.continues.emplace_back();
+  ctx.loop_cleanups.push_back(ctx.cleanups.size());
+  each(x);
+  size_t step = emit(ctx, BC_ADDK, i, i, 1, s);
+  patch(ctx, to_cond);
+  emit(ctx, BC_LTI, cond, i, end, s);
+  emit(ctx, BC_JT, cond, 0, body, s);
+  emit_loop_end(ctx, body, step);
+}
+
+// A map() or filter() runs inside the loop of its source, so a whole
+// pipe is one loop and nothing in between is ever stored.
+void CompilationUnit::emit_stage(EmitContext& ctx, size_t pipe, const std::function<void(uint32_t)>& each) {
+  auto t = tokens[pipe];
+  size_t stage = t->child2;
+  bool map = (token_string(tokens[stage]->child1) == "map");
+  size_t f = tokens[stage]->child2;
+  // a function by name is called directly, anything else is evaluated once
+  int32_t index = -1;
+  uint32_t callee = 0;
+  const Symbol* sym = nullptr;
+  if (tokens[f]->type == TOKEN_IDENT && local_register(ctx, f) < 0) sym = lookup_global(token_string(f));
+  if (sym && sym->kind == SYMBOL_FUNCTION) {
+    index = ctx.program->function_index[{sym->unit, sym->token}];
+  } else {
+    callee = alloc_register(ctx);
+    emit_into(ctx, f, callee);
+  }
+  emit_iteration(ctx, t->child1, stage, [&](uint32_t x) {
+    uint32_t mark = ctx.next_register;
+    uint32_t y = alloc_register(ctx);
+    if (index < 0) emit(ctx, BC_MOVE, alloc_register(ctx), callee, 0, stage);
+    uint32_t arg = alloc_register(ctx);
+    emit(ctx, BC_MOVE, arg, x, 0, stage);
+    if (index < 0) emit(ctx, BC_CALLR, y, 1, arg, stage);
+    else emit(ctx, BC_CALL, y, index, arg, stage);
+    ctx.next_register = y + 1;
+    if (map) {
+      each(y);
+    } else {
+      ctx.continues.back().push_back(emit(ctx, BC_JF, y, 0, 0, stage));
+      each(x);
+    }
+    ctx.next_register = mark;
+  });
+}
+
+void CompilationUnit::emit_for(EmitContext& ctx, size_t s) {
+  auto t = tokens[s];
+  size_t in = t->child1;
+  ctx.scopes.emplace_back();
+  emit_iteration(ctx, tokens[in]->child2, s, [&](uint32_t x) {
+    declare_local(ctx, tokens[in]->child1, x);
+    emit_block(ctx, t->child2);
+  });
+  ctx.scopes.pop_back();
+}
+
+// Whether tok is a constant that a value of the given kind can be
+// dispatched on without comparing against it at run time.
+bool CompilationUnit::case_key(EmitContext& ctx, size_t tok, TypeKind kind, CaseKey& key) {
+  auto t = tokens[tok];
+  if (t->type == TOKEN_BRACKET && t->op == OP_PAREN && t->role == ROLE_OPERAND) {
+    return t->child1 && case_key(ctx, t->child1, kind, key);
+  }
+  if (kind == TYPE_STR) {
+    if (t->type != TOKEN_STR) return false;
+    key.text = unescape(token_string(tok));
+    return true;
+  }
+  if (kind != TYPE_INT && kind != TYPE_ENUM) return false;
+  if (t->type == TOKEN_NUM) {
+    if (t->value_type != TypeTable::int_type) return false;
+    key.value = std::strtoll(token_string(tok).c_str(), nullptr, 0);
+    return true;
+  }
+  if (t->type != TOKEN_OP) return false;
+  if (t->op == OP_UNARY_MINUS && !t->child1) {
+    if (!case_key(ctx, t->child2, kind, key)) return false;
+    key.value = (int64_t)(0 - (uint64_t)key.value);
+    return true;
+  }
+  if (t->op != OP_ACCESS) return false;
+  // Enum.Value
+  size_t lhs = t->child1;
+  const Type& lt = type_table.get(tokens[lhs]->value_type);
+  if (lt.kind != TYPE_ENUM || tokens[lhs]->type != TOKEN_IDENT || local_register(ctx, lhs) >= 0) return false;
+  std::string field = token_string(t->child2);
+  for (size_t i = 0; i < lt.names.size(); i++) {
+    if (lt.names[i] != field) continue;
+    key.value = i;
+    return true;
+  }
+  return false;
+}
+
+// Jumps to jumps[key.target] for the one of keys[lo, hi) equal to value,
+// otherwise to jumps.back(). The keys are sorted. A run of them that fills
+// at least a third of its range gets a JUMPTAB; a sparse one is split in
+// half until the pieces are dense or small enough to compare one by one.
+void CompilationUnit::emit_search(EmitContext& ctx, uint32_t value, const std::vector<CaseKey>& keys, size_t lo, size_t hi,
+                                  std::vector<std::vector<size_t>>& jumps, size_t tok) {
+  size_t n = hi - lo;
+  uint64_t span = (uint64_t)keys[hi - 1].value - (uint64_t)keys[lo].value;
+  uint32_t mark = ctx.next_register;
+  if (n >= 4 && span < 3 * n && span < 4096) {
+    uint32_t index = ctx.fn->tables.size();
+    ctx.fn->tables.emplace_back();
+    std::vector<int32_t> targets(span + 1, -1);
+    jumps.back().push_back(emit(ctx, BC_JUMPTAB, value, index, 0, tok));
+    for (size_t i = lo; i < hi; i++) {
+      targets[keys[i].value - keys[lo].value] = ctx.fn->code.size();
+      jumps[keys[i].target].push_back(emit(ctx, BC_JMP, 0, 0, 0, tok));
+    }
+    if (n <= span) {
+      int32_t hole = ctx.fn->code.size();
+      jumps.back().push_back(emit(ctx, BC_JMP, 0, 0, 0, tok));
+      for (auto& target : targets) {
+        if (target < 0) target = hole;
+      }
+    }
+    ctx.fn->tables[index].low = keys[lo].value;
+    ctx.fn->tables[index].targets = std::move(targets);
+  } else if (n > 3) {
+    size_t mid = lo + n / 2;
+    uint32_t cond = alloc_register(ctx);
+    emit_int(ctx, cond, keys[mid].value, tok);
+    emit(ctx, BC_LTI, cond, value, cond, tok);
+    size_t below = emit(ctx, BC_JT, cond, 0, 0, tok);
+    ctx.next_register = mark;
+    emit_search(ctx, value, keys, mid, hi, jumps, tok);
+    patch(ctx, below);
+    emit_search(ctx, value, keys, lo, mid, jumps, tok);
+  } else {
+    uint32_t cond = alloc_register(ctx);
+    for (size_t i = lo; i < hi; i++) {
+      emit_int(ctx, cond, keys[i].value, tok);
+      emit(ctx, BC_EQI, cond, value, cond, tok);
+      jumps[keys[i].target].push_back(emit(ctx, BC_JT, cond, 0, 0, tok));
+    }
+    jumps.back().push_back(emit(ctx, BC_JMP, 0, 0, 0, tok));
+  }
+  ctx.next_register = mark;
+}
+
+// Looks for a seed and a power of two size at which every key hashes to a
+// slot of its own, so a str is found with one compare. False if there is
+// none close to the number of keys.
+bool CompilationUnit::emit_hashed(EmitContext& ctx, uint32_t value, const std::vector<CaseKey>& keys,
+                                  std::vector<std::vector<size_t>>& jumps, size_t tok) {
+  size_t size = 1;
+  while (size < keys.size()) size *= 2;
+  std::vector<int32_t> slots;
+  for (size_t m = size; m <= 4 * size; m *= 2) {
+    for (int32_t seed = 0; seed < 256; seed++) {
+      slots.assign(m, -1);
+      bool distinct = true;
+      for (size_t i = 0; i < keys.size() && distinct; i++) {
+        auto& text = keys[i].text;
+        size_t slot = str_hash(text.data(), text.size(), seed) & (m - 1);
+        distinct = (slots[slot] < 0);
+        slots[slot] = i;
+      }
+      if (!distinct) continue;
+      uint32_t mark = ctx.next_register;
+      uint32_t h = alloc_register(ctx);
+      uint32_t cond = alloc_register(ctx);
+      emit(ctx, BC_SHASH, h, value, seed, tok);
+      emit(ctx, BC_LOADI, cond, m - 1, 0, tok);
+      emit(ctx, BC_BAND, h, h, cond, tok);
+      uint32_t index = ctx.fn->tables.size();
+      ctx.fn->tables.emplace_back();
+      jumps.back().push_back(emit(ctx, BC_JUMPTAB, h, index, 0, tok));
+      std::vector<int32_t> targets(m, -1);
+      int32_t hole = -1;
+      for (size_t slot = 0; slot < m; slot++) {
+        if (slots[slot] < 0) {
+          if (hole < 0) {
+            hole = ctx.fn->code.size();
+            jumps.back().push_back(emit(ctx, BC_JMP, 0, 0, 0, tok));
+          }
+          targets[slot] = hole;
+          continue;
+        }
+        targets[slot] = ctx.fn->code.size();
+        auto& key = keys[slots[slot]];
+        emit(ctx, BC_LOADK, cond, ctx.program->add_string(key.text.data(), key.text.size()), 0, tok);
+        emit(ctx, BC_EQS, cond, value, cond, tok);
+        jumps[key.target].push_back(emit(ctx, BC_JT, cond, 0, 0, tok));
+        jumps.back().push_back(emit(ctx, BC_JMP, 0, 0, 0, tok));
+      }
+      ctx.fn->tables[index].targets = std::move(targets);
+      ctx.next_register = mark;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Jumps to jumps[key.target] for the key equal to value, otherwise to
+// jumps.back(), picking how by the keys: see emit_search() for ints and
+// enums, emit_hashed() for strs.
+void CompilationUnit::emit_dispatch(EmitContext& ctx, uint32_t value, TypeKind kind, std::vector<CaseKey> keys,
+                                    std::vector<std::vector<size_t>>& jumps, size_t tok) {
+  // the first of equal keys wins, as it would in a chain of compares
+  bool str = (kind == TYPE_STR);
+  std::stable_sort(keys.begin(), keys.end(), [&](const CaseKey& x, const CaseKey& y) {
+    return str ? x.text < y.text : x.value < y.value;
+  });
+  keys.erase(std::unique(keys.begin(), keys.end(), [&](const CaseKey& x, const CaseKey& y) {
+    return str ? x.text == y.text : x.value == y.value;
+  }), keys.end());
+  if (keys.empty()) {
+    jumps.back().push_back(emit(ctx, BC_JMP, 0, 0, 0, tok));
+  } else if (!str) {
+    emit_search(ctx, value, keys, 0, keys.size(), jumps, tok);
+  } else if (keys.size() < 4 || !emit_hashed(ctx, value, keys, jumps, tok)) {
+    uint32_t mark = ctx.next_register;
+    uint32_t cond = alloc_register(ctx);
+    for (auto& key : keys) {
+      emit(ctx, BC_LOADK, cond, ctx.program->add_string(key.text.data(), key.text.size()), 0, tok);
+      emit(ctx, BC_EQS, cond, value, cond, tok);
+      jumps[key.target].push_back(emit(ctx, BC_JT, cond, 0, 0, tok));
+    }
+    jumps.back().push_back(emit(ctx, BC_JMP, 0, 0, 0, tok));
+    ctx.next_register = mark;
+  }
+}
+
+// `x in [...]` with constants in the brackets doesn't build the array:
+// ints less than 64 apart are a bit test, and the rest dispatch the way a
+// switch would.
+bool CompilationUnit::emit_in_constants(EmitContext& ctx, size_t tok, uint32_t dest) {
+  auto t = tokens[tok];
+  auto seq = tokens[t->child2];
+  if (seq->type != TOKEN_BRACKET || seq->op != OP_BRACKET || seq->role != ROLE_OPERAND) return false;
+  TypeId elem = type_table.get(seq->value_type).inner;
+  TypeKind kind = type_table.get(elem).kind;
+  std::vector<size_t> elems;
+  flatten_commas(seq->child1, elems);
+  if (elems.empty()) return false;
+  std::vector<CaseKey> keys(elems.size());
+  for (size_t i = 0; i < elems.size(); i++) {
+    if (!case_key(ctx, elems[i], kind, keys[i])) return false;
+  }
+  uint32_t x = emit_value_typed(ctx, t->child1, elem);
+  bool negate = (t->op == OP_NOT_IN);
+  if (kind != TYPE_STR) {
+    auto [low, high] = std::minmax_element(keys.begin(), keys.end(), [](const CaseKey& a, const CaseKey& b) {
+      return a.value < b.value;
+    });
+    int64_t base = (low->value >= 0 && high->value < 64 ? 0 : low->value);
+    if ((uint64_t)high->value - (uint64_t)base < 64) {
+      Value mask;
+      mask.i = 0;
+      for (auto& key : keys) mask.i |= (int64_t)1 << (key.value - base);
+      uint32_t bit = x;
+      if (base) {
+        bit = alloc_register(ctx);
+        if (base != INT32_MIN && base == (int32_t)base) {
+          emit(ctx, BC_ADDK, bit, x, -base, tok);
+        } else {
+          emit_int(ctx, bit, base, tok);
+          emit(ctx, BC_SUBI, bit, x, bit, tok);
+        }
+      }
+      emit(ctx, BC_BITTEST, dest, bit, ctx.program->add_constant(mask), tok);
+      if (negate) emit(ctx, BC_NOT, dest, dest, 0, tok);
+      return true;
+    }
+  }
+  std::vector<std::vector<size_t>> jumps(2);
+  emit_dispatch(ctx, x, kind, keys, jumps, tok);
+  for (auto j : jumps[1]) patch(ctx, j);
+  emit(ctx, BC_LOADI, dest, negate, 0, tok);
+  size_t end = emit(ctx, BC_JMP, 0, 0, 0, tok);
+  for (auto j : jumps[0]) patch(ctx, j);
+  emit(ctx, BC_LOADI, dest, !negate, 0, tok);
+  patch(ctx, end);
+  return true;
+}
+
+void CompilationUnit::emit_switch(EmitContext& ctx, size_t s) {
+  auto t = tokens[s];
+  uint32_t value = alloc_register(ctx);
+  emit_into(ctx, t->child1, value);
+  TypeKind kind = kind_of(t->child1);
+  std::vector<size_t> cases;
+  std::vector<std::vector<size_t>> values;
+  std::vector<CaseKey> keys;
+  bool constant = true;
+  size_t otherwise = 0;
+  for (size_t c = tokens[t->child2]->child1; c; c = tokens[c]->next) {
+    if (tokens[c]->type == TOKEN_ELSE) {
+      otherwise = c;
+      continue;
+    }
+    values.emplace_back();
+    flatten_commas(tokens[c]->child1, values.back());
+    for (auto v : values.back()) {
+      CaseKey key;
+      key.target = cases.size();
+      constant = constant && case_key(ctx, v, kind, key);
+      keys.push_back(key);
+    }
+    cases.push_back(c);
+  }
+  // to each case in turn, then to the else
+  std::vector<std::vector<size_t>> jumps(cases.size() + 1);
+  if (constant) {
+    emit_dispatch(ctx, value, kind, keys, jumps, s);
+  } else {
+    // compare against every value first, then lay out the bodies
+    Opcode eq = (kind == TYPE_FLOAT ? BC_EQF : kind == TYPE_STR ? BC_EQS : BC_EQI);
+    uint32_t cond = alloc_register(ctx);
+    for (size_t i = 0; i < cases.size(); i++) {
+      for (auto v : values[i]) {
+        uint32_t mark = ctx.next_register;
+        emit(ctx, eq, cond, value, emit_value(ctx, v), v);
+        jumps[i].push_back(emit(ctx, BC_JT, cond, 0, 0, v));
+        ctx.next_register = mark;
+      }
+    }
+  }
+  std::vector<size_t> ends;
+  for (auto j : jumps.back()) patch(ctx, j);
+  if (otherwise) emit_block(ctx, tokens[otherwise]->child2);
+  ends.push_back(emit(ctx, BC_JMP, 0, 0, 0, s));
+  for (size_t i = 0; i < cases.size(); i++) {
+    for (auto j : jumps[i]) patch(ctx, j);
+    emit_block(ctx, tokens[cases[i]]->child2);
+    ends.push_back(emit(ctx, BC_JMP, 0, 0, 0, cases[i]));
+  }
+  for (auto j : ends) patch(ctx, j);
+}
+
+// Whether tok makes a new object: a struct, an array literal, range(),
+// or a str concatenation.
+bool CompilationUnit::allocates(size_t tok) {
+  auto t = tokens[tok];
+  if (t->type == TOKEN_OP) return t->op == OP_ADD && t->child1 && t->value_type == TypeTable::str_type;
+  if (t->type != TOKEN_BRACKET) return false;
+  if (t->role == ROLE_OPERAND) return t->op == OP_BRACKET;
+  if (t->role != ROLE_CALL || tokens[t->child1]->type != TOKEN_IDENT) return false;
+  std::string name = token_string(t->child1);
+  const Symbol* sym = lookup_global(name);
+  return sym ? sym->kind == SYMBOL_TYPE : name == "range";
+}
+
+// Calls use() on tok and everything under it, with whether its value is
+// consumed there: read, compared or printed, but not kept anywhere that
+// could outlive the statement, the way an assignment, an argument, an
+// element or a return keeps it. Statements go through their expressions
+// and blocks. Anything not known to consume its operands keeps them.
+void CompilationUnit::visit_values(size_t tok, bool consumed, const std::function<void(size_t, bool)>& use) {
+  if (!tok) return;
+  auto t = tokens[tok];
+  use(tok, consumed);
+  switch (t->type) {
+  case TOKEN_IDENT:
+  case TOKEN_NUM:
+  case TOKEN_STR:
+  case TOKEN_CONSTANT:
+  case TOKEN_BREAK:
+  case TOKEN_CONTINUE:
+  case TOKEN_ENUM:
+  case TOKEN_FUNCTION:
+  case TOKEN_IMPORT:
+  case TOKEN_STRUCT:
+    return;
+  case TOKEN_OP:
+    switch (t->op) {
+    case OP_ACCESS:
+      // not the field name
+      visit_values(t->child1, true, use);
+      return;
+    case OP_CHECK_NULL:
+    case OP_CAST:
+    case OP_IF_NULL:
+    case OP_COMMA:
+      // the value may be an operand, as it is
+      visit_values(t->child1, consumed, use);
+      visit_values(t->child2, consumed, use);
+      return;
+    case OP_PIPE:
+      visit_values(t->child1, true, use);
+      visit_values(t->child2, false, use);
+      return;
+    default:
+      visit_values(t->child1, true, use);
+      visit_values(t->child2, true, use);
+      return;
+    }
+  case TOKEN_BRACKET:
+    if (t->role == ROLE_CALL) {
+      // print(), len() and range() only read their arguments
+      bool reads = false;
+      if (tokens[t->child1]->type == TOKEN_IDENT && !lookup_global(token_string(t->child1))) {
+        std::string name = token_string(t->child1);
+        reads = (name == "print" || name == "len" || name == "range");
+      }
+      visit_values(t->child1, true, use);
+      visit_values(t->child2, reads, use);
+    } else if (t->role == ROLE_ACCESS) {
+      visit_values(t->child1, true, use);
+      visit_values(t->child2, true, use);
+    } else if (t->op == OP_PAREN) {
+      visit_values(t->child1, consumed, use);
+    } else if (t->op == OP_BRACKET) {
+      visit_values(t->child1, false, use);
+    } else {
+      for (size_t s = t->child1; s; s = tokens[s]->next) visit_values(s, true, use);
+    }
+    return;
+  case TOKEN_SEMICOLON:
+  case TOKEN_DEFER:
+    visit_values(t->child1, true, use);
+    return;
+  case TOKEN_STATEMENT_OP:
+    // a declaration's name isn't a use
+    if (tokens[t->child1]->type != TOKEN_OP || tokens[t->child1]->op != OP_COLON) {
+      visit_values(t->child1, true, use);
+    }
+    // what's assigned is kept, unless it's only an operand of +=
+    visit_values(t->child2, t->op != OP_UNK, use);
+    return;
+  case TOKEN_IF:
+  case TOKEN_ELIF:
+  case TOKEN_WHILE:
+  case TOKEN_DO:
+  case TOKEN_CASE:
+  case TOKEN_SWITCH:
+    visit_values(t->child1, true, use);
+    visit_values(t->child2, true, use);
+    return;
+  case TOKEN_ELSE:
+    visit_values(t->child2, true, use);
+    return;
+  case TOKEN_FOR:
+    // not the loop variable
+    visit_values(tokens[t->child1]->child2, true, use);
+    visit_values(t->child2, true, use);
+    return;
+  default:
+    visit_values(t->child1, false, use);
+    visit_values(t->child2, false, use);
+  }
+}
+
+// `x = <new object>;` declaring x puts the object in the block's region,
+// if nothing in the rest of the block lets x's value go anywhere else.
+void CompilationUnit::find_local_variable(EmitContext& ctx, size_t stmt) {
+  size_t tok = tokens[stmt]->child1;
+  if (!ctx.regions || !tok || tokens[tok]->type != TOKEN_STATEMENT_OP || tokens[tok]->op != OP_UNK) return;
+  size_t lhs = tokens[tok]->child1;
+  size_t rhs = tokens[tok]->child2;
+  while (tokens[rhs]->op == OP_PAREN && tokens[rhs]->role == ROLE_OPERAND) rhs = tokens[rhs]->child1;
+  if (tokens[lhs]->type != TOKEN_IDENT || local_register(ctx, lhs) >= 0 || !allocates(rhs)) return;
+  std::string name = token_string(lhs);
+  bool escapes = false;
+  for (size_t s = tokens[stmt]->next; s && !escapes; s = tokens[s]->next) {
+    visit_values(s, true, [&](size_t use, bool consumed) {
+      if (!consumed && tokens[use]->type == TOKEN_IDENT && token_string(use) == name) escapes = true;
+    });
+  }
+  if (!escapes) ctx.local.insert(rhs);
+}
+
+// Whether the allocation at tok goes in the innermost block's region,
+// which that block then marks and releases.
+bool CompilationUnit::local(EmitContext& ctx, size_t tok) {
+  if (!ctx.regions || ctx.cleanups.empty() || !ctx.local.count(tok)) return false;
+  ctx.cleanups.back().used = true;
+  return true;
+}
+
+void CompilationUnit::open_cleanup(EmitContext& ctx, size_t tok) {
+  EmitContext::Cleanup c;
+  c.scopes = ctx.scopes.size();
+  if (ctx.regions) {
+    c.mark = alloc_register(ctx);
+    c.mark_at = emit(ctx, BC_NOP, c.mark, 0, 0, tok);
+  }
+  ctx.cleanups.push_back(c);
+}
+
+// Leaves ctx.cleanups[index] behind: its deferred statements, newest
+// first, then its region.
+void CompilationUnit::emit_cleanup(EmitContext& ctx, size_t index, size_t tok) {
+  std::vector<size_t> defers = ctx.cleanups[index].defers;
+  if (!defers.empty()) {
+    // They see the names, and put what they allocate in the region, of
+    // the block they were deferred in, and declare nothing that stays.
+    size_t visible = ctx.cleanups[index].scopes;
+    std::vector<std::map<std::string, uint32_t>> scopes(ctx.scopes.begin() + visible, ctx.scopes.end());
+    std::vector<EmitContext::Cleanup> cleanups(ctx.cleanups.begin() + index + 1, ctx.cleanups.end());
+    ctx.scopes.resize(visible);
+    ctx.cleanups.resize(index + 1);
+    uint32_t mark = ctx.next_register;
+    for (auto it = defers.rbegin(); it != defers.rend(); it++) {
+      ctx.scopes.emplace_back();
+      emit_statement(ctx, tokens[*it]->child1);
+      ctx.scopes.pop_back();
+    }
+    ctx.next_register = mark;
+    ctx.scopes.insert(ctx.scopes.end(), scopes.begin(), scopes.end());
+    ctx.cleanups.insert(ctx.cleanups.end(), cleanups.begin(), cleanups.end());
+  }
+  auto& c = ctx.cleanups[index];
+  if (c.mark >= 0) c.releases.push_back(emit(ctx, BC_NOP, c.mark, 0, 0, tok));
+}
+
+// for a jump out of every block from ctx.cleanups[depth] in
+void CompilationUnit::emit_cleanups(EmitContext& ctx, size_t depth, size_t tok) {
+  for (size_t i = ctx.cleanups.size(); i-- > depth;) emit_cleanup(ctx, i, tok);
+}
+
+// the end of the innermost block
+void CompilationUnit::close_cleanup(EmitContext& ctx, size_t tok) {
+  emit_cleanup(ctx, ctx.cleanups.size() - 1, tok);
+  auto& c = ctx.cleanups.back();
+  if (c.used) {
+    ctx.fn->code[c.mark_at].op = BC_MARK;
+    for (auto r : c.releases) ctx.fn->code[r].op = BC_RELEASE;
+  }
+  ctx.cleanups.pop_back();
+}
+
+// A loop's condition runs on every iteration, so it gets a region of its
+// own rather than piling up what it allocates in the enclosing block's.
+uint32_t CompilationUnit::emit_loop_condition(EmitContext& ctx, size_t cond) {
+  uint32_t r = alloc_register(ctx);
+  open_cleanup(ctx, cond);
+  emit_into(ctx, cond, r);
+  close_cleanup(ctx, cond);
+  return r;
+}
+
+// returns the last statement used, which is more than one for if chains
+size_t CompilationUnit::emit_statement(EmitContext& ctx, size_t s) {
+  auto t = tokens[s];
+  uint32_t mark = ctx.next_register;
+  switch (t->type) {
+  case TOKEN_BRACKET:
+    emit_block(ctx, s);
+    break;
+  case TOKEN_SEMICOLON:
+    // may declare a variable, so it resets registers itself
+    if (!t->child1) return s;
+    find_local_variable(ctx, s);
+    emit_assignment(ctx, t->child1);
+    return s;
+  case TOKEN_BREAK:
+    emit_cleanups(ctx, ctx.loop_cleanups.back(), s);
+    ctx.breaks.back().push_back(emit(ctx, BC_JMP, 0, 0, 0, s));
+    break;
+  case TOKEN_CONTINUE:
+    emit_cleanups(ctx, ctx.loop_cleanups.back(), s);
+    ctx.continues.back().push_back(emit(ctx, BC_JMP, 0, 0, 0, s));
+    break;
+  case TOKEN_RETURN: {
+    // the value is taken before deferred statements run, so they can't change it
+    bool deferred = false;
+    for (auto& c : ctx.cleanups) deferred = deferred || !c.defers.empty();
+    int32_t v = -1;
+    if (t->child1 && deferred) {
+      v = alloc_register(ctx);
+      emit_typed(ctx, t->child1, v, ctx.return_type);
+    } else if (t->child1) {
+      v = emit_value_typed(ctx, t->child1, ctx.return_type);
+    }
+    emit_cleanups(ctx, 0, s);
+    for (size_t i = ctx.generators.size(); i-- > 0;) {
+      emit(ctx, BC_GENFREE, ctx.generators[i].first, ctx.generators[i].second, 0, s);
+    }
+    if (v >= 0) emit(ctx, BC_RET, v, 0, 0, s);
+    else emit(ctx, ctx.fn->generator ? BC_DONE : BC_RETV, 0, 0, 0, s);
+  } break;
+  case TOKEN_YIELD:
+    emit(ctx, BC_YIELD, emit_value_typed(ctx, t->child1, ctx.yield_type), 0, 0, s);
+    break;
+  case TOKEN_IF: {
+    std::vector<size_t> ends;
+    while (true) {
+      size_t skip = 0;
+      if (tokens[s]->type != TOKEN_ELSE) {
+        skip = emit(ctx, BC_JF, emit_value(ctx, tokens[s]->child1), 0, 0, s);
+        ctx.next_register = mark;
+      }
+      emit_block(ctx, tokens[s]->child2);
+      size_t next = tokens[s]->next;
+      bool more = (skip && next && (tokens[next]->type == TOKEN_ELIF || tokens[next]->type == TOKEN_ELSE));
+      if (more) ends.push_back(emit(ctx, BC_JMP, 0, 0, 0, s));
+      if (skip) patch(ctx, skip);
+      if (!more) break;
+      s = next;
+    }
+    for (auto j : ends) patch(ctx, j);
+  } break;
+  case TOKEN_WHILE: {
+    size_t to_cond = emit(ctx, BC_JMP, 0, 0, 0, s);
+    size_t body = ctx.fn->code.size();
+    ctx.breaks.emplace_back();
+    ctx.continues.emplace_back();
+    ctx.loop_cleanups.push_back(ctx.cleanups.size());
+    emit_block(ctx, t->child2);
+    patch(ctx, to_cond);
+    size_t cond_at = ctx.fn->code.size();
+    emit(ctx, BC_JT, emit_loop_condition(ctx, t->child1), 0, body, s);
+    emit_loop_end(ctx, body, cond_at);
+  } break;
+  case TOKEN_DO: {
+    size_t body = ctx.fn->code.size();
+    ctx.breaks.emplace_back();
+    ctx.continues.emplace_back();
+    ctx.loop_cleanups.push_back(ctx.cleanups.size());
+    emit_block(ctx, t->child2);
+    size_t cond_at = ctx.fn->code.size();
+    emit(ctx, BC_JT, emit_loop_condition(ctx, t->child1), 0, body, s);
+    emit_loop_end(ctx, body, cond_at);
+  } break;
+  case TOKEN_FOR:
+    emit_for(ctx, s);
+    break;
+  case TOKEN_SWITCH:
+    emit_switch(ctx, s);
+    break;
+  case TOKEN_DELETE: {
+    // how big it is, for the free list it goes back on
+    TypeId type = tokens[t->child1]->value_type;
+    if (type_table.get(type).kind == TYPE_NULLABLE) type = type_table.get(type).inner;
+    const Type& dt = type_table.get(type);
+    int32_t size = 0;
+    if (dt.kind == TYPE_STRUCT) size = std::max<int32_t>(dt.members.size(), 1);
+    emit(ctx, BC_DELETE, emit_value(ctx, t->child1), size, 0, s);
+  } break;
+  case TOKEN_DEFER:
+    ctx.cleanups.back().defers.push_back(s);
+    break;
+  default:
+    break;
+  }
+  ctx.next_register = mark;
+  return s;
+}
+
+void CompilationUnit::emit_block(EmitContext& ctx, size_t block) {
+  uint32_t mark = ctx.next_register;
+  ctx.scopes.emplace_back();
+  open_cleanup(ctx, block);
+  for (size_t s = tokens[block]->child1; s; s = tokens[s]->next) {
+    s = emit_statement(ctx, s);
+  }
+  close_cleanup(ctx, tokens[block]->child2 ? tokens[block]->child2 : block);
+  ctx.scopes.pop_back();
+  ctx.next_register = mark;
+}
+
+void CompilationUnit::emit_function(Program& program, size_t index) {
+  size_t fn = functions[index];
+  EmitContext ctx;
+  ctx.program = &program;
+  ctx.fn = &program.functions[program.function_index[{this, fn}]];
+  ctx.scopes.emplace_back();
+  ctx.regions = !ctx.fn->generator;
+  // what's only ever consumed goes in the region of its block, see also
+  // find_local_variable()
+  auto consumed = [&](size_t tok, bool consumed) {
+    if (consumed && allocates(tok)) ctx.local.insert(tok);
+  };
+  if (!fn) {
+    for (size_t s = tokens[0]->child1; s; s = tokens[s]->next) visit_values(s, true, consumed);
+    open_cleanup(ctx, 0);
+    for (size_t s = tokens[0]->child1; s; s = tokens[s]->next) {
+      switch (tokens[s]->type) {
+      case TOKEN_ENUM:
+      case TOKEN_FUNCTION:
+      case TOKEN_IMPORT:
+      case TOKEN_STRUCT:
+        break;
+      default:
+        s = emit_statement(ctx, s);
+      }
+    }
+    close_cleanup(ctx, tokens.size() - 1);
+    emit(ctx, BC_RETV, 0, 0, 0, tokens.size() - 1);
+    return;
+  }
+  std::vector<size_t> params;
+  flatten_commas(tokens[tokens[tokens[fn]->child1]->child1]->child1, params);
+  for (auto p : params) {
+    uint32_t r = alloc_register(ctx);
+    if (tokens[p]->op == OP_COLON) declare_local(ctx, tokens[p]->child1, r);
+  }
+  ctx.return_type = type_table.get(tokens[fn]->value_type).inner;
+  if (ctx.fn->generator) {
+    // where to resume, right after the parameters
+    alloc_register(ctx);
+    ctx.yield_type = type_table.get(ctx.return_type).inner;
+    ctx.return_type = TypeTable::void_type;
+  }
+  visit_values(tokens[fn]->child2, true, consumed);
+  emit_block(ctx, tokens[fn]->child2);
+  emit(ctx, ctx.fn->generator ? BC_DONE : BC_RETV, 0, 0, 0, tokens[tokens[fn]->child2]->child2);
+}
+
+void CompilationUnit::declare_functions(Program& program) {
+  for (auto fn : functions) {
+    Function f;
+    if (fn) {
+      f.name = token_string(tokens[fn]->child1);
+      const Type& t = type_table.get(tokens[fn]->value_type);
+      f.params = t.members.size();
+      f.generator = (type_table.get(t.inner).kind == TYPE_SEQUENCE);
+    } else {
+      f.name = filename.string();
+    }
+    program.function_index[{this, fn}] = program.functions.size();
+    program.functions.push_back(f);
+  }
+}
+
+void CompilationUnit::emit_functions(Program& program) {
+  for (size_t i = 0; i < functions.size(); i++) emit_function(program, i);
+}
@@ -0,0 +1,66 @@
+#include "heap.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <iomanip>
+
+Heap::Heap() {
+  chunks.push_back({(char*)std::malloc(chunk_size), chunk_size});
+  top = chunks[0].base;
+  grew(chunk_size);
+}
+
+Heap::~Heap() {
+  for (auto p : slabs) std::free(p);
+  for (auto& c : chunks) std::free(c.base);
+}
+
+void* Heap::alloc_slow(size_t bytes) {
+  if (plain || bytes > max_pooled) {
+    if (!plain) grew(bytes);
+    return std::malloc(bytes);
+  }
+  size_t size = size_class(bytes) * 16;
+  if (slab_next + size > slab_end) {
+    // the rest of the old slab is too small to be worth a list
+    slab_next = (char*)std::malloc(slab_size);
+    slab_end = slab_next + slab_size;
+    slabs.push_back(slab_next);
+    grew(slab_size);
+  }
+  void* p = slab_next;
+  slab_next += size;
+  return p;
+}
+
+// moves on to the next chunk, which is new if the ones kept are too small
+void* Heap::local_slow(size_t bytes) {
+  chunk++;
+  while (chunk < chunks.size() && chunks[chunk].size < bytes) {
+    stats.held -= chunks[chunk].size;
+    std::free(chunks[chunk].base);
+    chunks.erase(chunks.begin() + chunk);
+  }
+  if (chunk == chunks.size()) {
+    size_t size = std::max(bytes, chunk_size);
+    chunks.push_back({(char*)std::malloc(size), size});
+    grew(size);
+  }
+  top = chunks[chunk].base + bytes;
+  return chunks[chunk].base;
+}
+
+void Heap::print_stats(std::ostream& out) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  auto mb = [](size_t bytes) { return bytes / double(1 << 20); };
+  out << "heap        " << stats.allocations << " allocations, " << stats.local << " in regions, ";
+  out << stats.reused << " reused, " << stats.freed << " freed" << std::endl;
+  out << std::fixed << std::setprecision(1);
+  out << "peak heap   " << mb(stats.peak_live) << " MB live";
+  if (!plain) out << " in " << mb(stats.peak_held) << " MB held";
+  // in kilobytes
+  out << ", " << usage.ru_maxrss / 1024 << " MB rss" << std::endl;
+  out << std::defaultfloat;
+}
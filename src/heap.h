@@ -0,0 +1,139 @@
+#ifndef __VOOM_HEAP_H__
+#define __VOOM_HEAP_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+struct HeapStats {
+  size_t allocations = 0;
+  // of those, how many came off a free list, and how many from a region
+  size_t reused = 0;
+  size_t local = 0;
+  size_t freed = 0;
+  // bytes in objects that haven't been freed, regions aside
+  size_t live = 0;
+  size_t peak_live = 0;
+  // bytes taken from malloc: slabs, large objects and region chunks
+  size_t held = 0;
+  size_t peak_held = 0;
+};
+
+// The interpreter's memory. Objects up to max_pooled bytes come from
+// slabs cut into size classes of 16 bytes, and `delete` puts them on the
+// free list of their class for the next allocation of that size; larger
+// ones are malloc()ed. Objects that the emitter proved don't outlive
+// their block go in the region instead: a stack of chunks that a block
+// marks on entry and releases in bulk on the way out (MARK, RELEASE).
+//
+// With `plain`, every object is malloc()ed, and free()d by `delete` or,
+// for a region object, at the release, to compare against.
+class Heap {
+private:
+  static constexpr size_t max_pooled = 256;
+  static constexpr size_t slab_size = 1 << 16;
+  static constexpr size_t chunk_size = 1 << 20;
+
+  struct Chunk {
+    char* base;
+    size_t size;
+  };
+  // the head of each class's free list, linked through the first word
+  void* free_lists[max_pooled / 16 + 1] = {};
+  // what's left of the slab being cut up
+  char* slab_next = nullptr;
+  char* slab_end = nullptr;
+  std::vector<char*> slabs;
+  // chunks past `chunk` are kept for when the region grows again
+  std::vector<Chunk> chunks;
+  size_t chunk = 0;
+  char* top = nullptr;
+  // with `plain`, what the region holds instead, and how big each is
+  std::vector<std::pair<void*, size_t>> plain_region;
+
+  static size_t size_class(size_t bytes) { return (bytes + 15) / 16; }
+  void* alloc_slow(size_t bytes);
+  void* local_slow(size_t bytes);
+  void grew(size_t bytes) {
+    stats.held += bytes;
+    if (stats.held > stats.peak_held) stats.peak_held = stats.held;
+  }
+public:
+  bool plain = false;
+  HeapStats stats;
+
+  Heap();
+  Heap(const Heap&) = delete;
+  ~Heap();
+
+  void* alloc(size_t bytes) {
+    stats.allocations++;
+    stats.live += bytes;
+    if (stats.live > stats.peak_live) stats.peak_live = stats.live;
+    if (!plain && bytes <= max_pooled) {
+      void*& head = free_lists[size_class(bytes)];
+      if (head) {
+        void* p = head;
+        head = *(void**)p;
+        stats.reused++;
+        return p;
+      }
+    }
+    return alloc_slow(bytes);
+  }
+
+  // bytes must be what p was allocated with
+  void free(void* p, size_t bytes) {
+    if (!p) return;
+    stats.freed++;
+    stats.live -= bytes;
+    if (plain || bytes > max_pooled) {
+      if (bytes > max_pooled) stats.held -= bytes;
+      std::free(p);
+      return;
+    }
+    void*& head = free_lists[size_class(bytes)];
+    *(void**)p = head;
+    head = p;
+  }
+
+  // in the region, until the innermost block that marked it releases it
+  void* local(size_t bytes) {
+    if (plain) {
+      void* p = alloc(bytes);
+      plain_region.push_back({p, bytes});
+      return p;
+    }
+    stats.allocations++;
+    stats.local++;
+    bytes = (bytes + 7) & ~(size_t)7;
+    if (top + bytes <= chunks[chunk].base + chunks[chunk].size) {
+      void* p = top;
+      top += bytes;
+      return p;
+    }
+    return local_slow(bytes);
+  }
+
+  int64_t mark() const { return plain ? (int64_t)plain_region.size() : (int64_t)top; }
+  // frees everything put in the region since mark()
+  void release(int64_t mark) {
+    if (plain) {
+      while (plain_region.size() > (size_t)mark) {
+        free(plain_region.back().first, plain_region.back().second);
+        plain_region.pop_back();
+      }
+      return;
+    }
+    char* p = (char*)mark;
+    while (p < chunks[chunk].base || p > chunks[chunk].base + chunks[chunk].size) chunk--;
+    top = p;
+  }
+
+  void print_stats(std::ostream& out);
+};
+
+#endif
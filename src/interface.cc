@@ -0,0 +1,335 @@
+#include "compilation_unit.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <functional>
+
+// Layout of an interface file, all in host byte order:
+//   InterfaceHeader
+//   InterfaceImport[import_count]
+//   InterfaceSymbol[symbol_count]
+//   uint32_t[type_words]   one record per type, see write_interface()
+//   char[strings_size]     nul-terminated strings
+static const char interface_magic[4] = {'V', 'O', 'M', 'I'};
+static const uint32_t interface_version = 4;
+
+struct InterfaceHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t source_hash;
+  uint64_t key;
+  uint32_t import_count;
+  uint32_t symbol_count;
+  uint32_t type_count;
+  uint32_t type_words;
+  uint32_t strings_size;
+  uint32_t padding;
+};
+
+struct InterfaceImport {
+  // relative to the directory of the importing unit
+  uint32_t path;
+  uint32_t padding;
+  uint64_t key;
+};
+
+struct InterfaceSymbol {
+  uint32_t name;
+  uint32_t kind;
+  uint32_t type;
+};
+
+void CompilationUnit::compute_key() {
+  key = hash_bytes(&source_hash, sizeof(source_hash));
+  for (auto& unit : imports) {
+    // a cycle we're still in the middle of
+    if (!unit->key) {
+      key = 0;
+      return;
+    }
+    key = hash_bytes(&unit->key, sizeof(unit->key), key);
+  }
+}
+
+std::filesystem::path CompilationUnit::interface_path() {
+  std::filesystem::path p = filename;
+  p += ".vi";
+  return p;
+}
+
+// Whether every count, offset and index in an interface stays inside it,
+// so that read_interface() can follow them without looking. Records that
+// aren't structs or enums may only refer to earlier records, so any cycle
+// goes through a named type, which read_interface() makes before its
+// members.
+static bool valid_interface(const char* data, size_t size) {
+  auto header = (const InterfaceHeader*)data;
+  uint64_t expected = sizeof(InterfaceHeader) +
+    (uint64_t)header->import_count * sizeof(InterfaceImport) +
+    (uint64_t)header->symbol_count * sizeof(InterfaceSymbol) +
+    (uint64_t)header->type_words * sizeof(uint32_t) + header->strings_size;
+  if (expected != size) return false;
+  auto imps = (const InterfaceImport*)(header + 1);
+  auto syms = (const InterfaceSymbol*)(imps + header->import_count);
+  auto words = (const uint32_t*)(syms + header->symbol_count);
+  const char* strings = data + size - header->strings_size;
+  // with a nul at the end, any offset inside is a whole string
+  uint32_t strings_size = header->strings_size;
+  if (strings_size && strings[strings_size - 1] != 0) return false;
+  auto is_string = [&](uint32_t offset) { return offset < strings_size; };
+
+  for (uint32_t i = 0; i < header->import_count; i++) {
+    if (!is_string(imps[i].path)) return false;
+  }
+  uint64_t w = 0;
+  uint64_t type_words = header->type_words;
+  for (uint32_t i = 0; i < header->type_count; i++) {
+    // kind inner name member_count members... name_count names...
+    if (w + 4 > type_words) return false;
+    const uint32_t* r = words + w;
+    uint32_t kind = r[0];
+    uint64_t member_count = r[3];
+    if (kind > TYPE_SEQUENCE || w + 5 + member_count > type_words) return false;
+    uint64_t name_count = r[4 + member_count];
+    if (w + 5 + member_count + name_count > type_words) return false;
+    for (uint64_t k = 0; k < name_count; k++) {
+      if (!is_string(r[5 + member_count + k])) return false;
+    }
+    bool named = (kind == TYPE_STRUCT || kind == TYPE_ENUM);
+    uint32_t limit = (named ? header->type_count : i);
+    for (uint64_t k = 0; k < member_count; k++) {
+      if (r[4 + k] >= limit) return false;
+    }
+    if (kind == TYPE_ARRAY || kind == TYPE_NULLABLE || kind == TYPE_SEQUENCE || kind == TYPE_FUNCTION) {
+      if (r[1] >= limit) return false;
+    }
+    if (named && (!is_string(r[1]) || !is_string(r[2]))) return false;
+    if (kind == TYPE_STRUCT && name_count != member_count) return false;
+    if (kind == TYPE_ENUM && member_count) return false;
+    w += 5 + member_count + name_count;
+  }
+  if (w != type_words) return false;
+  for (uint32_t i = 0; i < header->symbol_count; i++) {
+    if (!is_string(syms[i].name) || syms[i].type >= header->type_count) return false;
+  }
+  return true;
+}
+
+bool CompilationUnit::open_interface(std::vector<std::pair<std::filesystem::path, uint64_t>>& deps) {
+  if (status != UNIT_READ) return false;
+  int fd = open(interface_path().c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(InterfaceHeader)) {
+    close(fd);
+    return false;
+  }
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+  interface_data = (char*)data;
+  interface_size = st.st_size;
+
+  auto header = (const InterfaceHeader*)interface_data;
+  if (std::memcmp(header->magic, interface_magic, 4) != 0 ||
+      header->version != interface_version ||
+      header->source_hash != source_hash ||
+      !valid_interface(interface_data, interface_size)) {
+    close_interface();
+    return false;
+  }
+  auto imps = (const InterfaceImport*)(header + 1);
+  auto syms = (const InterfaceSymbol*)(imps + header->import_count);
+  for (uint32_t i = 0; i < header->symbol_count; i++) {
+    if (syms[i].kind > SYMBOL_TYPE) {
+      close_interface();
+      return false;
+    }
+  }
+  const char* strings = interface_data + interface_size - header->strings_size;
+  for (uint32_t i = 0; i < header->import_count; i++) {
+    std::filesystem::path p = filename.parent_path() / (strings + imps[i].path);
+    deps.push_back({p.lexically_normal(), imps[i].key});
+  }
+  return true;
+}
+
+void CompilationUnit::read_interface() {
+  auto header = (const InterfaceHeader*)interface_data;
+  auto imps = (const InterfaceImport*)(header + 1);
+  auto syms = (const InterfaceSymbol*)(imps + header->import_count);
+  auto words = (const uint32_t*)(syms + header->symbol_count);
+  const char* strings = interface_data + interface_size - header->strings_size;
+
+  std::vector<const uint32_t*> records;
+  for (uint32_t i = 0, w = 0; i < header->type_count; i++) {
+    records.push_back(words + w);
+    // kind inner name member_count members... name_count names...
+    uint32_t members = words[w+3];
+    w += 4 + members;
+    w += 1 + words[w];
+  }
+  std::vector<TypeId> ids(records.size(), TypeTable::null_type);
+  // relative to this unit's directory, as the writer put it
+  auto unit_path = [&](uint32_t offset) {
+    return (filename.parent_path() / (strings + offset)).lexically_normal().string();
+  };
+  std::function<TypeId(uint32_t)> materialize = [&](uint32_t i) -> TypeId {
+    if (ids[i] != TypeTable::null_type) return ids[i];
+    const uint32_t* r = records[i];
+    TypeKind kind = (TypeKind)r[0];
+    uint32_t member_count = r[3];
+    std::vector<TypeId> members;
+    std::vector<std::string> names;
+    for (uint32_t k = 0; k < r[4 + member_count]; k++) {
+      names.push_back(strings + r[5 + member_count + k]);
+    }
+    switch (kind) {
+    case TYPE_STRUCT:
+    case TYPE_ENUM:
+      // named first, so that recursive structs find themselves
+      ids[i] = type_table.declare_named(kind, unit_path(r[1]), strings + r[2]);
+      for (uint32_t k = 0; k < member_count; k++) members.push_back(materialize(r[4 + k]));
+      if (kind == TYPE_STRUCT) type_table.define_struct(ids[i], names, members);
+      else type_table.define_enum(ids[i], names);
+      break;
+    case TYPE_ARRAY:
+      ids[i] = type_table.array_of(materialize(r[1]));
+      break;
+    case TYPE_NULLABLE:
+      ids[i] = type_table.nullable(materialize(r[1]));
+      break;
+    case TYPE_SEQUENCE:
+      ids[i] = type_table.sequence_of(materialize(r[1]));
+      break;
+    case TYPE_FUNCTION:
+      for (uint32_t k = 0; k < member_count; k++) members.push_back(materialize(r[4 + k]));
+      ids[i] = type_table.function(materialize(r[1]), members);
+      break;
+    default:
+      // builtins are written as their id
+      ids[i] = kind;
+    }
+    return ids[i];
+  };
+
+  for (uint32_t i = 0; i < header->symbol_count; i++) {
+    globals[strings + syms[i].name] = {(SymbolKind)syms[i].kind, materialize(syms[i].type), 0, this};
+  }
+  key = header->key;
+  from_interface = true;
+  status = UNIT_TYPED;
+  close_interface();
+}
+
+void CompilationUnit::close_interface() {
+  if (interface_data) munmap(interface_data, interface_size);
+  interface_data = nullptr;
+  interface_size = 0;
+}
+
+bool CompilationUnit::write_interface() {
+  if (status != UNIT_TYPED || from_interface || !key) return false;
+  std::string strings;
+  auto add_string = [&](const std::string& s) -> uint32_t {
+    uint32_t offset = strings.size();
+    strings.append(s.c_str(), s.size() + 1);
+    return offset;
+  };
+
+  std::vector<InterfaceImport> imps;
+  for (auto& unit : imports) {
+    std::string rel = unit->filename.lexically_relative(filename.parent_path()).string();
+    imps.push_back({add_string(rel), 0, unit->key});
+  }
+
+  // Types are numbered in the order they are finished, except that structs
+  // and enums are numbered when first reached, so that they can contain
+  // themselves. Everything else then only refers to earlier records.
+  // Each record is: kind, inner, name, member_count, members...,
+  // name_count, names... For structs and enums, inner is instead the file
+  // that declares them, relative to this one's directory.
+  std::map<TypeId, uint32_t> local;
+  std::vector<TypeId> order;
+  std::function<uint32_t(TypeId)> number = [&](TypeId id) -> uint32_t {
+    auto found = local.find(id);
+    if (found != local.end()) return found->second;
+    const Type& t = type_table.get(id);
+    bool named = (t.kind == TYPE_STRUCT || t.kind == TYPE_ENUM);
+    if (named) {
+      local[id] = order.size();
+      order.push_back(id);
+    }
+    if (t.kind == TYPE_ARRAY || t.kind == TYPE_NULLABLE || t.kind == TYPE_SEQUENCE ||
+        t.kind == TYPE_FUNCTION) {
+      number(t.inner);
+    }
+    for (auto m : t.members) number(m);
+    // a struct among the members may have come back to it already
+    found = local.find(id);
+    if (found != local.end()) return found->second;
+    uint32_t n = order.size();
+    local[id] = n;
+    order.push_back(id);
+    return n;
+  };
+  std::vector<InterfaceSymbol> syms;
+  for (auto& it : globals) {
+    uint32_t name = add_string(it.first);
+    syms.push_back({name, (uint32_t)it.second.kind, number(it.second.type)});
+  }
+  std::vector<uint32_t> words;
+  for (auto id : order) {
+    const Type& t = type_table.get(id);
+    words.push_back(t.kind);
+    bool has_inner = (t.kind == TYPE_ARRAY || t.kind == TYPE_NULLABLE || t.kind == TYPE_SEQUENCE ||
+                      t.kind == TYPE_FUNCTION);
+    if (has_inner) {
+      words.push_back(local[t.inner]);
+    } else if (!t.unit.empty()) {
+      std::filesystem::path unit = t.unit;
+      words.push_back(add_string(unit.lexically_relative(filename.parent_path()).string()));
+    } else {
+      words.push_back(0);
+    }
+    words.push_back(t.name.empty() ? 0 : add_string(t.name));
+    words.push_back(t.members.size());
+    for (auto m : t.members) words.push_back(local[m]);
+    words.push_back(t.names.size());
+    for (auto& n : t.names) words.push_back(add_string(n));
+  }
+
+  InterfaceHeader header;
+  std::memcpy(header.magic, interface_magic, 4);
+  header.version = interface_version;
+  header.source_hash = source_hash;
+  header.key = key;
+  header.import_count = imps.size();
+  header.symbol_count = syms.size();
+  header.type_count = order.size();
+  header.type_words = words.size();
+  header.strings_size = strings.size();
+  header.padding = 0;
+
+  // write to a temporary name so a concurrent reader never sees half a file
+  std::filesystem::path tmp = interface_path();
+  tmp += ".tmp";
+  std::ofstream out(tmp, std::ios::binary);
+  out.write((const char*)&header, sizeof(header));
+  out.write((const char*)imps.data(), imps.size() * sizeof(InterfaceImport));
+  out.write((const char*)syms.data(), syms.size() * sizeof(InterfaceSymbol));
+  out.write((const char*)words.data(), words.size() * sizeof(uint32_t));
+  out.write(strings.data(), strings.size());
+  out.close();
+  std::error_code ec;
+  if (!out) {
+    std::filesystem::remove(tmp, ec);
+    return false;
+  }
+  std::filesystem::rename(tmp, interface_path(), ec);
+  return !ec;
+}
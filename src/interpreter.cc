@@ -0,0 +1,529 @@
+#include "bytecode.h"
+#include "heap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+
+Program::~Program() {
+  for (auto& p : owned) std::free(p);
+}
+
+uint32_t Program::add_constant(Value v) {
+  constants.push_back(v);
+  return constants.size() - 1;
+}
+
+uint32_t Program::add_string(const char* data, size_t length) {
+  Str* s = (Str*)std::malloc(sizeof(Str) + length);
+  s->length = length;
+  std::memcpy(s->data, data, length);
+  owned.push_back(s);
+  Value v;
+  v.p = s;
+  return add_constant(v);
+}
+
+NullRepr null_repr(TypeId type) {
+  const Type& t = type_table.get(type);
+  if (t.kind == TYPE_NULLABLE) return null_repr(t.inner);
+  switch (t.kind) {
+  case TYPE_INT:
+  case TYPE_ENUM:
+    return NULL_INT;
+  case TYPE_FLOAT:
+    return NULL_FLOAT;
+  case TYPE_BOOL:
+    return NULL_BOOL;
+  default:
+    return NULL_POINTER;
+  }
+}
+
+static Str* new_str(Heap& heap, size_t length, bool local) {
+  size_t size = sizeof(Str) + length;
+  Str* s = (Str*)(local ? heap.local(size) : heap.alloc(size));
+  s->length = length;
+  return s;
+}
+
+static Array* new_array(Heap& heap, size_t length, bool local) {
+  size_t size = sizeof(Array) + length * sizeof(Value);
+  Array* a = (Array*)(local ? heap.local(size) : heap.alloc(size));
+  a->length = length;
+  return a;
+}
+
+static bool str_equal(const Str* a, const Str* b) {
+  if (!a || !b) return a == b;
+  return a->length == b->length && std::memcmp(a->data, b->data, a->length) == 0;
+}
+
+static int str_compare(const Str* a, const Str* b) {
+  std::string_view x(a ? a->data : "", a ? a->length : 0);
+  std::string_view y(b ? b->data : "", b ? b->length : 0);
+  return x.compare(y);
+}
+
+static void print_value(std::ostream& out, Value v, TypeId type, int depth) {
+  const Type& t = type_table.get(type);
+  if (t.kind == TYPE_NULLABLE) {
+    if (v.i == null_bits[null_repr(type)]) out << "null";
+    else print_value(out, v, t.inner, depth);
+    return;
+  }
+  if (depth > 8) {
+    out << "...";
+    return;
+  }
+  switch (t.kind) {
+  case TYPE_BOOL:
+    out << (v.i ? "true" : "false");
+    break;
+  case TYPE_INT:
+    out << v.i;
+    break;
+  case TYPE_FLOAT:
+    out << v.f;
+    break;
+  case TYPE_STR:
+    if (v.p) out.write(((Str*)v.p)->data, ((Str*)v.p)->length);
+    break;
+  case TYPE_ENUM:
+    if (v.i >= 0 && (size_t)v.i < t.names.size()) out << t.name << "." << t.names[v.i];
+    else out << t.name << "(" << v.i << ")";
+    break;
+  case TYPE_ARRAY: {
+    Array* a = (Array*)v.p;
+    out << "[";
+    for (int64_t i = 0; a && i < a->length; i++) {
+      if (i) out << ", ";
+      print_value(out, a->data[i], t.inner, depth+1);
+    }
+    out << "]";
+  } break;
+  case TYPE_STRUCT: {
+    Value* fields = (Value*)v.p;
+    out << t.name << "(";
+    for (size_t i = 0; fields && i < t.members.size(); i++) {
+      if (i) out << ", ";
+      print_value(out, fields[i], t.members[i], depth+1);
+    }
+    out << ")";
+  } break;
+  case TYPE_FUNCTION:
+    out << "<function>";
+    break;
+  default:
+    out << "null";
+  }
+}
+
+struct Frame {
+  const Function* fn;
+  // where to continue in the caller
+  const Instruction* ip;
+  Value* base;
+  int32_t dest;
+  // a pooled generator frame to copy the registers back to
+  Value* pooled = nullptr;
+};
+
+// Pooled generator frames, recycled by size. A frame holds the index of
+// its generator followed by its registers.
+class FramePool {
+private:
+  std::vector<std::vector<Value*>> free;
+public:
+  ~FramePool() {
+    for (auto& list : free) {
+      for (auto p : list) std::free(p);
+    }
+  }
+  Value* take(size_t size) {
+    if (size < free.size() && !free[size].empty()) {
+      Value* p = free[size].back();
+      free[size].pop_back();
+      return p;
+    }
+    return (Value*)std::malloc(sizeof(Value) * size);
+  }
+  void give(Value* p, size_t size) {
+    if (free.size() <= size) free.resize(size + 1);
+    free[size].push_back(p);
+  }
+};
+
+// Adds the frames a generator's frame at `base` is suspended in the loops
+// of to `frames`, going into the ones in place.
+static void suspended_frames(const Program& program, const Function& g, Value* base,
+                             std::vector<Value*>& frames) {
+  int64_t at = base[g.params].i;
+  // resuming continues right after the YIELD
+  if (at < 2 || g.code[at - 2].op != BC_YIELD || g.code[at - 2].b == 0) return;
+  for (auto& s : g.suspended[g.code[at - 2].b - 1]) {
+    if (s.pooled) frames.push_back((Value*)base[s.at].p);
+    else suspended_frames(program, program.functions[s.function], base + s.at, frames);
+  }
+}
+
+// A generator left before it's done may itself be suspended in loops over
+// pooled generators, which nothing else will free.
+static void free_frame(const Program& program, FramePool& pool, Value* frame) {
+  std::vector<Value*> frames{frame};
+  while (!frames.empty()) {
+    Value* p = frames.back();
+    frames.pop_back();
+    const Function& g = program.functions[p[0].i];
+    suspended_frames(program, g, p + 1, frames);
+    pool.give(p, g.registers + 1);
+  }
+}
+
+static const size_t stack_size = 1 << 20;
+static const size_t max_frames = 1 << 16;
+
+#define R(x) base[in->x]
+#define FAIL(msg) { error = (msg); goto fail; }
+
+// Register windows overlap: a callee's registers start at the caller's
+// first argument register, so arguments are never copied.
+static bool execute(Program& program, uint32_t entry, Value* stack, Heap& heap) {
+  std::vector<Frame> frames;
+  const Function* fn = &program.functions[entry];
+  const Instruction* ip = fn->code.data();
+  const Instruction* in = ip;
+  const Value* constants = program.constants.data();
+  Value* base = stack;
+  Value* limit = stack + stack_size;
+  const char* error = nullptr;
+  FramePool pool;
+
+#if defined(__GNUC__)
+  // threaded dispatch: every handler jumps straight to the next one
+  static void* labels[] = {
+#define X(name) &&op_##name,
+    VOOM_OPCODES(X)
+#undef X
+  };
+#define CASE(name) op_##name:
+#define NEXT() { in = ip++; goto *labels[in->op]; }
+  NEXT();
+  {
+#else
+#define CASE(name) case BC_##name:
+#define NEXT() goto dispatch;
+dispatch:
+  in = ip++;
+  switch (in->op) {
+#endif
+  CASE(NOP) NEXT();
+  CASE(MOVE) R(a) = R(b); NEXT();
+  CASE(LOADI) R(a).i = in->b; NEXT();
+  CASE(LOADK) R(a) = constants[in->b]; NEXT();
+  CASE(LOADNULL) R(a).i = null_bits[in->b]; NEXT();
+  CASE(LOADFN) R(a).i = in->b; NEXT();
+  // wrap around on overflow instead of invoking undefined behaviour
+  CASE(ADDI) R(a).i = (int64_t)((uint64_t)R(b).i + (uint64_t)R(c).i); NEXT();
+  CASE(SUBI) R(a).i = (int64_t)((uint64_t)R(b).i - (uint64_t)R(c).i); NEXT();
+  CASE(MULI) R(a).i = (int64_t)((uint64_t)R(b).i * (uint64_t)R(c).i); NEXT();
+  CASE(DIVI)
+    if (R(c).i == 0) FAIL("division by zero");
+    if (R(c).i == -1) R(a).i = (int64_t)(0 - (uint64_t)R(b).i);
+    else R(a).i = R(b).i / R(c).i;
+    NEXT();
+  CASE(MODI)
+    if (R(c).i == 0) FAIL("division by zero");
+    if (R(c).i == -1) R(a).i = 0;
+    else R(a).i = R(b).i % R(c).i;
+    NEXT();
+  CASE(ADDK) R(a).i = (int64_t)((uint64_t)R(b).i + (uint64_t)(int64_t)in->c); NEXT();
+  CASE(SHL) R(a).i = (int64_t)((uint64_t)R(b).i << (R(c).i & 63)); NEXT();
+  CASE(SHR) R(a).i = R(b).i >> (R(c).i & 63); NEXT();
+  CASE(BAND) R(a).i = R(b).i & R(c).i; NEXT();
+  CASE(BOR) R(a).i = R(b).i | R(c).i; NEXT();
+  CASE(BXOR) R(a).i = R(b).i ^ R(c).i; NEXT();
+  CASE(NEGI) R(a).i = (int64_t)(0 - (uint64_t)R(b).i); NEXT();
+  CASE(BNOT) R(a).i = ~R(b).i; NEXT();
+  CASE(NOT) R(a).i = !R(b).i; NEXT();
+  CASE(ADDF) R(a).f = R(b).f + R(c).f; NEXT();
+  CASE(SUBF) R(a).f = R(b).f - R(c).f; NEXT();
+  CASE(MULF) R(a).f = R(b).f * R(c).f; NEXT();
+  CASE(DIVF) R(a).f = R(b).f / R(c).f; NEXT();
+  CASE(MODF) R(a).f = std::fmod(R(b).f, R(c).f); NEXT();
+  CASE(NEGF) R(a).f = -R(b).f; NEXT();
+  CASE(ITOF) R(a).f = (double)R(b).i; NEXT();
+  CASE(FTOI) R(a).i = (int64_t)R(b).f; NEXT();
+  CASE(EQI) R(a).i = R(b).i == R(c).i; NEXT();
+  CASE(NEI) R(a).i = R(b).i != R(c).i; NEXT();
+  CASE(LTI) R(a).i = R(b).i < R(c).i; NEXT();
+  CASE(LEI) R(a).i = R(b).i <= R(c).i; NEXT();
+  CASE(EQF) R(a).i = R(b).f == R(c).f; NEXT();
+  CASE(NEF) R(a).i = R(b).f != R(c).f; NEXT();
+  CASE(LTF) R(a).i = R(b).f < R(c).f; NEXT();
+  CASE(LEF) R(a).i = R(b).f <= R(c).f; NEXT();
+  CASE(EQS) R(a).i = str_equal((Str*)R(b).p, (Str*)R(c).p); NEXT();
+  CASE(NES) R(a).i = !str_equal((Str*)R(b).p, (Str*)R(c).p); NEXT();
+  CASE(LTS) R(a).i = str_compare((Str*)R(b).p, (Str*)R(c).p) < 0; NEXT();
+  CASE(LES) R(a).i = str_compare((Str*)R(b).p, (Str*)R(c).p) <= 0; NEXT();
+  CASE(CONCAT) CASE(LCONCAT) {
+    Str* x = (Str*)R(b).p;
+    Str* y = (Str*)R(c).p;
+    if (!x || !y) FAIL("null access");
+    Str* s = new_str(heap, x->length + y->length, in->op == BC_LCONCAT);
+    std::memcpy(s->data, x->data, x->length);
+    std::memcpy(s->data + x->length, y->data, y->length);
+    R(a).p = s;
+  } NEXT();
+  CASE(ISNULL) R(a).i = R(b).i == null_bits[in->c]; NEXT();
+  CASE(ORNULLP) R(a) = (R(b).i == null_bits[NULL_POINTER] ? R(c) : R(b)); NEXT();
+  CASE(ORNULLI) R(a) = (R(b).i == null_bits[NULL_INT] ? R(c) : R(b)); NEXT();
+  CASE(ORNULLF) R(a) = (R(b).i == null_bits[NULL_FLOAT] ? R(c) : R(b)); NEXT();
+  CASE(ORNULLB) R(a) = (R(b).i == null_bits[NULL_BOOL] ? R(c) : R(b)); NEXT();
+  CASE(SHASH) {
+    Str* x = (Str*)R(b).p;
+    R(a).i = (x ? str_hash(x->data, x->length, in->c) : 0);
+  } NEXT();
+  CASE(BITTEST) {
+    uint64_t bit = R(b).i;
+    R(a).i = (bit < 64 ? (constants[in->c].i >> bit) & 1 : 0);
+  } NEXT();
+  CASE(JMP) ip = fn->code.data() + in->c; NEXT();
+  CASE(JT) if (R(a).i) ip = fn->code.data() + in->c; NEXT();
+  CASE(JF) if (!R(a).i) ip = fn->code.data() + in->c; NEXT();
+  CASE(JUMPTAB) {
+    const JumpTable& t = fn->tables[in->b];
+    uint64_t k = R(a).i - t.low;
+    ip = fn->code.data() + (k < t.targets.size() ? t.targets[k] : in->c);
+  } NEXT();
+  CASE(CALLR) {
+    const Function* callee = &program.functions[base[in->c - 1].i];
+    Value* callee_base = base + in->c;
+    if (callee_base + callee->registers > limit || frames.size() >= max_frames) {
+      FAIL("stack overflow");
+    }
+    frames.push_back({fn, ip, base, in->a});
+    fn = callee;
+    base = callee_base;
+    ip = fn->code.data();
+  } NEXT();
+  CASE(CALL) {
+    const Function* callee = &program.functions[in->b];
+    Value* callee_base = base + in->c;
+    if (callee_base + callee->registers > limit || frames.size() >= max_frames) {
+      FAIL("stack overflow");
+    }
+    frames.push_back({fn, ip, base, in->a});
+    fn = callee;
+    base = callee_base;
+    ip = fn->code.data();
+  } NEXT();
+  CASE(RET) {
+    Value v = R(a);
+    if (frames.empty()) return true;
+    Frame& f = frames.back();
+    fn = f.fn;
+    ip = f.ip;
+    base = f.base;
+    base[f.dest] = v;
+    frames.pop_back();
+  } NEXT();
+  CASE(RETV) {
+    if (frames.empty()) return true;
+    Frame& f = frames.back();
+    fn = f.fn;
+    ip = f.ip;
+    base = f.base;
+    base[f.dest].i = 0;
+    frames.pop_back();
+  } NEXT();
+  CASE(GENSTART) {
+    const Function* g = &program.functions[in->b];
+    for (uint32_t i = 0; i < g->params; i++) base[in->a + i] = base[in->c + i];
+    base[in->a + g->params].i = 1;
+  } NEXT();
+  CASE(RESUME) {
+    const Function* callee = &program.functions[in->b];
+    Value* callee_base = base + in->c;
+    if (callee_base + callee->registers > limit || frames.size() >= max_frames) {
+      FAIL("stack overflow");
+    }
+    frames.push_back({fn, ip, base, in->a});
+    fn = callee;
+    base = callee_base;
+    ip = fn->code.data() + base[fn->params].i - 1;
+  } NEXT();
+  CASE(GENLIVE) R(a).i = base[in->c + program.functions[in->b].params].i != 0; NEXT();
+  CASE(YIELD) {
+    Value v = R(a);
+    base[fn->params].i = ip - fn->code.data() + 1;
+    Frame& f = frames.back();
+    if (f.pooled) std::memcpy(f.pooled + 1, base, fn->registers * sizeof(Value));
+    fn = f.fn;
+    ip = f.ip;
+    base = f.base;
+    base[f.dest] = v;
+    frames.pop_back();
+  } NEXT();
+  CASE(DONE) {
+    base[fn->params].i = 0;
+    Frame& f = frames.back();
+    if (f.pooled) f.pooled[1 + fn->params].i = 0;
+    fn = f.fn;
+    ip = f.ip;
+    base = f.base;
+    base[f.dest].i = 0;
+    frames.pop_back();
+  } NEXT();
+  CASE(GENNEW) {
+    const Function* g = &program.functions[in->b];
+    Value* frame = pool.take(g->registers + 1);
+    frame[0].i = in->b;
+    for (uint32_t i = 0; i < g->params; i++) frame[1 + i] = base[in->c + i];
+    frame[1 + g->params].i = 1;
+    R(a).p = frame;
+  } NEXT();
+  CASE(RESUMEP) {
+    Value* frame = (Value*)R(b).p;
+    const Function* callee = &program.functions[frame[0].i];
+    Value* callee_base = base + in->c;
+    if (callee_base + callee->registers > limit || frames.size() >= max_frames) {
+      FAIL("stack overflow");
+    }
+    std::memcpy(callee_base, frame + 1, callee->registers * sizeof(Value));
+    frames.push_back({fn, ip, base, in->a, frame});
+    fn = callee;
+    base = callee_base;
+    ip = fn->code.data() + base[fn->params].i - 1;
+  } NEXT();
+  CASE(GENFREE) {
+    if (in->c) {
+      std::vector<Value*> frames;
+      suspended_frames(program, program.functions[in->b], &R(a), frames);
+      for (auto p : frames) free_frame(program, pool, p);
+    } else {
+      free_frame(program, pool, (Value*)R(a).p);
+    }
+  } NEXT();
+  CASE(NEWSTRUCT) CASE(LNEWSTRUCT) {
+    size_t size = sizeof(Value) * std::max(in->b, 1);
+    Value* fields = (Value*)(in->op == BC_LNEWSTRUCT ? heap.local(size) : heap.alloc(size));
+    for (int32_t i = 0; i < in->b; i++) fields[i] = base[in->c + i];
+    R(a).p = fields;
+  } NEXT();
+  CASE(GETFIELD) {
+    Value* fields = (Value*)R(b).p;
+    if (!fields) FAIL("null access");
+    R(a) = fields[in->c];
+  } NEXT();
+  CASE(SETFIELD) {
+    Value* fields = (Value*)R(a).p;
+    if (!fields) FAIL("null access");
+    fields[in->b] = R(c);
+  } NEXT();
+  CASE(NEWARRAY) CASE(LNEWARRAY) {
+    Array* arr = new_array(heap, in->b, in->op == BC_LNEWARRAY);
+    for (int32_t i = 0; i < in->b; i++) arr->data[i] = base[in->c + i];
+    R(a).p = arr;
+  } NEXT();
+  CASE(RANGE) CASE(LRANGE) {
+    int64_t start = R(b).i;
+    int64_t end = R(c).i;
+    Array* arr = new_array(heap, end > start ? end - start : 0, in->op == BC_LRANGE);
+    for (int64_t i = 0; i < arr->length; i++) arr->data[i].i = start + i;
+    R(a).p = arr;
+  } NEXT();
+  CASE(INDEX) {
+    Array* arr = (Array*)R(b).p;
+    if (!arr) FAIL("null access");
+    int64_t i = R(c).i;
+    if (i < 0 || i >= arr->length) FAIL("index out of range");
+    R(a) = arr->data[i];
+  } NEXT();
+  CASE(SETINDEX) {
+    Array* arr = (Array*)R(a).p;
+    if (!arr) FAIL("null access");
+    int64_t i = R(b).i;
+    if (i < 0 || i >= arr->length) FAIL("index out of range");
+    arr->data[i] = R(c);
+  } NEXT();
+  CASE(LEN) {
+    Array* arr = (Array*)R(b).p;
+    if (!arr) FAIL("null access");
+    R(a).i = arr->length;
+  } NEXT();
+  CASE(SLEN) {
+    Str* s = (Str*)R(b).p;
+    if (!s) FAIL("null access");
+    R(a).i = s->length;
+  } NEXT();
+  CASE(SINDEX) {
+    Str* s = (Str*)R(b).p;
+    if (!s) FAIL("null access");
+    int64_t i = R(c).i;
+    if (i < 0 || i >= s->length) FAIL("index out of range");
+    Str* ch = new_str(heap, 1, false);
+    ch->data[0] = s->data[i];
+    R(a).p = ch;
+  } NEXT();
+  CASE(INARR) {
+    Array* arr = (Array*)R(c).p;
+    if (!arr) FAIL("null access");
+    int64_t found = 0;
+    for (int64_t i = 0; i < arr->length && !found; i++) found = (arr->data[i].i == R(b).i);
+    R(a).i = found;
+  } NEXT();
+  CASE(INARRS) {
+    Array* arr = (Array*)R(c).p;
+    if (!arr) FAIL("null access");
+    int64_t found = 0;
+    for (int64_t i = 0; i < arr->length && !found; i++) {
+      found = str_equal((Str*)arr->data[i].p, (Str*)R(b).p);
+    }
+    R(a).i = found;
+  } NEXT();
+  CASE(SFIND) {
+    Str* x = (Str*)R(b).p;
+    Str* y = (Str*)R(c).p;
+    if (!x || !y) FAIL("null access");
+    std::string_view haystack(y->data, y->length);
+    R(a).i = haystack.find(std::string_view(x->data, x->length)) != std::string_view::npos;
+  } NEXT();
+  CASE(DELETE) {
+    void* p = R(a).p;
+    if (!p) NEXT();
+    size_t size = sizeof(Value) * in->b;
+    if (in->b == 0) size = sizeof(Array) + sizeof(Value) * ((Array*)p)->length;
+    heap.free(p, size);
+  } NEXT();
+  CASE(MARK) R(a).i = heap.mark(); NEXT();
+  CASE(RELEASE) heap.release(R(a).i); NEXT();
+  CASE(PRINT)
+    print_value(std::cout, R(a), in->b, 0);
+    if (in->c) std::cout.put((char)in->c);
+    NEXT();
+  }
+
+fail:
+  std::cout.flush();
+  std::cerr << "runtime error in " << fn->name << " line ";
+  std::cerr << fn->lines[in - fn->code.data()] << ": " << error << std::endl;
+  return false;
+}
+
+#undef CASE
+#undef NEXT
+#undef R
+#undef FAIL
+
+int interpret(Program& program, Heap& heap) {
+  std::vector<Value> stack(stack_size);
+  for (auto entry : program.init) {
+    if (!execute(program, entry, stack.data(), heap)) return 1;
+  }
+  std::cout.flush();
+  return 0;
+}
@@ -0,0 +1,1225 @@
+#include "ir.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <iterator>
+#include <sstream>
+
+static const uint32_t no_value = UINT32_MAX;
+
+// where the registers are in each bytecode instruction
+enum Shape {
+  SHAPE_NONE,     // nothing
+  SHAPE_LOAD,     // a = f(immediate b)
+  SHAPE_UNARY,    // a = f(b), c is immediate
+  SHAPE_BINARY,   // a = f(b, c)
+  SHAPE_SETFIELD, // reads a and c, b is immediate
+  SHAPE_STORE,    // reads a, b and c
+  SHAPE_USE,      // reads a, b and c are immediate
+  SHAPE_CALL,     // a = function b(c, ...)
+  SHAPE_CALLR,    // a = (c-1)(c, ... c+b-1)
+  SHAPE_NEW,      // a = f(c, ... c+b-1)
+  SHAPE_FRAME,    // a = f(generator frame c), b is immediate
+};
+
+static Shape shape_of(uint16_t op) {
+  switch (op) {
+  case BC_NOP:
+  case BC_JMP:
+  case BC_RETV:
+  case BC_DONE:
+    return SHAPE_NONE;
+  case BC_LOADI:
+  case BC_LOADK:
+  case BC_LOADNULL:
+  case BC_LOADFN:
+  case BC_MARK:
+    return SHAPE_LOAD;
+  case BC_MOVE:
+  case BC_ADDK:
+  case BC_NEGI:
+  case BC_BNOT:
+  case BC_NOT:
+  case BC_NEGF:
+  case BC_ITOF:
+  case BC_FTOI:
+  case BC_ISNULL:
+  case BC_GETFIELD:
+  case BC_LEN:
+  case BC_SLEN:
+  case BC_SHASH:
+  case BC_BITTEST:
+    return SHAPE_UNARY;
+  case BC_SETFIELD:
+    return SHAPE_SETFIELD;
+  case BC_SETINDEX:
+    return SHAPE_STORE;
+  case BC_JT:
+  case BC_JF:
+  case BC_JUMPTAB:
+  case BC_RET:
+  case BC_DELETE:
+  case BC_RELEASE:
+  case BC_PRINT:
+  case BC_YIELD:
+  case BC_GENFREE:
+    return SHAPE_USE;
+  case BC_CALL:
+  case BC_GENSTART:
+    return SHAPE_CALL;
+  case BC_RESUME:
+  case BC_GENLIVE:
+    return SHAPE_FRAME;
+  case BC_CALLR:
+    return SHAPE_CALLR;
+  case BC_NEWSTRUCT:
+  case BC_LNEWSTRUCT:
+  case BC_NEWARRAY:
+  case BC_LNEWARRAY:
+    return SHAPE_NEW;
+  default:
+    return SHAPE_BINARY;
+  }
+}
+
+bool ir_defines_value(uint16_t op) {
+  switch (op) {
+  case IR_PHI:
+  case IR_PARAM:
+  case IR_UNDEF:
+    return true;
+  default:
+    break;
+  }
+  switch (shape_of(op)) {
+  case SHAPE_LOAD:
+  case SHAPE_UNARY:
+  case SHAPE_BINARY:
+  case SHAPE_CALL:
+  case SHAPE_CALLR:
+  case SHAPE_NEW:
+  case SHAPE_FRAME:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool ir_is_pure(uint16_t op) {
+  switch (op) {
+  case BC_LOADI: case BC_LOADK: case BC_LOADNULL: case BC_LOADFN:
+  case BC_ADDI: case BC_SUBI: case BC_MULI: case BC_DIVI: case BC_MODI: case BC_ADDK:
+  case BC_SHL: case BC_SHR: case BC_BAND: case BC_BOR: case BC_BXOR:
+  case BC_NEGI: case BC_BNOT: case BC_NOT:
+  case BC_ADDF: case BC_SUBF: case BC_MULF: case BC_DIVF: case BC_MODF: case BC_NEGF:
+  case BC_ITOF: case BC_FTOI:
+  case BC_EQI: case BC_NEI: case BC_LTI: case BC_LEI:
+  case BC_EQF: case BC_NEF: case BC_LTF: case BC_LEF:
+  case BC_EQS: case BC_NES: case BC_LTS: case BC_LES:
+  case BC_ISNULL: case BC_ORNULLP: case BC_ORNULLI: case BC_ORNULLF: case BC_ORNULLB:
+  case BC_SHASH: case BC_BITTEST:
+  // arrays never change length, and strs never change at all
+  case BC_LEN: case BC_SLEN:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool ir_may_fail(const IrFunction& f, const IrInst& inst) {
+  switch (inst.op) {
+  case BC_DIVI:
+  case BC_MODI: {
+    const IrInst& divisor = f.insts[inst.args[1]];
+    return divisor.op != BC_LOADI || divisor.b == 0;
+  }
+  case BC_CALL:
+  case BC_CALLR:
+  case BC_RESUME:
+  case BC_CONCAT:
+  case BC_LCONCAT:
+  case BC_GETFIELD:
+  case BC_SETFIELD:
+  case BC_INDEX:
+  case BC_SETINDEX:
+  case BC_LEN:
+  case BC_SLEN:
+  case BC_SINDEX:
+  case BC_INARR:
+  case BC_INARRS:
+  case BC_SFIND:
+    return true;
+  default:
+    return false;
+  }
+}
+
+uint32_t IrFunction::add(uint32_t block, uint16_t op, int32_t b, int32_t c) {
+  IrInst inst;
+  inst.op = op;
+  inst.b = b;
+  inst.c = c;
+  inst.block = block;
+  insts.push_back(inst);
+  forward.push_back(insts.size() - 1);
+  blocks[block].code.push_back(insts.size() - 1);
+  return insts.size() - 1;
+}
+
+uint32_t IrFunction::find(uint32_t value) {
+  uint32_t v = value;
+  while (forward[v] != v) v = forward[v];
+  // shorten the path for next time
+  while (forward[value] != v) {
+    uint32_t next = forward[value];
+    forward[value] = v;
+    value = next;
+  }
+  return v;
+}
+
+// The replaced instruction is dropped; its users see `with` after resolve().
+void IrFunction::replace(uint32_t value, uint32_t with) {
+  with = find(with);
+  if (value == with) return;
+  forward[value] = with;
+  insts[value].removed = true;
+}
+
+void IrFunction::resolve() {
+  for (auto& inst : insts) {
+    if (inst.removed) continue;
+    for (auto& arg : inst.args) arg = find(arg);
+  }
+  for (auto& block : blocks) {
+    auto removed = [&](uint32_t id) { return insts[id].removed; };
+    block.code.erase(std::remove_if(block.code.begin(), block.code.end(), removed), block.code.end());
+  }
+}
+
+void IrFunction::remove_edge(uint32_t from, uint32_t to) {
+  auto& succs = blocks[from].succs;
+  auto s = std::find(succs.begin(), succs.end(), to);
+  if (s != succs.end()) succs.erase(s);
+  auto& preds = blocks[to].preds;
+  auto p = std::find(preds.begin(), preds.end(), from);
+  if (p == preds.end()) return;
+  size_t k = p - preds.begin();
+  preds.erase(p);
+  for (auto id : blocks[to].code) {
+    if (insts[id].op == IR_PHI && !insts[id].removed) insts[id].args.erase(insts[id].args.begin() + k);
+  }
+}
+
+void IrFunction::remove_unreachable() {
+  std::vector<bool> reached(blocks.size(), false);
+  for (auto b : reverse_postorder()) reached[b] = true;
+  for (uint32_t b = 0; b < blocks.size(); b++) {
+    if (reached[b] || blocks[b].removed) continue;
+    while (!blocks[b].succs.empty()) remove_edge(b, blocks[b].succs.back());
+    blocks[b].removed = true;
+    for (auto id : blocks[b].code) insts[id].removed = true;
+    blocks[b].code.clear();
+  }
+}
+
+// A block that only one other block jumps to, unconditionally, becomes
+// the end of that one. This undoes the splitting inlining does.
+void IrFunction::merge_blocks() {
+  for (uint32_t b = 0; b < blocks.size(); b++) {
+    if (blocks[b].removed) continue;
+    while (blocks[b].succs.size() == 1) {
+      uint32_t s = blocks[b].succs[0];
+      IrBlock& next = blocks[s];
+      if (s == b || next.preds.size() != 1) break;
+      // with one predecessor, a phi is just its only operand
+      for (auto id : next.code) {
+        if (insts[id].op == IR_PHI) replace(id, insts[id].args[0]);
+      }
+      auto& code = blocks[b].code;
+      insts[code.back()].removed = true;
+      code.pop_back();
+      for (auto id : next.code) {
+        if (insts[id].removed) continue;
+        insts[id].block = b;
+        code.push_back(id);
+      }
+      blocks[b].succs = next.succs;
+      for (auto t : next.succs) {
+        for (auto& p : blocks[t].preds) {
+          if (p == s) p = b;
+        }
+      }
+      next.succs.clear();
+      next.preds.clear();
+      next.code.clear();
+      next.removed = true;
+    }
+  }
+  resolve();
+}
+
+std::vector<uint32_t> IrFunction::reverse_postorder() {
+  std::vector<uint32_t> order;
+  std::vector<bool> seen(blocks.size(), false);
+  // explicit stack of (block, next successor)
+  std::vector<std::pair<uint32_t, size_t>> stack;
+  stack.push_back({0, 0});
+  seen[0] = true;
+  while (!stack.empty()) {
+    auto& top = stack.back();
+    const auto& succs = blocks[top.first].succs;
+    if (top.second < succs.size()) {
+      uint32_t s = succs[top.second++];
+      if (!seen[s]) {
+        seen[s] = true;
+        stack.push_back({s, 0});
+      }
+    } else {
+      order.push_back(top.first);
+      stack.pop_back();
+    }
+  }
+  std::reverse(order.begin(), order.end());
+  return order;
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+std::vector<uint32_t> IrFunction::dominators(const std::vector<uint32_t>& order) {
+  std::vector<uint32_t> number(blocks.size(), no_value);
+  for (size_t i = 0; i < order.size(); i++) number[order[i]] = i;
+  std::vector<uint32_t> idom(blocks.size(), no_value);
+  idom[order[0]] = order[0];
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t i = 1; i < order.size(); i++) {
+      uint32_t b = order[i];
+      uint32_t dom = no_value;
+      for (auto p : blocks[b].preds) {
+        if (idom[p] == no_value) continue;
+        if (dom == no_value) {
+          dom = p;
+          continue;
+        }
+        uint32_t x = p;
+        uint32_t y = dom;
+        while (x != y) {
+          while (number[x] > number[y]) x = idom[x];
+          while (number[y] > number[x]) y = idom[y];
+        }
+        dom = x;
+      }
+      if (idom[b] != dom) {
+        idom[b] = dom;
+        changed = true;
+      }
+    }
+  }
+  return idom;
+}
+
+size_t IrFunction::size() const {
+  size_t n = 0;
+  for (auto& block : blocks) {
+    if (block.removed) continue;
+    for (auto id : block.code) n += !insts[id].removed;
+  }
+  return n;
+}
+
+size_t IrFunction::block_count() const {
+  size_t n = 0;
+  for (auto& block : blocks) n += !block.removed;
+  return n;
+}
+
+// SSA construction as in Braun et al., "Simple and Efficient Construction
+// of Static Single Assignment Form". Bytecode registers are the variables.
+class SsaBuilder {
+private:
+  const Program& program;
+  const Function& fn;
+  IrFunction& f;
+  std::vector<std::map<int32_t, uint32_t>> defs;
+  std::vector<std::vector<std::pair<int32_t, uint32_t>>> incomplete;
+  std::vector<bool> sealed;
+  std::vector<bool> filled;
+  uint32_t undef = no_value;
+
+  uint32_t new_phi(uint32_t block);
+  uint32_t get_undef();
+  uint32_t read(int32_t reg, uint32_t block);
+  uint32_t add_phi_operands(int32_t reg, uint32_t phi);
+  uint32_t remove_trivial(uint32_t phi);
+  void seal(uint32_t block);
+  void fill(uint32_t block, size_t start, size_t end);
+public:
+  SsaBuilder(const Program& program, const Function& fn, IrFunction& f)
+    : program(program), fn(fn), f(f) {}
+  void build();
+};
+
+uint32_t SsaBuilder::new_phi(uint32_t block) {
+  uint32_t phi = f.add(block, IR_PHI);
+  // phis go first
+  auto& code = f.blocks[block].code;
+  code.pop_back();
+  code.insert(code.begin(), phi);
+  return phi;
+}
+
+uint32_t SsaBuilder::get_undef() {
+  if (undef != no_value) return undef;
+  undef = f.add(0, IR_UNDEF);
+  auto& code = f.blocks[0].code;
+  code.pop_back();
+  code.insert(code.begin(), undef);
+  return undef;
+}
+
+uint32_t SsaBuilder::read(int32_t reg, uint32_t block) {
+  auto found = defs[block].find(reg);
+  if (found != defs[block].end()) return f.find(found->second);
+  uint32_t value;
+  const auto& preds = f.blocks[block].preds;
+  if (!sealed[block]) {
+    value = new_phi(block);
+    incomplete[block].push_back({reg, value});
+  } else if (preds.empty()) {
+    value = get_undef();
+  } else if (preds.size() == 1) {
+    value = read(reg, preds[0]);
+  } else {
+    // break cycles through loops before looking at the predecessors
+    value = new_phi(block);
+    defs[block][reg] = value;
+    value = add_phi_operands(reg, value);
+  }
+  defs[block][reg] = value;
+  return value;
+}
+
+uint32_t SsaBuilder::add_phi_operands(int32_t reg, uint32_t phi) {
+  for (size_t k = 0; k < f.blocks[f.insts[phi].block].preds.size(); k++) {
+    uint32_t v = read(reg, f.blocks[f.insts[phi].block].preds[k]);
+    f.insts[phi].args.push_back(v);
+  }
+  return remove_trivial(phi);
+}
+
+uint32_t SsaBuilder::remove_trivial(uint32_t phi) {
+  uint32_t same = no_value;
+  for (auto arg : f.insts[phi].args) {
+    arg = f.find(arg);
+    if (arg == same || arg == phi) continue;
+    if (same != no_value) return phi;
+    same = arg;
+  }
+  if (same == no_value) same = get_undef();
+  f.replace(phi, same);
+  return same;
+}
+
+void SsaBuilder::seal(uint32_t block) {
+  for (auto& p : incomplete[block]) add_phi_operands(p.first, p.second);
+  incomplete[block].clear();
+  sealed[block] = true;
+}
+
+void SsaBuilder::fill(uint32_t block, size_t start, size_t end) {
+  bool terminated = false;
+  for (size_t i = start; i < end; i++) {
+    const Instruction& in = fn.code[i];
+    size_t line = fn.lines[i];
+    std::vector<uint32_t> args;
+    switch (shape_of(in.op)) {
+    case SHAPE_NONE:
+      break;
+    case SHAPE_LOAD:
+      break;
+    case SHAPE_UNARY:
+      args.push_back(read(in.b, block));
+      break;
+    case SHAPE_BINARY:
+      args.push_back(read(in.b, block));
+      args.push_back(read(in.c, block));
+      break;
+    case SHAPE_SETFIELD:
+      args.push_back(read(in.a, block));
+      args.push_back(read(in.c, block));
+      break;
+    case SHAPE_STORE:
+      args.push_back(read(in.a, block));
+      args.push_back(read(in.b, block));
+      args.push_back(read(in.c, block));
+      break;
+    case SHAPE_USE:
+      args.push_back(read(in.a, block));
+      break;
+    case SHAPE_CALL:
+      for (uint32_t k = 0; k < program.functions[in.b].params; k++) args.push_back(read(in.c + k, block));
+      break;
+    case SHAPE_CALLR:
+      args.push_back(read(in.c - 1, block));
+      for (int32_t k = 0; k < in.b; k++) args.push_back(read(in.c + k, block));
+      break;
+    case SHAPE_NEW:
+      for (int32_t k = 0; k < in.b; k++) args.push_back(read(in.c + k, block));
+      break;
+    case SHAPE_FRAME:
+      args.push_back(read(in.c, block));
+      break;
+    }
+    if (in.op == BC_NOP) continue;
+    if (in.op == BC_MOVE) {
+      // copies vanish: the destination just names the same value
+      defs[block][in.a] = args[0];
+      continue;
+    }
+    uint16_t op = in.op;
+    if (op == BC_JF) op = BC_JT;
+    uint32_t v = f.add(block, op, in.b, in.c);
+    f.insts[v].args = args;
+    f.insts[v].line = line;
+    if (ir_defines_value(op)) defs[block][in.a] = v;
+    terminated = (op == BC_JMP || op == BC_JT || op == BC_JUMPTAB || op == BC_RET || op == BC_RETV || op == BC_DONE);
+  }
+  if (!terminated) {
+    uint32_t j = f.add(block, BC_JMP);
+    f.insts[j].line = fn.lines[end - 1];
+  }
+  filled[block] = true;
+}
+
+void SsaBuilder::build() {
+  size_t n = fn.code.size();
+  std::vector<bool> leader(n + 1, false);
+  leader[0] = true;
+  for (size_t i = 0; i < n; i++) {
+    const Instruction& in = fn.code[i];
+    switch (in.op) {
+    case BC_JMP:
+    case BC_JT:
+    case BC_JF:
+      leader[in.c] = true;
+      leader[i + 1] = true;
+      break;
+    case BC_JUMPTAB:
+      leader[in.c] = true;
+      for (auto t : fn.tables[in.b].targets) leader[t] = true;
+      leader[i + 1] = true;
+      break;
+    case BC_RET:
+    case BC_RETV:
+    case BC_DONE:
+      leader[i + 1] = true;
+      break;
+    default:
+      break;
+    }
+  }
+  // block 0 is a fresh entry holding the parameters, so that loops back
+  // to the first instruction don't see them as loop-carried
+  std::vector<size_t> starts;
+  std::vector<uint32_t> block_at(n + 1, 0);
+  for (size_t i = 0; i < n; i++) {
+    if (leader[i]) starts.push_back(i);
+    block_at[i] = starts.size();
+  }
+  starts.push_back(n);
+  size_t count = starts.size();
+  f.blocks.resize(count);
+  defs.resize(count);
+  incomplete.resize(count);
+  sealed.assign(count, false);
+  filled.assign(count, false);
+
+  auto edge = [&](uint32_t from, uint32_t to) {
+    f.blocks[from].succs.push_back(to);
+    f.blocks[to].preds.push_back(from);
+  };
+  f.tables = fn.tables;
+  for (auto& table : f.tables) {
+    for (auto& t : table.targets) t = block_at[t];
+  }
+  edge(0, 1);
+  for (uint32_t b = 1; b < count; b++) {
+    const Instruction& last = fn.code[starts[b] - 1];
+    uint32_t next = b + 1;
+    switch (last.op) {
+    case BC_JMP:
+      edge(b, block_at[last.c]);
+      break;
+    case BC_JT:
+      edge(b, block_at[last.c]);
+      edge(b, next);
+      break;
+    case BC_JF:
+      edge(b, next);
+      edge(b, block_at[last.c]);
+      break;
+    case BC_JUMPTAB:
+      edge(b, block_at[last.c]);
+      for (auto t : f.tables[last.b].targets) {
+        auto& succs = f.blocks[b].succs;
+        if (std::find(succs.begin(), succs.end(), t) == succs.end()) edge(b, t);
+      }
+      break;
+    case BC_RET:
+    case BC_RETV:
+    case BC_DONE:
+      break;
+    default:
+      edge(b, next);
+    }
+  }
+
+  for (uint32_t p = 0; p < fn.params; p++) {
+    uint32_t v = f.add(0, IR_PARAM, p);
+    defs[0][p] = v;
+  }
+  f.add(0, BC_JMP);
+  sealed[0] = true;
+  filled[0] = true;
+  // bytecode after a return can't be reached, and has nothing to say
+  f.remove_unreachable();
+  for (uint32_t b = 1; b < count; b++) {
+    if (f.blocks[b].removed) continue;
+    bool ready = true;
+    for (auto p : f.blocks[b].preds) ready = ready && filled[p];
+    if (ready && !sealed[b]) seal(b);
+    fill(b, starts[b - 1], starts[b]);
+    for (auto s : f.blocks[b].succs) {
+      bool all = true;
+      for (auto p : f.blocks[s].preds) all = all && filled[p];
+      if (all && !sealed[s]) seal(s);
+    }
+  }
+  for (uint32_t b = 0; b < count; b++) {
+    if (!sealed[b] && !f.blocks[b].removed) seal(b);
+  }
+  // phis made trivial by later ones
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (uint32_t id = 0; id < f.insts.size(); id++) {
+      if (f.insts[id].op != IR_PHI || f.insts[id].removed) continue;
+      if (remove_trivial(id) != id) changed = true;
+    }
+  }
+  f.resolve();
+}
+
+IrFunction build_ir(const Program& program, uint32_t index) {
+  IrFunction f;
+  f.index = index;
+  f.params = program.functions[index].params;
+  f.generator = program.functions[index].generator;
+  SsaBuilder(program, program.functions[index], f).build();
+  return f;
+}
+
+// an instruction in its final order, before registers are assigned
+struct Lowered {
+  uint16_t op;
+  int32_t b;
+  int32_t c;
+  uint32_t def;
+  std::vector<uint32_t> uses;
+  size_t line;
+  // label for jumps
+  uint32_t target = no_value;
+};
+
+// Copies for the phis of `to` on the edge from `from`. They happen at
+// once, so they are ordered to never overwrite a value a later one
+// reads, with a temporary to break cycles.
+static void phi_copies(IrFunction& f, uint32_t from, uint32_t to, uint32_t& next_temp,
+                       std::vector<Lowered>& out) {
+  const IrBlock& block = f.blocks[to];
+  size_t k = std::find(block.preds.begin(), block.preds.end(), from) - block.preds.begin();
+  std::vector<std::pair<uint32_t, uint32_t>> pending;
+  size_t line = f.insts[f.blocks[from].code.back()].line;
+  for (auto id : block.code) {
+    if (f.insts[id].op != IR_PHI) continue;
+    uint32_t src = f.insts[id].args[k];
+    if (src != id) pending.push_back({id, src});
+  }
+  while (!pending.empty()) {
+    bool progress = false;
+    for (size_t i = 0; i < pending.size(); i++) {
+      uint32_t dst = pending[i].first;
+      bool read_later = false;
+      for (size_t j = 0; j < pending.size(); j++) read_later = read_later || (j != i && pending[j].second == dst);
+      if (read_later) continue;
+      out.push_back({BC_MOVE, 0, 0, dst, {pending[i].second}, line});
+      pending.erase(pending.begin() + i);
+      progress = true;
+      break;
+    }
+    if (progress) continue;
+    // a cycle: move one source aside
+    uint32_t temp = next_temp++;
+    uint32_t src = pending[0].second;
+    out.push_back({BC_MOVE, 0, 0, temp, {src}, line});
+    for (auto& p : pending) {
+      if (p.second == src) p.second = temp;
+    }
+  }
+}
+
+// Copies that coloring made trivial leave jumps to jumps and jumps to the
+// next instruction behind. Those go straight through or go away, along
+// with whatever nothing reaches any more, and a conditional jump over a
+// jump becomes the opposite one.
+static void tidy_jumps(Function& fn) {
+  auto& code = fn.code;
+  auto jumps = [](uint16_t op) { return op == BC_JMP || op == BC_JT || op == BC_JF || op == BC_JUMPTAB; };
+  for (bool changed = true; changed;) {
+    changed = false;
+    size_t n = code.size();
+    std::vector<bool> targeted(n + 1, false);
+    auto thread = [&](int32_t& to) {
+      for (size_t hops = 0; hops < n && (size_t)to < n && code[to].op == BC_JMP; hops++) {
+        if (code[to].c == to) break;
+        to = code[to].c;
+      }
+      targeted[to] = true;
+    };
+    for (auto& in : code) {
+      if (jumps(in.op)) thread(in.c);
+    }
+    for (auto& table : fn.tables) {
+      for (auto& t : table.targets) thread(t);
+    }
+    std::vector<bool> keep(n, true);
+    bool falls = true;
+    for (size_t i = 0; i < n; i++) {
+      uint16_t op = code[i].op;
+      if (!falls && !targeted[i]) keep[i] = false;
+      else falls = !(op == BC_JMP || op == BC_JUMPTAB || op == BC_RET || op == BC_RETV || op == BC_DONE);
+    }
+    for (size_t i = 0; i < n; i++) {
+      Instruction& in = code[i];
+      if (!keep[i]) continue;
+      if (in.op == BC_NOP || (in.op == BC_JMP && (size_t)in.c == i + 1)) {
+        keep[i] = false;
+      } else if ((in.op == BC_JT || in.op == BC_JF) && (size_t)in.c == i + 2 &&
+                 code[i + 1].op == BC_JMP && keep[i + 1] && !targeted[i + 1]) {
+        in.op = (in.op == BC_JT ? BC_JF : BC_JT);
+        in.c = code[i + 1].c;
+        keep[i + 1] = false;
+        i++;
+      }
+    }
+    // a removed instruction's place goes to the one after it
+    std::vector<int32_t> moved(n + 1);
+    int32_t at = 0;
+    for (size_t i = 0; i < n; i++) {
+      moved[i] = at;
+      at += keep[i];
+    }
+    moved[n] = at;
+    if ((size_t)at == n) break;
+    changed = true;
+    size_t out = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (!keep[i]) continue;
+      code[out] = code[i];
+      fn.lines[out] = fn.lines[i];
+      if (jumps(code[out].op)) code[out].c = moved[code[out].c];
+      out++;
+    }
+    for (auto& table : fn.tables) {
+      for (auto& t : table.targets) t = moved[t];
+    }
+    code.resize(out);
+    fn.lines.resize(out);
+  }
+}
+
+void lower_ir(Program& program, IrFunction& f) {
+  f.remove_unreachable();
+  f.merge_blocks();
+  std::vector<uint32_t> order;
+  for (uint32_t b = 0; b < f.blocks.size(); b++) {
+    if (!f.blocks[b].removed) order.push_back(b);
+  }
+  // labels 0..blocks-1 are blocks, the rest are edges with copies
+  std::vector<Lowered> code;
+  std::vector<size_t> label_at(f.blocks.size(), 0);
+  // the label for each entry of each table
+  std::vector<std::vector<uint32_t>> table_labels(f.tables.size());
+  uint32_t next_temp = f.insts.size();
+  for (size_t i = 0; i < order.size(); i++) {
+    uint32_t b = order[i];
+    uint32_t next = (i + 1 < order.size() ? order[i + 1] : no_value);
+    label_at[b] = code.size();
+    for (auto id : f.blocks[b].code) {
+      const IrInst& inst = f.insts[id];
+      switch (inst.op) {
+      case IR_PHI:
+      case IR_PARAM:
+        break;
+      case IR_UNDEF:
+        code.push_back({BC_LOADI, 0, 0, id, {}, inst.line});
+        break;
+      case BC_JMP: {
+        uint32_t s = f.blocks[b].succs[0];
+        phi_copies(f, b, s, next_temp, code);
+        if (s != next) code.push_back({BC_JMP, 0, 0, no_value, {}, inst.line, s});
+      } break;
+      case BC_JT: {
+        // jump to one side, falling through to the block after if we can
+        uint16_t op = BC_JT;
+        uint32_t jump_to = f.blocks[b].succs[0];
+        uint32_t fall_to = f.blocks[b].succs[1];
+        if (jump_to == next) {
+          op = BC_JF;
+          std::swap(jump_to, fall_to);
+        }
+        std::vector<Lowered> jump_copies;
+        phi_copies(f, b, jump_to, next_temp, jump_copies);
+        uint32_t edge = no_value;
+        if (jump_copies.empty()) {
+          code.push_back({op, 0, 0, no_value, inst.args, inst.line, jump_to});
+        } else {
+          edge = label_at.size();
+          label_at.push_back(0);
+          code.push_back({op, 0, 0, no_value, inst.args, inst.line, edge});
+        }
+        phi_copies(f, b, fall_to, next_temp, code);
+        if (fall_to != next || edge != no_value) {
+          code.push_back({BC_JMP, 0, 0, no_value, {}, inst.line, fall_to});
+        }
+        if (edge != no_value) {
+          label_at[edge] = code.size();
+          code.insert(code.end(), jump_copies.begin(), jump_copies.end());
+          code.push_back({BC_JMP, 0, 0, no_value, {}, inst.line, jump_to});
+        }
+      } break;
+      case BC_JUMPTAB: {
+        // nothing falls through, so edges with copies go right after
+        std::map<uint32_t, uint32_t> label_of;
+        std::vector<std::pair<uint32_t, std::vector<Lowered>>> edges;
+        for (auto s : f.blocks[b].succs) {
+          std::vector<Lowered> copies;
+          phi_copies(f, b, s, next_temp, copies);
+          label_of[s] = s;
+          if (copies.empty()) continue;
+          label_of[s] = label_at.size();
+          label_at.push_back(0);
+          edges.push_back({s, copies});
+        }
+        code.push_back({BC_JUMPTAB, inst.b, 0, no_value, inst.args, inst.line, label_of[f.blocks[b].succs[0]]});
+        for (auto t : f.tables[inst.b].targets) table_labels[inst.b].push_back(label_of[t]);
+        for (auto& e : edges) {
+          label_at[label_of[e.first]] = code.size();
+          code.insert(code.end(), e.second.begin(), e.second.end());
+          code.push_back({BC_JMP, 0, 0, no_value, {}, inst.line, e.first});
+        }
+      } break;
+      default: {
+        uint32_t def = (ir_defines_value(inst.op) ? id : no_value);
+        code.push_back({inst.op, inst.b, inst.c, def, inst.args, inst.line});
+      }
+      }
+    }
+  }
+
+  // Registers are assigned by coloring the interference graph from a
+  // liveness analysis of the final code, preferring the register of the
+  // other side of a copy so that the copy goes away. Parameters must stay
+  // where the caller put them.
+  size_t values = next_temp;
+  std::vector<std::vector<size_t>> succs(code.size());
+  for (size_t i = 0; i < code.size(); i++) {
+    uint16_t op = code[i].op;
+    if (code[i].target != no_value) succs[i].push_back(label_at[code[i].target]);
+    if (op == BC_JUMPTAB) {
+      for (auto t : table_labels[code[i].b]) succs[i].push_back(label_at[t]);
+    }
+    bool ends = (op == BC_JMP || op == BC_JUMPTAB || op == BC_RET || op == BC_RETV || op == BC_DONE);
+    if (!ends && i + 1 < code.size()) succs[i].push_back(i + 1);
+  }
+  // straight-line runs, split at jumps and jump targets
+  std::vector<bool> starts_run(code.size() + 1, false);
+  starts_run[0] = true;
+  for (size_t i = 0; i < code.size(); i++) {
+    if (code[i].target != no_value) {
+      starts_run[label_at[code[i].target]] = true;
+      starts_run[i + 1] = true;
+    }
+    uint16_t op = code[i].op;
+    if (op == BC_JUMPTAB) {
+      for (auto t : table_labels[code[i].b]) starts_run[label_at[t]] = true;
+    }
+    if (op == BC_RET || op == BC_RETV || op == BC_DONE) starts_run[i + 1] = true;
+  }
+  std::vector<size_t> run_first;
+  std::vector<size_t> run_of(code.size());
+  for (size_t i = 0; i < code.size(); i++) {
+    if (starts_run[i]) run_first.push_back(i);
+    run_of[i] = run_first.size() - 1;
+  }
+  run_first.push_back(code.size());
+  size_t runs = run_first.size() - 1;
+  typedef std::vector<uint32_t> Set;
+  auto step = [&](size_t i, Set& live) {
+    const Lowered& l = code[i];
+    if (l.def != no_value) {
+      auto d = std::lower_bound(live.begin(), live.end(), l.def);
+      if (d != live.end() && *d == l.def) live.erase(d);
+    }
+    for (auto u : l.uses) {
+      auto at = std::lower_bound(live.begin(), live.end(), u);
+      if (at == live.end() || *at != u) live.insert(at, u);
+    }
+  };
+  std::vector<Set> live_in(runs);
+  std::vector<Set> live_out(runs);
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t r = runs; r-- > 0;) {
+      Set out;
+      for (auto s : succs[run_first[r + 1] - 1]) {
+        Set merged;
+        std::set_union(out.begin(), out.end(), live_in[run_of[s]].begin(), live_in[run_of[s]].end(),
+                       std::back_inserter(merged));
+        out.swap(merged);
+      }
+      Set live = out;
+      for (size_t i = run_first[r + 1]; i-- > run_first[r];) step(i, live);
+      live_out[r].swap(out);
+      if (live != live_in[r]) {
+        live_in[r].swap(live);
+        changed = true;
+      }
+    }
+  }
+  std::vector<std::vector<uint32_t>> interferes(values);
+  std::vector<std::vector<uint32_t>> hints(values);
+  // the generator handles live across each yield
+  std::map<size_t, Set> suspended;
+  for (size_t r = 0; r < runs; r++) {
+    Set live = live_out[r];
+    for (size_t i = run_first[r + 1]; i-- > run_first[r];) {
+      const Lowered& l = code[i];
+      if (l.op == BC_YIELD) {
+        for (auto v : live) {
+          if (v < f.insts.size() && f.insts[v].op == BC_GENSTART) suspended[i].push_back(v);
+        }
+      }
+      if (l.def != no_value) {
+        // a copy doesn't make its source and destination interfere
+        uint32_t source = (l.op == BC_MOVE ? l.uses[0] : no_value);
+        for (auto v : live) {
+          if (v == l.def || v == source) continue;
+          interferes[l.def].push_back(v);
+          interferes[v].push_back(l.def);
+        }
+        if (source != no_value) {
+          hints[l.def].push_back(source);
+          hints[source].push_back(l.def);
+        }
+      }
+      step(i, live);
+    }
+  }
+  for (auto id : f.blocks[0].code) {
+    if (f.insts[id].op != IR_PARAM) continue;
+    // every parameter is live on entry, used or not
+    for (auto other : f.blocks[0].code) {
+      if (other != id && f.insts[other].op == IR_PARAM) interferes[id].push_back(other);
+    }
+  }
+  std::vector<int32_t> reg(values, -1);
+  for (auto id : f.blocks[0].code) {
+    if (f.insts[id].op == IR_PARAM) reg[id] = f.insts[id].b;
+  }
+  // A generator iterated in place gets a window of registers above all
+  // the others for its frame, so its handle and whether it goes on are
+  // both just places in that window.
+  auto in_place = [&](uint32_t handle) {
+    return handle < f.insts.size() && f.insts[handle].op == BC_GENSTART && !f.pooled.count(f.insts[handle].b);
+  };
+  auto no_register = [&](const Lowered& l) {
+    return (l.op == BC_GENSTART && in_place(l.def)) || (l.op == BC_GENLIVE && in_place(l.uses[0]));
+  };
+  // a generator keeps where to resume right after its parameters
+  int32_t registers = f.params + f.generator;
+  std::vector<bool> taken;
+  for (size_t i = 0; i < code.size(); i++) {
+    uint32_t v = code[i].def;
+    if (v == no_value || reg[v] != -1 || no_register(code[i])) continue;
+    taken.assign(registers, false);
+    if (f.generator) taken[f.params] = true;
+    for (auto other : interferes[v]) {
+      if (reg[other] != -1) taken[reg[other]] = true;
+    }
+    for (auto other : hints[v]) {
+      if (reg[other] != -1 && !taken[reg[other]]) {
+        reg[v] = reg[other];
+        break;
+      }
+    }
+    for (int32_t r = 0; reg[v] == -1 && r < registers; r++) {
+      if (!taken[r]) reg[v] = r;
+    }
+    if (reg[v] == -1) reg[v] = registers++;
+  }
+  // Windows are stacked like the loops that own them: one goes above
+  // those of the handles live where it starts.
+  std::map<uint32_t, int32_t> window;
+  int32_t windows = 0;
+  auto window_size = [&](uint32_t handle) {
+    return (int32_t)program.functions[f.insts[handle].b].registers;
+  };
+  for (size_t i = 0; i < code.size(); i++) {
+    if (code[i].op != BC_GENSTART || !in_place(code[i].def)) continue;
+    uint32_t v = code[i].def;
+    int32_t at = registers;
+    for (auto other : interferes[v]) {
+      auto w = window.find(other);
+      if (w != window.end()) at = std::max(at, w->second + window_size(other));
+    }
+    window[v] = at;
+    windows = std::max(windows, at + window_size(v) - registers);
+  }
+  for (size_t i = 0; i < code.size(); i++) {
+    const Lowered& l = code[i];
+    if (l.op == BC_GENLIVE && in_place(l.uses[0])) {
+      reg[l.def] = window[l.uses[0]] + program.functions[l.b].params;
+    }
+  }
+  // Arguments are copied to the top of the frame, so that the callee's
+  // registers never overlap a value that is still live.
+  int32_t top = registers + windows;
+  int32_t extra = 0;
+
+  Function& fn = program.functions[f.index];
+  fn.code.clear();
+  fn.lines.clear();
+  fn.suspended.clear();
+  std::vector<size_t> position(code.size() + 1, 0);
+  std::vector<std::pair<size_t, uint32_t>> jumps;
+  auto emit = [&](uint16_t op, int32_t a, int32_t b, int32_t c, size_t line) {
+    Instruction in;
+    in.op = op;
+    in.a = a;
+    in.b = b;
+    in.c = c;
+    fn.code.push_back(in);
+    fn.lines.push_back(line);
+  };
+  for (size_t i = 0; i < code.size(); i++) {
+    position[i] = fn.code.size();
+    const Lowered& l = code[i];
+    int32_t a = (l.def != no_value ? reg[l.def] : 0);
+    auto r = [&](size_t k) { return reg[l.uses[k]]; };
+    switch (shape_of(l.op)) {
+    case SHAPE_NONE:
+    case SHAPE_LOAD:
+      if (l.target != no_value) jumps.push_back({fn.code.size(), l.target});
+      emit(l.op, a, l.b, l.c, l.line);
+      break;
+    case SHAPE_UNARY:
+      if (l.op == BC_MOVE && a == r(0)) break;
+      emit(l.op, a, r(0), l.c, l.line);
+      break;
+    case SHAPE_BINARY:
+      emit(l.op, a, r(0), r(1), l.line);
+      break;
+    case SHAPE_SETFIELD:
+      emit(l.op, r(0), l.b, r(1), l.line);
+      break;
+    case SHAPE_STORE:
+      emit(l.op, r(0), r(1), r(2), l.line);
+      break;
+    case SHAPE_USE:
+      if (l.op == BC_GENFREE && in_place(l.uses[0])) {
+        // only needed to free what the generator left suspended
+        int32_t g = f.insts[l.uses[0]].b;
+        if (!program.functions[g].suspended.empty()) emit(BC_GENFREE, window[l.uses[0]], g, 1, l.line);
+        break;
+      }
+      if (l.op == BC_YIELD) {
+        std::vector<Suspended> frames;
+        for (auto v : suspended[i]) {
+          int32_t g = f.insts[v].b;
+          if (!in_place(v)) frames.push_back({(uint32_t)g, reg[v], true});
+          else if (!program.functions[g].suspended.empty()) frames.push_back({(uint32_t)g, window[v], false});
+        }
+        int32_t index = 0;
+        if (!frames.empty()) {
+          fn.suspended.push_back(std::move(frames));
+          index = fn.suspended.size();
+        }
+        emit(BC_YIELD, r(0), index, 0, l.line);
+        break;
+      }
+      if (l.target != no_value) jumps.push_back({fn.code.size(), l.target});
+      emit(l.op, r(0), l.b, l.c, l.line);
+      break;
+    case SHAPE_CALL:
+    case SHAPE_CALLR:
+    case SHAPE_NEW: {
+      for (size_t k = 0; k < l.uses.size(); k++) emit(BC_MOVE, top + k, r(k), 0, l.line);
+      extra = std::max<int32_t>(extra, l.uses.size());
+      int32_t first = top + (l.op == BC_CALLR);
+      if (l.op != BC_GENSTART) emit(l.op, a, l.b, first, l.line);
+      else if (in_place(l.def)) emit(BC_GENSTART, window[l.def], l.b, first, l.line);
+      else emit(BC_GENNEW, a, l.b, first, l.line);
+    } break;
+    case SHAPE_FRAME:
+      if (in_place(l.uses[0])) {
+        if (l.op == BC_RESUME) emit(BC_RESUME, a, l.b, window[l.uses[0]], l.line);
+      } else if (l.op == BC_RESUME) {
+        emit(BC_RESUMEP, a, r(0), top, l.line);
+      } else {
+        emit(BC_GENLIVE, a, l.b, top, l.line);
+      }
+      break;
+    }
+  }
+  position[code.size()] = fn.code.size();
+  for (auto& j : jumps) {
+    fn.code[j.first].c = position[label_at[j.second]];
+  }
+  fn.tables.assign(f.tables.size(), JumpTable());
+  for (size_t t = 0; t < f.tables.size(); t++) {
+    fn.tables[t].low = f.tables[t].low;
+    for (auto label : table_labels[t]) fn.tables[t].targets.push_back(position[label_at[label]]);
+  }
+  tidy_jumps(fn);
+  fn.registers = top + extra;
+}
+
+const IrFunction* IrModule::function(uint32_t index) {
+  if (index >= first && index - first < functions.size()) return &functions[index - first];
+  auto found = others.find(index);
+  if (found != others.end()) return &found->second;
+  const Function& fn = program.functions[index];
+  if (fn.code.empty()) return nullptr;
+  for (auto& in : fn.code) {
+    if (in.op == BC_GENSTART || in.op == BC_GENNEW) return nullptr;
+  }
+  return &(others[index] = build_ir(program, index));
+}
+
+void PassManager::add(const std::string& name, Pass pass) {
+  passes.push_back({name, pass});
+  PassStats s;
+  s.name = name;
+  stats.push_back(s);
+}
+
+void PassManager::run(Program& program, uint32_t first, uint32_t count) {
+  typedef std::chrono::steady_clock clock;
+  auto t = clock::now();
+  lowered.resize(program.functions.size(), false);
+  IrModule module{program, first, {}, {}};
+  for (uint32_t i = first; i < first + count; i++) {
+    module.functions.push_back(build_ir(program, i));
+  }
+  build_seconds += std::chrono::duration<double>(clock::now() - t).count();
+  // Callees go through every pass before their callers, so that what gets
+  // inlined is already optimized.
+  std::vector<uint8_t> state(count, 0);
+  std::vector<uint32_t> order;
+  std::vector<std::pair<uint32_t, size_t>> stack;
+  for (uint32_t root = 0; root < count; root++) {
+    if (state[root]) continue;
+    state[root] = 1;
+    stack.push_back({root, 0});
+    while (!stack.empty()) {
+      const IrFunction& f = module.functions[stack.back().first];
+      size_t& at = stack.back().second;
+      if (at == f.insts.size()) {
+        order.push_back(stack.back().first);
+        stack.pop_back();
+        continue;
+      }
+      const IrInst& inst = f.insts[at++];
+      if (inst.op != BC_CALL || (uint32_t)inst.b < first || (uint32_t)inst.b - first >= count) continue;
+      if (state[inst.b - first] == 0) {
+        state[inst.b - first] = 1;
+        stack.push_back({(uint32_t)inst.b - first, 0});
+      }
+    }
+  }
+  for (auto i : order) {
+    IrFunction& f = module.functions[i];
+    for (size_t p = 0; p < passes.size(); p++) {
+      PassStats& s = stats[p];
+      s.insts_before += f.size();
+      s.blocks_before += f.block_count();
+      t = clock::now();
+      passes[p].second(module, f);
+      s.seconds += std::chrono::duration<double>(clock::now() - t).count();
+      s.insts_after += f.size();
+      s.blocks_after += f.block_count();
+    }
+  }
+  t = clock::now();
+  // A frame in place needs the final size of the generator's, so those
+  // are lowered first. Iterating a generator already on the way there
+  // means its frame would contain itself, so that one is pooled instead,
+  // as is one of another unit that isn't lowered yet.
+  state.assign(count, 0);
+  for (uint32_t root = 0; root < count; root++) {
+    if (state[root]) continue;
+    state[root] = 1;
+    stack.push_back({root, 0});
+    while (!stack.empty()) {
+      IrFunction& f = module.functions[stack.back().first];
+      size_t& at = stack.back().second;
+      if (at == f.insts.size()) {
+        lower_ir(program, f);
+        lowered[f.index] = true;
+        state[f.index - first] = 2;
+        stack.pop_back();
+        continue;
+      }
+      const IrInst& inst = f.insts[at++];
+      if (inst.removed || inst.op != BC_GENSTART) continue;
+      if ((uint32_t)inst.b < first || (uint32_t)inst.b - first >= count) {
+        if (!lowered[inst.b]) f.pooled.insert(inst.b);
+        continue;
+      }
+      if (state[inst.b - first] == 1) f.pooled.insert(inst.b);
+      if (state[inst.b - first] == 0) {
+        state[inst.b - first] = 1;
+        stack.push_back({(uint32_t)inst.b - first, 0});
+      }
+    }
+  }
+  lower_seconds += std::chrono::duration<double>(clock::now() - t).count();
+}
+
+void PassManager::print_stats(std::ostream& out) {
+  // each column padded to its heading, and followed by a space even if wider
+  auto row = [&](const std::string& name, double seconds, const std::string& rest) {
+    std::ostringstream line;
+    line << std::left << std::setw(11) << name << ' ' << std::fixed << std::setprecision(3);
+    if (rest.empty()) line << seconds * 1000;
+    else line << std::setw(9) << seconds * 1000 << ' ' << rest;
+    out << line.str() << std::endl;
+  };
+  out << "pass        ms        instructions      blocks" << std::endl;
+  row("build", build_seconds, "");
+  for (auto& s : stats) {
+    std::string insts = std::to_string(s.insts_before) + " -> " + std::to_string(s.insts_after);
+    if (insts.size() < 17) insts.resize(17, ' ');
+    row(s.name, s.seconds, insts + " " + std::to_string(s.blocks_before) + " -> " + std::to_string(s.blocks_after));
+  }
+  row("lower", lower_seconds, "");
+}
+
+void add_default_passes(PassManager& passes) {
+  passes.add("inline", inline_calls);
+  passes.add("fold", fold_constants);
+  passes.add("cse", eliminate_common_subexpressions);
+  passes.add("dce", eliminate_dead_code);
+}
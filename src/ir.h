@@ -0,0 +1,133 @@
+#ifndef __VOOM_IR_H__
+#define __VOOM_IR_H__
+
+#include "bytecode.h"
+
+#include <functional>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// The mid-level IR is the bytecode in SSA form: every instruction defines
+// at most one value, operands name the instructions that defined them,
+// and control flow is explicit between basic blocks. Bytecode opcodes are
+// reused as they are, plus a few that only exist here.
+enum IrOpcode {
+  IR_PHI = 0x100,   // one operand per predecessor, in order
+  IR_PARAM,         // parameter b
+  IR_UNDEF,         // read of a register nothing wrote; lowered as 0
+};
+
+// A block ends with exactly one of BC_JMP, BC_JT, BC_JUMPTAB, BC_RET, BC_RETV
+// or BC_DONE. BC_JT goes to succs[0] if its operand is true and succs[1]
+// otherwise. BC_JUMPTAB goes to the blocks in tables[b], or succs[0] for
+// values outside it; each of those blocks is in succs once.
+struct IrInst {
+  uint16_t op = BC_NOP;
+  // the operands of the bytecode instruction that aren't registers
+  int32_t b = 0;
+  int32_t c = 0;
+  std::vector<uint32_t> args;
+  uint32_t block = 0;
+  size_t line = 0;
+  bool removed = false;
+};
+
+struct IrBlock {
+  // phis first, terminator last
+  std::vector<uint32_t> code;
+  std::vector<uint32_t> preds;
+  std::vector<uint32_t> succs;
+  bool removed = false;
+};
+
+struct IrFunction {
+  uint32_t index = 0;
+  uint32_t params = 0;
+  bool generator = false;
+  // generators iterated from a frame copied off the stack, because theirs
+  // could end up inside their own (see PassManager::run)
+  std::set<uint32_t> pooled;
+  std::vector<IrInst> insts;
+  std::vector<IrBlock> blocks;
+  // the targets of each BC_JUMPTAB, as blocks
+  std::vector<JumpTable> tables;
+  // replace() records here, resolve() rewrites operands
+  std::vector<uint32_t> forward;
+
+  uint32_t add(uint32_t block, uint16_t op, int32_t b = 0, int32_t c = 0);
+  uint32_t find(uint32_t value);
+  void replace(uint32_t value, uint32_t with);
+  void resolve();
+  void remove_edge(uint32_t from, uint32_t to);
+  void remove_unreachable();
+  void merge_blocks();
+  std::vector<uint32_t> reverse_postorder();
+  // immediate dominator of each block, in terms of reverse_postorder()
+  std::vector<uint32_t> dominators(const std::vector<uint32_t>& order);
+  size_t size() const;
+  size_t block_count() const;
+};
+
+// The functions of one unit, from program.functions[first] on.
+struct IrModule {
+  Program& program;
+  uint32_t first = 0;
+  std::vector<IrFunction> functions;
+  // those of other units that were asked for, built from their bytecode
+  std::map<uint32_t, IrFunction> others;
+
+  // Null if it has no bytecode yet, or iterates generators: once lowered,
+  // their frames are no longer one register.
+  const IrFunction* function(uint32_t index);
+};
+
+bool ir_defines_value(uint16_t op);
+// no side effects, and the same result for the same operands
+bool ir_is_pure(uint16_t op);
+// may stop the program with a runtime error
+bool ir_may_fail(const IrFunction& f, const IrInst& inst);
+
+IrFunction build_ir(const Program& program, uint32_t index);
+// replaces the code of program.functions[f.index]
+void lower_ir(Program& program, IrFunction& f);
+
+struct PassStats {
+  std::string name;
+  double seconds = 0;
+  // summed over every function the pass ran on
+  size_t insts_before = 0;
+  size_t insts_after = 0;
+  size_t blocks_before = 0;
+  size_t blocks_after = 0;
+};
+
+class PassManager {
+private:
+  typedef std::function<void(IrModule&, IrFunction&)> Pass;
+  std::vector<std::pair<std::string, Pass>> passes;
+  // by function, whether run() has lowered it
+  std::vector<bool> lowered;
+public:
+  std::vector<PassStats> stats;
+  double build_seconds = 0;
+  double lower_seconds = 0;
+
+  void add(const std::string& name, Pass pass);
+  // build functions first to first + count - 1, run every pass over
+  // each, and lower them back
+  void run(Program& program, uint32_t first, uint32_t count);
+  void print_stats(std::ostream& out);
+};
+
+void inline_calls(IrModule& module, IrFunction& f);
+void fold_constants(IrModule& module, IrFunction& f);
+void eliminate_common_subexpressions(IrModule& module, IrFunction& f);
+void eliminate_dead_code(IrModule& module, IrFunction& f);
+
+// the standard pipeline
+void add_default_passes(PassManager& passes);
+
+#endif
@@ -1,21 +1,64 @@
 #include "compiler.h"
 
 #include <iostream>
+#include <cstdlib>
 #include <cstring>
 
 bool is_help(char* arg) {
 	return std::strcmp(arg, "-h") == 0 || std::strcmp(arg, "--help") == 0;
 }
 
+int usage(char* name) {
+	std::cerr << "Usage:" << std::endl;
+	std::cerr << name << " [--memory-budget=MB] [--malloc] [--heap-stats] input_file" << std::endl;
+	std::cerr << name << " outline input_file" << std::endl;
+	std::cerr << name << " run input_file" << std::endl;
+	std::cerr << name << " build input_file" << std::endl;
+	std::cerr << name << " opt input_file" << std::endl;
+	std::cerr << "--memory-budget=MB keeps at most about MB of source and tokens loaded" << std::endl;
+	std::cerr << "--malloc runs with plain malloc and free instead of pools and regions" << std::endl;
+	std::cerr << "--heap-stats prints what run did with memory" << std::endl;
+	return 1;
+}
+
 int main(int argc, char** argv) {
-	if (argc != 2 || is_help(argv[1])) {
-		std::cerr << "Usage:" << std::endl;
-		std::cerr << argv[0] << " input_file" << std::endl;
-		return 1;
+	char* name = argv[0];
+	size_t budget = 0;
+	bool plain = false;
+	bool stats = false;
+	const char* option = "--memory-budget=";
+	while (argc > 1 && std::strncmp(argv[1], "--", 2) == 0 && !is_help(argv[1])) {
+		if (std::strcmp(argv[1], "--malloc") == 0) {
+			plain = true;
+		} else if (std::strcmp(argv[1], "--heap-stats") == 0) {
+			stats = true;
+		} else if (std::strncmp(argv[1], option, strlen(option)) == 0) {
+			char* end;
+			budget = std::strtoul(argv[1] + strlen(option), &end, 10);
+			if (*end || budget == 0) return usage(name);
+		} else {
+			return usage(name);
+		}
+		argc--;
+		argv++;
+	}
+	if (argc < 2 || argc > 3 || is_help(argv[1])) return usage(name);
+	const char* command = (argc == 3 ? argv[1] : "");
+	if (argc == 3 && std::strcmp(command, "outline") != 0 &&
+			std::strcmp(command, "run") != 0 && std::strcmp(command, "build") != 0 &&
+			std::strcmp(command, "opt") != 0) {
+		return usage(name);
 	}
   String fname;
-  fname.data = argv[1];
-  fname.count = strlen(argv[1]);
+  fname.data = argv[argc-1];
+  fname.count = strlen(argv[argc-1]);
 	Compiler c(fname);
+	c.memory_budget = budget << 20;
+	c.plain_malloc = plain;
+	c.heap_stats = stats;
+	if (std::strcmp(command, "outline") == 0) return c.outline();
+	if (std::strcmp(command, "run") == 0) return c.run();
+	if (std::strcmp(command, "build") == 0) return c.build();
+	if (std::strcmp(command, "opt") == 0) return c.optimize();
 	return c.compile();
 }
@@ -0,0 +1,1441 @@
+#include "native.h"
+#include "x86.h"
+
+#include <elf.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+static const uint64_t text_base = 0x400000;
+// Data lives at a fixed address, so its addresses are known while the
+// code that uses them is being generated.
+static const uint64_t data_base = 0x10000000;
+// the output buffer, which takes no space in the file
+static const uint64_t bss_base = 0x20000000;
+static const size_t headers_size = sizeof(Elf64_Ehdr) + 3 * sizeof(Elf64_Phdr);
+static const uint64_t code_base = text_base + headers_size;
+static const size_t page_size = 4096;
+static const int32_t out_buffer_size = 1 << 16;
+static const int64_t heap_chunk = 1 << 26;
+// the largest size with a free list every 16 bytes, see rt_alloc
+static const int64_t max_pooled = 256;
+// then one for each power of two, up to 2^63
+static const int64_t free_lists = max_pooled / 16 + 64 - 8;
+// the region is one chunk, and once that is full rt_local() goes to the heap
+static const int64_t region_size = heap_chunk;
+// how much of the stack the program may use before it is an overflow
+static const int64_t stack_reserve = 7 << 20;
+
+// Registers are handed out caller-saved first, since those cost nothing
+// unless the value is live across a call. rax, rcx and rdx are kept as
+// scratch for the instructions that need them.
+static const Reg caller_saved[] = {RSI, RDI, R8, R9, R10, R11};
+static const Reg callee_saved[] = {RBX, R12, R13, R14, R15};
+
+struct Interval {
+  int32_t vreg;
+  size_t start;
+  size_t end;
+  bool crosses_call;
+};
+
+class NativeCompiler {
+private:
+  const Program& program;
+  std::vector<uint8_t> data;
+
+  // runtime state
+  uint64_t heap_addr;         // next free byte, end of chunk
+  uint64_t free_lists_addr;   // the head of each size's free list
+  uint64_t region_addr;       // next free byte, end of the region
+  uint64_t stack_limit_addr;
+  uint64_t out_length_addr;
+  uint64_t out_buffer_addr = bss_base;
+  uint64_t function_table_addr;
+  uint64_t char_table_addr;   // a one character Str for every byte
+  // constant strs
+  uint64_t true_str, false_str, null_str, space_str, newline_str;
+  uint64_t error_prefix_str, error_line_str, error_separator_str, runtime_str;
+  uint64_t null_msg, index_msg, division_msg, stack_msg, memory_msg;
+  std::map<const void*, uint64_t> strings;
+  std::map<TypeId, uint64_t> enum_tables;
+  std::vector<uint64_t> function_names;
+
+  // Every runtime routine takes its arguments in rax, rcx and rdx and
+  // preserves every other register.
+  size_t rt_flush;      // write the output buffer to fd rax
+  size_t rt_write;      // append rcx bytes at rax to the output
+  size_t rt_print_str;  // rax = Str*
+  size_t rt_print_int;  // rax = int
+  size_t rt_fail;       // message rax, line rcx, function name rdx; exits
+  size_t rt_alloc;      // rax = size, returns the memory in rax
+  size_t rt_free;       // rax = memory of rcx bytes from rt_alloc, or static
+  size_t rt_local;      // rt_alloc, in the region
+  size_t rt_str_eq;     // rax = (rax == rcx) for Str*
+  size_t rt_str_hash;   // rax = str_hash(rax, seed rcx), 0 for null
+  size_t rt_concat;     // rax = rax + rcx for non-null Str*
+  size_t rt_concat_local; // rt_concat, in the region
+
+  std::vector<size_t> function_offsets;
+  // rel32 of every direct call, and the function it calls
+  std::vector<std::pair<size_t, uint32_t>> calls;
+
+  // the function being lowered
+  uint32_t index = 0;
+  const Function* fn = nullptr;
+  size_t ip = 0;
+  // physical register of each bytecode register, or NO_REG if on the stack
+  std::vector<Reg> location;
+  std::vector<int32_t> slot;
+  std::vector<Reg> saved;
+  int32_t frame_size = 0;
+  // native offset of each instruction
+  std::vector<size_t> labels;
+  // rel32, bytecode target
+  std::vector<std::pair<size_t, size_t>> jumps;
+  // where each JUMPTAB's addresses go, and which of fn->tables they are
+  std::vector<std::pair<uint64_t, int32_t>> tables;
+  std::vector<size_t> returns;
+  struct Failure {
+    size_t rel32;
+    uint64_t msg;
+    size_t line;
+  };
+  std::vector<Failure> failures;
+
+  void align_data();
+  uint64_t data_words(size_t count);
+  void set_word(uint64_t addr, int64_t value);
+  uint64_t data_str(const char* s, size_t length);
+  uint64_t data_str(const std::string& s);
+  uint64_t enum_table(TypeId type);
+
+  void call_rt(size_t routine);
+  void emit_runtime();
+
+  void operands(const Instruction& in, std::vector<int32_t>& out);
+  void allocate();
+  Reg get(int32_t vreg, Reg scratch);
+  void get_into(Reg dst, int32_t vreg);
+  void put(int32_t vreg, Reg src);
+  void load_immediate(int32_t vreg, int64_t value);
+  void fail(Condition cc, uint64_t msg);
+  void null_check(Reg r);
+  bool print(TypeId type);
+  bool unsupported(const char* what);
+  bool lower(const Instruction& in);
+  bool lower_function(uint32_t index);
+  void emit_entry();
+public:
+  Assembler a;
+  size_t entry = 0;
+
+  NativeCompiler(const Program& program);
+  bool compile();
+  bool write(const std::filesystem::path& out);
+};
+
+NativeCompiler::NativeCompiler(const Program& program) : program(program) {
+  heap_addr = data_words(2);
+  free_lists_addr = data_words(free_lists);
+  region_addr = data_words(2);
+  stack_limit_addr = data_words(1);
+  out_length_addr = data_words(1);
+  function_table_addr = data_words(program.functions.size());
+  char_table_addr = data_words(2 * 256);
+  for (int c = 0; c < 256; c++) {
+    set_word(char_table_addr + 16 * c, 1);
+    data[char_table_addr + 16 * c + 8 - data_base] = c;
+  }
+  true_str = data_str("true");
+  false_str = data_str("false");
+  null_str = data_str("null");
+  space_str = data_str(" ");
+  newline_str = data_str("\n");
+  error_prefix_str = data_str("runtime error in ");
+  error_line_str = data_str(" line ");
+  error_separator_str = data_str(": ");
+  runtime_str = data_str("runtime");
+  null_msg = data_str("null access");
+  index_msg = data_str("index out of range");
+  division_msg = data_str("division by zero");
+  stack_msg = data_str("stack overflow");
+  memory_msg = data_str("out of memory");
+  for (auto p : program.owned) {
+    const Str* s = (const Str*)p;
+    strings[p] = data_str(s->data, s->length);
+  }
+  for (auto& f : program.functions) function_names.push_back(data_str(f.name));
+}
+
+void NativeCompiler::align_data() {
+  while (data.size() % 8) data.push_back(0);
+}
+
+uint64_t NativeCompiler::data_words(size_t count) {
+  align_data();
+  uint64_t addr = data_base + data.size();
+  data.resize(data.size() + 8 * count);
+  return addr;
+}
+
+void NativeCompiler::set_word(uint64_t addr, int64_t value) {
+  std::memcpy(&data[addr - data_base], &value, 8);
+}
+
+uint64_t NativeCompiler::data_str(const char* s, size_t length) {
+  uint64_t addr = data_words(1 + (length + 7) / 8);
+  set_word(addr, length);
+  std::memcpy(&data[addr + 8 - data_base], s, length);
+  return addr;
+}
+
+uint64_t NativeCompiler::data_str(const std::string& s) {
+  return data_str(s.data(), s.size());
+}
+
+// a Str* for each value, so enums print the same as in the interpreter
+uint64_t NativeCompiler::enum_table(TypeId type) {
+  auto found = enum_tables.find(type);
+  if (found != enum_tables.end()) return found->second;
+  const Type& t = type_table.get(type);
+  std::vector<uint64_t> names;
+  for (auto& n : t.names) names.push_back(data_str(t.name + "." + n));
+  uint64_t table = data_words(names.size());
+  for (size_t i = 0; i < names.size(); i++) set_word(table + 8 * i, names[i]);
+  enum_tables[type] = table;
+  return table;
+}
+
+void NativeCompiler::call_rt(size_t routine) {
+  a.patch(a.call(), routine);
+}
+
+void NativeCompiler::emit_runtime() {
+  rt_flush = a.here();
+  a.push(RSI);
+  a.push(RDI);
+  a.push(R11);
+  a.mov(RDI, RAX);
+  a.mov(RSI, (int64_t)out_buffer_addr);
+  a.mov(RDX, (int64_t)out_length_addr);
+  a.load(RDX, {RDX});
+  size_t top = a.here();
+  a.test(RDX, RDX);
+  size_t empty = a.jcc(CC_E);
+  a.mov(RAX, 1); // write
+  a.syscall();
+  a.test(RAX, RAX);
+  size_t failed = a.jcc(CC_LE);
+  a.alu(ALU_ADD, RSI, RAX);
+  a.alu(ALU_SUB, RDX, RAX);
+  a.patch(a.jmp(), top);
+  a.patch(empty, a.here());
+  a.patch(failed, a.here());
+  a.mov(RAX, 0);
+  a.mov(RCX, (int64_t)out_length_addr);
+  a.store({RCX}, RAX);
+  a.pop(R11);
+  a.pop(RDI);
+  a.pop(RSI);
+  a.ret();
+
+  rt_write = a.here();
+  a.push(RSI);
+  a.push(RDI);
+  a.push(R8);
+  a.mov(RSI, RAX);
+  a.mov(RDI, RCX);
+  top = a.here();
+  a.test(RDI, RDI);
+  size_t done = a.jcc(CC_E);
+  a.mov(RDX, (int64_t)out_length_addr);
+  a.load(R8, {RDX});
+  a.alu(ALU_CMP, R8, out_buffer_size);
+  size_t room = a.jcc(CC_L);
+  a.mov(RAX, 1);
+  call_rt(rt_flush);
+  a.mov(R8, 0);
+  a.patch(room, a.here());
+  a.load_byte(RAX, {RSI});
+  a.mov(RDX, (int64_t)out_buffer_addr);
+  a.store_byte({RDX, 0, R8}, RAX);
+  a.alu(ALU_ADD, R8, 1);
+  a.mov(RDX, (int64_t)out_length_addr);
+  a.store({RDX}, R8);
+  a.alu(ALU_ADD, RSI, 1);
+  a.alu(ALU_SUB, RDI, 1);
+  a.patch(a.jmp(), top);
+  a.patch(done, a.here());
+  a.pop(R8);
+  a.pop(RDI);
+  a.pop(RSI);
+  a.ret();
+
+  rt_print_str = a.here();
+  a.test(RAX, RAX);
+  size_t is_null = a.jcc(CC_E);
+  a.load(RCX, {RAX});
+  a.alu(ALU_ADD, RAX, 8);
+  a.patch(a.jmp(), rt_write);
+  a.patch(is_null, a.here());
+  a.ret();
+
+  // digits are written backwards into a buffer on the stack
+  rt_print_int = a.here();
+  a.push(RSI);
+  a.push(RDI);
+  a.push(R8);
+  a.alu(ALU_SUB, RSP, 32);
+  a.lea(RSI, {RSP, 32});
+  a.mov(R8, RAX);
+  a.mov(RDI, 0);
+  a.test(R8, R8);
+  size_t positive = a.jcc(CC_NS);
+  // the unsigned division below gets INT64_MIN right too
+  a.neg(R8);
+  a.mov(RDI, 1);
+  a.patch(positive, a.here());
+  size_t digit = a.here();
+  a.mov(RAX, R8);
+  a.mov(RDX, 0);
+  a.mov(RCX, 10);
+  a.div(RCX);
+  a.alu(ALU_ADD, RDX, '0');
+  a.alu(ALU_SUB, RSI, 1);
+  a.store_byte({RSI}, RDX);
+  a.mov(R8, RAX);
+  a.test(R8, R8);
+  a.patch(a.jcc(CC_NE), digit);
+  a.test(RDI, RDI);
+  size_t no_sign = a.jcc(CC_E);
+  a.alu(ALU_SUB, RSI, 1);
+  a.mov(RDX, '-');
+  a.store_byte({RSI}, RDX);
+  a.patch(no_sign, a.here());
+  a.mov(RAX, RSI);
+  a.lea(RCX, {RSP, 32});
+  a.alu(ALU_SUB, RCX, RSI);
+  call_rt(rt_write);
+  a.alu(ALU_ADD, RSP, 32);
+  a.pop(R8);
+  a.pop(RDI);
+  a.pop(RSI);
+  a.ret();
+
+  // never returns, so nothing is preserved
+  rt_fail = a.here();
+  a.mov(R12, RAX);
+  a.mov(R13, RCX);
+  a.mov(R14, RDX);
+  a.mov(RAX, 1);
+  call_rt(rt_flush);
+  a.mov(RAX, (int64_t)error_prefix_str);
+  call_rt(rt_print_str);
+  a.mov(RAX, R14);
+  call_rt(rt_print_str);
+  a.mov(RAX, (int64_t)error_line_str);
+  call_rt(rt_print_str);
+  a.mov(RAX, R13);
+  call_rt(rt_print_int);
+  a.mov(RAX, (int64_t)error_separator_str);
+  call_rt(rt_print_str);
+  a.mov(RAX, R12);
+  call_rt(rt_print_str);
+  a.mov(RAX, (int64_t)newline_str);
+  call_rt(rt_print_str);
+  a.mov(RAX, 2);
+  call_rt(rt_flush);
+  a.mov(RDI, 1);
+  a.mov(RAX, 60); // exit
+  a.syscall();
+
+  // Sizes up to max_pooled are rounded up to a multiple of 16, and larger
+  // ones to a power of two. Each comes off that size's free list if
+  // rt_free() left anything there, or else is bumped off chunks from mmap.
+  rt_alloc = a.here();
+  a.push(RSI);
+  a.push(RDI);
+  a.push(R8);
+  a.push(R9);
+  a.push(R10);
+  a.push(R11);
+  a.alu(ALU_ADD, RAX, 7);
+  a.alu(ALU_AND, RAX, -8);
+  a.alu(ALU_CMP, RAX, max_pooled);
+  size_t large = a.jcc(CC_A);
+  a.alu(ALU_ADD, RAX, 15);
+  a.alu(ALU_AND, RAX, -16);
+  // the list for size n is at word n / 16
+  a.mov(RCX, RAX);
+  a.shr(RCX, 1);
+  size_t listed = a.jmp();
+  // and the one for 2^k at word max_pooled / 16 + k - 8
+  a.patch(large, a.here());
+  a.lea(RCX, {RAX, -1});
+  a.bsr(RCX, RCX);
+  a.alu(ALU_ADD, RCX, 1);
+  a.mov(RAX, 1);
+  a.shl_cl(RAX);
+  a.alu(ALU_ADD, RCX, max_pooled / 16 - 8);
+  for (int k = 0; k < 3; k++) a.alu(ALU_ADD, RCX, RCX);
+  a.patch(listed, a.here());
+  a.mov(RDX, (int64_t)free_lists_addr);
+  a.alu(ALU_ADD, RCX, RDX);
+  a.load(RSI, {RCX});
+  a.test(RSI, RSI);
+  size_t nothing_free = a.jcc(CC_E);
+  a.load(RDX, {RSI});
+  a.store({RCX}, RDX);
+  size_t reused = a.jmp();
+  a.patch(nothing_free, a.here());
+  a.mov(R8, RAX);
+  a.mov(RCX, (int64_t)heap_addr);
+  a.load(RSI, {RCX});
+  a.mov(RDX, RSI);
+  a.alu(ALU_ADD, RDX, R8);
+  a.load(RDI, {RCX, 8});
+  a.alu(ALU_CMP, RDX, RDI);
+  size_t fits = a.jcc(CC_BE);
+  a.mov(RSI, heap_chunk);
+  a.alu(ALU_CMP, R8, RSI);
+  size_t small = a.jcc(CC_BE);
+  a.mov(RSI, R8);
+  a.patch(small, a.here());
+  a.push(RSI);
+  a.push(R8);
+  a.mov(RAX, 9); // mmap
+  a.mov(RDI, 0);
+  a.mov(RDX, 3); // PROT_READ | PROT_WRITE
+  a.mov(R10, 0x22); // MAP_PRIVATE | MAP_ANONYMOUS
+  a.mov(R8, -1);
+  a.mov(R9, 0);
+  a.syscall();
+  a.pop(R8);
+  a.pop(RSI);
+  a.mov(RCX, -4096);
+  a.alu(ALU_CMP, RAX, RCX);
+  size_t mapped = a.jcc(CC_BE);
+  a.mov(RAX, (int64_t)memory_msg);
+  a.mov(RCX, 0);
+  a.mov(RDX, (int64_t)runtime_str);
+  a.patch(a.jmp(), rt_fail);
+  a.patch(mapped, a.here());
+  a.mov(RCX, (int64_t)heap_addr);
+  a.mov(RDX, RAX);
+  a.alu(ALU_ADD, RDX, RSI);
+  a.store({RCX, 8}, RDX);
+  a.mov(RSI, RAX);
+  a.mov(RDX, RSI);
+  a.alu(ALU_ADD, RDX, R8);
+  a.patch(fits, a.here());
+  a.mov(RCX, (int64_t)heap_addr);
+  a.store({RCX}, RDX);
+  a.patch(reused, a.here());
+  a.mov(RAX, RSI);
+  a.pop(R11);
+  a.pop(R10);
+  a.pop(R9);
+  a.pop(R8);
+  a.pop(RDI);
+  a.pop(RSI);
+  a.ret();
+
+  // Puts the memory on its size's free list, rounding the size the way
+  // rt_alloc() did.
+  rt_free = a.here();
+  a.alu(ALU_ADD, RCX, 7);
+  a.alu(ALU_AND, RCX, -8);
+  a.alu(ALU_CMP, RCX, max_pooled);
+  size_t large_free = a.jcc(CC_A);
+  a.alu(ALU_ADD, RCX, 15);
+  a.alu(ALU_AND, RCX, -16);
+  a.shr(RCX, 1);
+  size_t listed_free = a.jmp();
+  a.patch(large_free, a.here());
+  a.alu(ALU_SUB, RCX, 1);
+  a.bsr(RCX, RCX);
+  a.alu(ALU_ADD, RCX, max_pooled / 16 - 7);
+  for (int k = 0; k < 3; k++) a.alu(ALU_ADD, RCX, RCX);
+  a.patch(listed_free, a.here());
+  a.mov(RDX, (int64_t)free_lists_addr);
+  a.alu(ALU_ADD, RCX, RDX);
+  a.load(RDX, {RCX});
+  a.store({RAX}, RDX);
+  a.store({RCX}, RAX);
+  a.ret();
+
+  // Bumps the region, which MARK and RELEASE move back and forth. Once it
+  // is full, objects come from the heap and stay there.
+  rt_local = a.here();
+  a.alu(ALU_ADD, RAX, 7);
+  a.alu(ALU_AND, RAX, -8);
+  a.mov(RCX, (int64_t)region_addr);
+  a.load(RDX, {RCX});
+  a.alu(ALU_ADD, RDX, RAX);
+  a.cmp({RCX, 8}, RDX);
+  a.patch(a.jcc(CC_B), rt_alloc);
+  a.store({RCX}, RDX);
+  a.alu(ALU_SUB, RDX, RAX);
+  a.mov(RAX, RDX);
+  a.ret();
+
+  rt_str_eq = a.here();
+  a.push(RSI);
+  a.push(RDI);
+  a.alu(ALU_CMP, RAX, RCX);
+  size_t same = a.jcc(CC_E);
+  a.test(RAX, RAX);
+  size_t differ1 = a.jcc(CC_E);
+  a.test(RCX, RCX);
+  size_t differ2 = a.jcc(CC_E);
+  a.load(RDX, {RAX});
+  a.cmp({RCX}, RDX);
+  size_t differ3 = a.jcc(CC_NE);
+  a.lea(RSI, {RAX, 8});
+  a.lea(RDI, {RCX, 8});
+  top = a.here();
+  a.test(RDX, RDX);
+  size_t equal = a.jcc(CC_E);
+  a.load_byte(RAX, {RSI});
+  a.load_byte(RCX, {RDI});
+  a.alu(ALU_CMP, RAX, RCX);
+  size_t differ4 = a.jcc(CC_NE);
+  a.alu(ALU_ADD, RSI, 1);
+  a.alu(ALU_ADD, RDI, 1);
+  a.alu(ALU_SUB, RDX, 1);
+  a.patch(a.jmp(), top);
+  a.patch(same, a.here());
+  a.patch(equal, a.here());
+  a.mov(RAX, 1);
+  done = a.jmp();
+  for (auto j : {differ1, differ2, differ3, differ4}) a.patch(j, a.here());
+  a.mov(RAX, 0);
+  a.patch(done, a.here());
+  a.pop(RDI);
+  a.pop(RSI);
+  a.ret();
+
+  rt_str_hash = a.here();
+  a.push(RSI);
+  a.push(R8);
+  a.test(RAX, RAX);
+  is_null = a.jcc(CC_E);
+  a.load(RDX, {RAX});
+  a.lea(RSI, {RAX, 8});
+  a.mov(RAX, (int64_t)0xcbf29ce484222325);
+  a.alu(ALU_XOR, RAX, RCX);
+  a.mov(R8, 0x100000001b3);
+  top = a.here();
+  a.test(RDX, RDX);
+  done = a.jcc(CC_E);
+  a.load_byte(RCX, {RSI});
+  a.alu(ALU_XOR, RAX, RCX);
+  a.imul(RAX, R8);
+  a.alu(ALU_ADD, RSI, 1);
+  a.alu(ALU_SUB, RDX, 1);
+  a.patch(a.jmp(), top);
+  a.patch(done, a.here());
+  a.mov(RCX, RAX);
+  a.shr(RCX, 32);
+  a.alu(ALU_XOR, RAX, RCX);
+  // a null Str* is already the 0 it hashes to
+  a.patch(is_null, a.here());
+  a.pop(R8);
+  a.pop(RSI);
+  a.ret();
+
+  for (bool local : {false, true}) {
+    (local ? rt_concat_local : rt_concat) = a.here();
+    a.push(RSI);
+    a.push(RDI);
+    a.push(R8);
+    a.mov(RSI, RAX);
+    a.mov(RDI, RCX);
+    a.load(RAX, {RSI});
+    a.load(RDX, {RDI});
+    a.alu(ALU_ADD, RAX, RDX);
+    a.alu(ALU_ADD, RAX, 8);
+    call_rt(local ? rt_local : rt_alloc);
+    a.load(RDX, {RSI});
+    a.load(RCX, {RDI});
+    a.alu(ALU_ADD, RDX, RCX);
+    a.store({RAX}, RDX);
+    a.lea(R8, {RAX, 8});
+    for (Reg from : {RSI, RDI}) {
+      a.load(RCX, {from});
+      a.alu(ALU_ADD, from, 8);
+      top = a.here();
+      a.test(RCX, RCX);
+      done = a.jcc(CC_E);
+      a.load_byte(RDX, {from});
+      a.store_byte({R8}, RDX);
+      a.alu(ALU_ADD, from, 1);
+      a.alu(ALU_ADD, R8, 1);
+      a.alu(ALU_SUB, RCX, 1);
+      a.patch(a.jmp(), top);
+      a.patch(done, a.here());
+    }
+    a.pop(R8);
+    a.pop(RDI);
+    a.pop(RSI);
+    a.ret();
+  }
+}
+
+// every register an instruction reads or writes
+void NativeCompiler::operands(const Instruction& in, std::vector<int32_t>& out) {
+  out.clear();
+  switch (in.op) {
+  case BC_NOP:
+  case BC_JMP:
+  case BC_RETV:
+    break;
+  case BC_LOADI:
+  case BC_LOADK:
+  case BC_LOADNULL:
+  case BC_LOADFN:
+  case BC_JT:
+  case BC_JF:
+  case BC_JUMPTAB:
+  case BC_RET:
+  case BC_DELETE:
+  case BC_MARK:
+  case BC_RELEASE:
+  case BC_PRINT:
+    out.push_back(in.a);
+    break;
+  case BC_MOVE:
+  case BC_ADDK:
+  case BC_NEGI:
+  case BC_BNOT:
+  case BC_NOT:
+  case BC_NEGF:
+  case BC_ITOF:
+  case BC_FTOI:
+  case BC_ISNULL:
+  case BC_GETFIELD:
+  case BC_LEN:
+  case BC_SLEN:
+  case BC_SHASH:
+  case BC_BITTEST:
+    out.push_back(in.a);
+    out.push_back(in.b);
+    break;
+  case BC_SETFIELD:
+    out.push_back(in.a);
+    out.push_back(in.c);
+    break;
+  case BC_CALL:
+    out.push_back(in.a);
+    for (uint32_t i = 0; i < program.functions[in.b].params; i++) out.push_back(in.c + i);
+    break;
+  case BC_CALLR:
+    out.push_back(in.a);
+    out.push_back(in.c - 1);
+    for (int32_t i = 0; i < in.b; i++) out.push_back(in.c + i);
+    break;
+  case BC_NEWSTRUCT:
+  case BC_LNEWSTRUCT:
+  case BC_NEWARRAY:
+  case BC_LNEWARRAY:
+    out.push_back(in.a);
+    for (int32_t i = 0; i < in.b; i++) out.push_back(in.c + i);
+    break;
+  case BC_GENSTART:
+  case BC_RESUME:
+  case BC_GENLIVE:
+  case BC_YIELD:
+  case BC_DONE:
+  case BC_GENNEW:
+  case BC_RESUMEP:
+  case BC_GENFREE:
+    // never lowered, see lower()
+    out.push_back(in.a);
+    break;
+  default:
+    out.push_back(in.a);
+    out.push_back(in.b);
+    out.push_back(in.c);
+  }
+}
+
+// Linear scan over live intervals (Poletto and Sarkar). An interval runs
+// from the first to the last instruction that mentions the register, and
+// is widened to cover any loop it overlaps, since its value may flow
+// around the back edge.
+void NativeCompiler::allocate() {
+  size_t n = fn->registers;
+  std::vector<size_t> start(n, SIZE_MAX);
+  std::vector<size_t> end(n, 0);
+  for (uint32_t p = 0; p < fn->params; p++) start[p] = 0;
+  std::vector<int32_t> regs;
+  std::vector<size_t> call_sites;
+  std::vector<std::pair<size_t, size_t>> loops;
+  for (size_t i = 0; i < fn->code.size(); i++) {
+    const Instruction& in = fn->code[i];
+    operands(in, regs);
+    for (auto r : regs) {
+      start[r] = std::min(start[r], i);
+      end[r] = std::max(end[r], i);
+    }
+    if (in.op == BC_CALL || in.op == BC_CALLR) call_sites.push_back(i);
+    if ((in.op == BC_JMP || in.op == BC_JT || in.op == BC_JF || in.op == BC_JUMPTAB) && (size_t)in.c <= i) {
+      loops.push_back({in.c, i});
+    }
+    if (in.op == BC_JUMPTAB) {
+      for (auto t : fn->tables[in.b].targets) {
+        if ((size_t)t <= i) loops.push_back({t, i});
+      }
+    }
+  }
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto& loop : loops) {
+      for (size_t r = 0; r < n; r++) {
+        if (start[r] > loop.second || end[r] < loop.first) continue;
+        if (start[r] > loop.first || end[r] < loop.second) {
+          start[r] = std::min(start[r], loop.first);
+          end[r] = std::max(end[r], loop.second);
+          changed = true;
+        }
+      }
+    }
+  }
+
+  std::vector<Interval> intervals;
+  for (size_t r = 0; r < n; r++) {
+    if (start[r] == SIZE_MAX) continue;
+    bool crosses = false;
+    for (auto c : call_sites) crosses = crosses || (start[r] < c && c < end[r]);
+    intervals.push_back({(int32_t)r, start[r], end[r], crosses});
+  }
+  std::sort(intervals.begin(), intervals.end(), [](const Interval& x, const Interval& y) {
+    return x.start < y.start;
+  });
+
+  location.assign(n, NO_REG);
+  slot.assign(n, 0);
+  std::vector<Reg> free_caller(std::rbegin(caller_saved), std::rend(caller_saved));
+  std::vector<Reg> free_callee(std::rbegin(callee_saved), std::rend(callee_saved));
+  auto is_callee_saved = [](Reg r) {
+    return std::find(std::begin(callee_saved), std::end(callee_saved), r) != std::end(callee_saved);
+  };
+  std::vector<Interval> active;
+  std::vector<int32_t> spilled;
+  for (auto& cur : intervals) {
+    for (size_t k = 0; k < active.size();) {
+      if (active[k].end >= cur.start) {
+        k++;
+        continue;
+      }
+      Reg r = location[active[k].vreg];
+      (is_callee_saved(r) ? free_callee : free_caller).push_back(r);
+      active.erase(active.begin() + k);
+    }
+    Reg r = NO_REG;
+    if (!cur.crosses_call && !free_caller.empty()) {
+      r = free_caller.back();
+      free_caller.pop_back();
+    } else if (!free_callee.empty()) {
+      r = free_callee.back();
+      free_callee.pop_back();
+    } else {
+      // spill whichever usable interval ends last
+      int victim = -1;
+      for (size_t k = 0; k < active.size(); k++) {
+        if (cur.crosses_call && !is_callee_saved(location[active[k].vreg])) continue;
+        if (victim < 0 || active[k].end > active[victim].end) victim = k;
+      }
+      if (victim >= 0 && active[victim].end > cur.end) {
+        r = location[active[victim].vreg];
+        location[active[victim].vreg] = NO_REG;
+        spilled.push_back(active[victim].vreg);
+        active.erase(active.begin() + victim);
+      } else {
+        spilled.push_back(cur.vreg);
+        continue;
+      }
+    }
+    location[cur.vreg] = r;
+    active.push_back(cur);
+  }
+
+  saved.clear();
+  for (auto r : callee_saved) {
+    if (std::find(location.begin(), location.end(), r) != location.end()) saved.push_back(r);
+  }
+  // [rbp - 8 * (k + 1)] holds saved register k, then the spill slots.
+  // Parameters that don't get a register stay where the caller put them.
+  int32_t slots = saved.size();
+  for (auto r : spilled) {
+    if ((uint32_t)r < fn->params) slot[r] = 16 + 8 * r;
+    else slot[r] = -8 * ++slots;
+  }
+  uint32_t outgoing = 0;
+  for (auto& in : fn->code) {
+    if (in.op == BC_CALL) outgoing = std::max(outgoing, program.functions[in.b].params);
+    if (in.op == BC_CALLR) outgoing = std::max(outgoing, (uint32_t)in.b);
+  }
+  frame_size = 8 * (slots + outgoing);
+  frame_size = (frame_size + 15) & ~15;
+}
+
+Reg NativeCompiler::get(int32_t vreg, Reg scratch) {
+  if (location[vreg] != NO_REG) return location[vreg];
+  a.load(scratch, {RBP, slot[vreg]});
+  return scratch;
+}
+
+void NativeCompiler::get_into(Reg dst, int32_t vreg) {
+  a.mov(dst, get(vreg, dst));
+}
+
+void NativeCompiler::put(int32_t vreg, Reg src) {
+  if (location[vreg] != NO_REG) a.mov(location[vreg], src);
+  else a.store({RBP, slot[vreg]}, src);
+}
+
+void NativeCompiler::load_immediate(int32_t vreg, int64_t value) {
+  if (location[vreg] != NO_REG) {
+    a.mov(location[vreg], value);
+  } else {
+    a.mov(RAX, value);
+    put(vreg, RAX);
+  }
+}
+
+// the stubs that report failures go after the function's code
+void NativeCompiler::fail(Condition cc, uint64_t msg) {
+  failures.push_back({a.jcc(cc), msg, fn->lines[ip]});
+}
+
+void NativeCompiler::null_check(Reg r) {
+  a.test(r, r);
+  fail(CC_E, null_msg);
+}
+
+bool NativeCompiler::print(TypeId type) {
+  const Type& t = type_table.get(type);
+  switch (t.kind) {
+  case TYPE_NULLABLE: {
+    a.mov(RCX, null_bits[null_repr(type)]);
+    a.alu(ALU_CMP, RAX, RCX);
+    size_t not_null = a.jcc(CC_NE);
+    a.mov(RAX, (int64_t)null_str);
+    call_rt(rt_print_str);
+    size_t done = a.jmp();
+    a.patch(not_null, a.here());
+    if (!print(t.inner)) return false;
+    a.patch(done, a.here());
+  } break;
+  case TYPE_INT:
+    call_rt(rt_print_int);
+    break;
+  case TYPE_BOOL: {
+    a.test(RAX, RAX);
+    a.mov(RAX, (int64_t)false_str);
+    size_t skip = a.jcc(CC_E);
+    a.mov(RAX, (int64_t)true_str);
+    a.patch(skip, a.here());
+    call_rt(rt_print_str);
+  } break;
+  case TYPE_STR:
+    call_rt(rt_print_str);
+    break;
+  case TYPE_ENUM: {
+    uint64_t table = enum_table(type);
+    a.mov(RCX, t.names.size());
+    a.alu(ALU_CMP, RAX, RCX);
+    size_t as_int = a.jcc(CC_AE);
+    a.mov(RCX, (int64_t)table);
+    a.load(RAX, {RCX, 0, RAX, 8});
+    call_rt(rt_print_str);
+    size_t done = a.jmp();
+    a.patch(as_int, a.here());
+    call_rt(rt_print_int);
+    a.patch(done, a.here());
+  } break;
+  default:
+    return unsupported(("printing " + type_table.name(type)).c_str());
+  }
+  return true;
+}
+
+bool NativeCompiler::unsupported(const char* what) {
+  std::cerr << "native backend: " << what << " in " << fn->name << " line ";
+  std::cerr << fn->lines[ip] << " is not supported yet" << std::endl;
+  return false;
+}
+
+bool NativeCompiler::lower(const Instruction& in) {
+  switch (in.op) {
+  case BC_NOP:
+    break;
+  case BC_MOVE:
+    put(in.a, get(in.b, RAX));
+    break;
+  case BC_LOADI:
+  case BC_LOADFN:
+    load_immediate(in.a, in.b);
+    break;
+  case BC_LOADK: {
+    Value v = program.constants[in.b];
+    auto s = strings.find(v.p);
+    load_immediate(in.a, s == strings.end() ? v.i : (int64_t)s->second);
+  } break;
+  case BC_LOADNULL:
+    load_immediate(in.a, null_bits[in.b]);
+    break;
+  case BC_ADDI:
+  case BC_SUBI:
+  case BC_BAND:
+  case BC_BOR:
+  case BC_BXOR: {
+    AluOp op = (in.op == BC_ADDI ? ALU_ADD : in.op == BC_SUBI ? ALU_SUB :
+                in.op == BC_BAND ? ALU_AND : in.op == BC_BOR ? ALU_OR : ALU_XOR);
+    get_into(RAX, in.b);
+    a.alu(op, RAX, get(in.c, RCX));
+    put(in.a, RAX);
+  } break;
+  case BC_MULI:
+    get_into(RAX, in.b);
+    a.imul(RAX, get(in.c, RCX));
+    put(in.a, RAX);
+    break;
+  case BC_ADDK:
+    get_into(RAX, in.b);
+    a.alu(ALU_ADD, RAX, in.c);
+    put(in.a, RAX);
+    break;
+  case BC_DIVI:
+  case BC_MODI: {
+    get_into(RCX, in.c);
+    a.test(RCX, RCX);
+    fail(CC_E, division_msg);
+    get_into(RAX, in.b);
+    // INT64_MIN / -1 traps, so -1 is done by hand
+    a.alu(ALU_CMP, RCX, -1);
+    size_t normal = a.jcc(CC_NE);
+    if (in.op == BC_DIVI) a.neg(RAX);
+    else a.mov(RAX, 0);
+    size_t done = a.jmp();
+    a.patch(normal, a.here());
+    a.cqo();
+    a.idiv(RCX);
+    if (in.op == BC_MODI) a.mov(RAX, RDX);
+    a.patch(done, a.here());
+    put(in.a, RAX);
+  } break;
+  case BC_SHL:
+  case BC_SHR:
+    get_into(RCX, in.c);
+    get_into(RAX, in.b);
+    if (in.op == BC_SHL) a.shl_cl(RAX);
+    else a.sar_cl(RAX);
+    put(in.a, RAX);
+    break;
+  case BC_NEGI:
+  case BC_BNOT:
+    get_into(RAX, in.b);
+    if (in.op == BC_NEGI) a.neg(RAX);
+    else a.not_(RAX);
+    put(in.a, RAX);
+    break;
+  case BC_NOT: {
+    Reg x = get(in.b, RAX);
+    a.test(x, x);
+    a.setcc(CC_E, RAX);
+    a.movzx_byte(RAX, RAX);
+    put(in.a, RAX);
+  } break;
+  case BC_ADDF:
+  case BC_SUBF:
+  case BC_MULF:
+  case BC_DIVF: {
+    SseOp op = (in.op == BC_ADDF ? SSE_ADD : in.op == BC_SUBF ? SSE_SUB :
+                in.op == BC_MULF ? SSE_MUL : SSE_DIV);
+    a.movq_to_xmm(0, get(in.b, RAX));
+    a.movq_to_xmm(1, get(in.c, RCX));
+    a.sse(op, 0, 1);
+    a.movq_from_xmm(RAX, 0);
+    put(in.a, RAX);
+  } break;
+  case BC_NEGF:
+    get_into(RAX, in.b);
+    a.mov(RCX, INT64_MIN);
+    a.alu(ALU_XOR, RAX, RCX);
+    put(in.a, RAX);
+    break;
+  case BC_ITOF:
+    a.cvtsi2sd(0, get(in.b, RAX));
+    a.movq_from_xmm(RAX, 0);
+    put(in.a, RAX);
+    break;
+  case BC_FTOI:
+    a.movq_to_xmm(0, get(in.b, RAX));
+    a.cvttsd2si(RAX, 0);
+    put(in.a, RAX);
+    break;
+  case BC_EQI:
+  case BC_NEI:
+  case BC_LTI:
+  case BC_LEI: {
+    Condition cc = (in.op == BC_EQI ? CC_E : in.op == BC_NEI ? CC_NE :
+                    in.op == BC_LTI ? CC_L : CC_LE);
+    Reg x = get(in.b, RAX);
+    a.alu(ALU_CMP, x, get(in.c, RCX));
+    a.setcc(cc, RAX);
+    a.movzx_byte(RAX, RAX);
+    put(in.a, RAX);
+  } break;
+  case BC_EQF:
+  case BC_NEF:
+  case BC_LTF:
+  case BC_LEF:
+    a.movq_to_xmm(0, get(in.b, RAX));
+    a.movq_to_xmm(1, get(in.c, RCX));
+    if (in.op == BC_LTF || in.op == BC_LEF) {
+      // x < y is y > x, which is false when unordered
+      a.ucomisd(1, 0);
+      a.setcc(in.op == BC_LTF ? CC_A : CC_AE, RAX);
+      a.movzx_byte(RAX, RAX);
+    } else {
+      // unordered sets the parity flag
+      a.ucomisd(0, 1);
+      a.setcc(in.op == BC_EQF ? CC_E : CC_NE, RAX);
+      a.movzx_byte(RAX, RAX);
+      a.setcc(in.op == BC_EQF ? CC_NP : CC_P, RCX);
+      a.movzx_byte(RCX, RCX);
+      a.alu(in.op == BC_EQF ? ALU_AND : ALU_OR, RAX, RCX);
+    }
+    put(in.a, RAX);
+    break;
+  case BC_EQS:
+  case BC_NES:
+    get_into(RAX, in.b);
+    get_into(RCX, in.c);
+    call_rt(rt_str_eq);
+    if (in.op == BC_NES) a.alu(ALU_XOR, RAX, 1);
+    put(in.a, RAX);
+    break;
+  case BC_SHASH:
+    get_into(RAX, in.b);
+    a.mov(RCX, in.c);
+    call_rt(rt_str_hash);
+    put(in.a, RAX);
+    break;
+  case BC_BITTEST:
+    // sar only looks at the low 6 bits of the count, so larger ones are 0
+    get_into(RCX, in.b);
+    a.mov(RAX, program.constants[in.c].i);
+    a.sar_cl(RAX);
+    a.alu(ALU_AND, RAX, 1);
+    a.mov(RDX, 0);
+    a.alu(ALU_CMP, RCX, 64);
+    a.cmov(CC_AE, RAX, RDX);
+    put(in.a, RAX);
+    break;
+  case BC_CONCAT:
+  case BC_LCONCAT:
+    get_into(RAX, in.b);
+    null_check(RAX);
+    get_into(RCX, in.c);
+    null_check(RCX);
+    call_rt(in.op == BC_LCONCAT ? rt_concat_local : rt_concat);
+    put(in.a, RAX);
+    break;
+  case BC_ISNULL: {
+    Reg x = get(in.b, RAX);
+    a.mov(RCX, null_bits[in.c]);
+    a.alu(ALU_CMP, x, RCX);
+    a.setcc(CC_E, RAX);
+    a.movzx_byte(RAX, RAX);
+    put(in.a, RAX);
+  } break;
+  case BC_ORNULLP:
+  case BC_ORNULLI:
+  case BC_ORNULLF:
+  case BC_ORNULLB: {
+    get_into(RAX, in.b);
+    Reg other = get(in.c, RCX);
+    // they go in NullRepr order
+    a.mov(RDX, null_bits[in.op - BC_ORNULLP]);
+    a.alu(ALU_CMP, RAX, RDX);
+    a.cmov(CC_E, RAX, other);
+    put(in.a, RAX);
+  } break;
+  case BC_JMP:
+    jumps.push_back({a.jmp(), in.c});
+    break;
+  case BC_JT:
+  case BC_JF: {
+    Reg x = get(in.a, RAX);
+    a.test(x, x);
+    jumps.push_back({a.jcc(in.op == BC_JT ? CC_NE : CC_E), in.c});
+  } break;
+  case BC_JUMPTAB: {
+    // an indirect jump through a table of addresses in the data segment
+    const JumpTable& t = fn->tables[in.b];
+    get_into(RAX, in.a);
+    if (t.low) {
+      a.mov(RCX, t.low);
+      a.alu(ALU_SUB, RAX, RCX);
+    }
+    a.mov(RCX, t.targets.size());
+    a.alu(ALU_CMP, RAX, RCX);
+    jumps.push_back({a.jcc(CC_AE), in.c});
+    uint64_t table = data_words(t.targets.size());
+    tables.push_back({table, in.b});
+    a.mov(RCX, (int64_t)table);
+    a.load(RAX, {RCX, 0, RAX, 8});
+    a.jmp(RAX);
+  } break;
+  case BC_CALL:
+  case BC_CALLR: {
+    // arguments go at the bottom of the caller's frame
+    uint32_t count = (in.op == BC_CALL ? program.functions[in.b].params : in.b);
+    for (uint32_t i = 0; i < count; i++) a.store({RSP, (int32_t)(8 * i)}, get(in.c + i, RAX));
+    if (in.op == BC_CALL) {
+      calls.push_back({a.call(), in.b});
+    } else {
+      get_into(RAX, in.c - 1);
+      a.mov(RCX, (int64_t)function_table_addr);
+      a.load(RAX, {RCX, 0, RAX, 8});
+      a.call(RAX);
+    }
+    put(in.a, RAX);
+  } break;
+  case BC_RET:
+    get_into(RAX, in.a);
+    returns.push_back(a.jmp());
+    break;
+  case BC_RETV:
+    a.mov(RAX, 0);
+    returns.push_back(a.jmp());
+    break;
+  case BC_NEWSTRUCT:
+  case BC_LNEWSTRUCT:
+  case BC_NEWARRAY:
+  case BC_LNEWARRAY: {
+    bool array = (in.op == BC_NEWARRAY || in.op == BC_LNEWARRAY);
+    a.mov(RAX, array ? 8 + 8 * in.b : 8 * std::max(in.b, 1));
+    call_rt(in.op == BC_LNEWSTRUCT || in.op == BC_LNEWARRAY ? rt_local : rt_alloc);
+    if (array) {
+      a.mov(RCX, in.b);
+      a.store({RAX}, RCX);
+    }
+    for (int32_t i = 0; i < in.b; i++) a.store({RAX, 8 * (i + array)}, get(in.c + i, RCX));
+    put(in.a, RAX);
+  } break;
+  case BC_RANGE:
+  case BC_LRANGE: {
+    get_into(RAX, in.c);
+    a.alu(ALU_SUB, RAX, get(in.b, RCX));
+    size_t positive = a.jcc(CC_G);
+    a.mov(RAX, 0);
+    a.patch(positive, a.here());
+    a.push(RAX);
+    for (int k = 0; k < 3; k++) a.alu(ALU_ADD, RAX, RAX);
+    a.alu(ALU_ADD, RAX, 8);
+    call_rt(in.op == BC_LRANGE ? rt_local : rt_alloc);
+    a.pop(RCX);
+    a.store({RAX}, RCX);
+    get_into(RDX, in.b);
+    a.push(RAX);
+    a.alu(ALU_ADD, RAX, 8);
+    size_t top = a.here();
+    a.test(RCX, RCX);
+    size_t done = a.jcc(CC_E);
+    a.store({RAX}, RDX);
+    a.alu(ALU_ADD, RAX, 8);
+    a.alu(ALU_ADD, RDX, 1);
+    a.alu(ALU_SUB, RCX, 1);
+    a.patch(a.jmp(), top);
+    a.patch(done, a.here());
+    a.pop(RAX);
+    put(in.a, RAX);
+  } break;
+  case BC_GETFIELD:
+    get_into(RAX, in.b);
+    null_check(RAX);
+    a.load(RAX, {RAX, 8 * in.c});
+    put(in.a, RAX);
+    break;
+  case BC_SETFIELD:
+    get_into(RAX, in.a);
+    null_check(RAX);
+    a.store({RAX, 8 * in.b}, get(in.c, RCX));
+    break;
+  case BC_INDEX:
+  case BC_SINDEX:
+  case BC_SETINDEX: {
+    bool set = (in.op == BC_SETINDEX);
+    get_into(RAX, set ? in.a : in.b);
+    null_check(RAX);
+    get_into(RCX, set ? in.b : in.c);
+    a.load(RDX, {RAX});
+    // unsigned, so negative indexes fail too
+    a.alu(ALU_CMP, RCX, RDX);
+    fail(CC_AE, index_msg);
+    if (set) {
+      a.store({RAX, 8, RCX, 8}, get(in.c, RDX));
+      break;
+    }
+    if (in.op == BC_INDEX) {
+      a.load(RAX, {RAX, 8, RCX, 8});
+    } else {
+      a.load_byte(RAX, {RAX, 8, RCX});
+      a.alu(ALU_ADD, RAX, RAX);
+      a.mov(RCX, (int64_t)char_table_addr);
+      a.lea(RAX, {RCX, 0, RAX, 8});
+    }
+    put(in.a, RAX);
+  } break;
+  case BC_LEN:
+  case BC_SLEN:
+    get_into(RAX, in.b);
+    null_check(RAX);
+    a.load(RAX, {RAX});
+    put(in.a, RAX);
+    break;
+  case BC_INARR: {
+    get_into(RAX, in.c);
+    null_check(RAX);
+    get_into(RCX, in.b);
+    a.load(RDX, {RAX});
+    size_t top = a.here();
+    a.test(RDX, RDX);
+    size_t missing = a.jcc(CC_E);
+    a.alu(ALU_SUB, RDX, 1);
+    a.cmp({RAX, 8, RDX, 8}, RCX);
+    a.patch(a.jcc(CC_NE), top);
+    a.mov(RAX, 1);
+    size_t done = a.jmp();
+    a.patch(missing, a.here());
+    a.mov(RAX, 0);
+    a.patch(done, a.here());
+    put(in.a, RAX);
+  } break;
+  case BC_DELETE: {
+    get_into(RAX, in.a);
+    a.test(RAX, RAX);
+    size_t is_null = a.jcc(CC_E);
+    if (in.b > 0) {
+      a.mov(RCX, 8 * in.b);
+    } else {
+      // the length, in elements
+      a.load(RCX, {RAX});
+      for (int k = 0; k < 3; k++) a.alu(ALU_ADD, RCX, RCX);
+      a.alu(ALU_ADD, RCX, 8);
+    }
+    call_rt(rt_free);
+    a.patch(is_null, a.here());
+  } break;
+  case BC_MARK:
+    a.mov(RCX, (int64_t)region_addr);
+    a.load(RAX, {RCX});
+    put(in.a, RAX);
+    break;
+  case BC_RELEASE:
+    get_into(RAX, in.a);
+    a.mov(RCX, (int64_t)region_addr);
+    a.store({RCX}, RAX);
+    break;
+  case BC_PRINT:
+    get_into(RAX, in.a);
+    if (!print(in.b)) return false;
+    if (in.c) {
+      if (in.c == ' ') a.mov(RAX, (int64_t)space_str);
+      else if (in.c == '\n') a.mov(RAX, (int64_t)newline_str);
+      else a.mov(RAX, (int64_t)(char_table_addr + 16 * (uint8_t)in.c));
+      call_rt(rt_print_str);
+    }
+    break;
+  case BC_MODF:
+    return unsupported("float %");
+  case BC_LTS:
+  case BC_LES:
+    return unsupported("str comparison");
+  case BC_INARRS:
+  case BC_SFIND:
+    return unsupported("`in` on strs");
+  case BC_GENSTART:
+  case BC_RESUME:
+  case BC_GENLIVE:
+  case BC_YIELD:
+  case BC_DONE:
+  case BC_GENNEW:
+  case BC_RESUMEP:
+  case BC_GENFREE:
+    return unsupported("a generator");
+  default:
+    return unsupported("this instruction");
+  }
+  return true;
+}
+
+// Frames are
+//   [rbp + 16 + 8 * i]  incoming argument i
+//   [rbp + 8]           return address
+//   [rbp]               caller's rbp
+//   [rbp - 8 * ...]     saved registers, then spill slots
+//   [rsp + 8 * i]       outgoing argument i
+// and the result comes back in rax.
+bool NativeCompiler::lower_function(uint32_t i) {
+  index = i;
+  fn = &program.functions[i];
+  ip = 0;
+  allocate();
+  function_offsets[i] = a.here();
+  jumps.clear();
+  tables.clear();
+  returns.clear();
+  failures.clear();
+  labels.assign(fn->code.size() + 1, 0);
+
+  a.push(RBP);
+  a.mov(RBP, RSP);
+  if (frame_size) a.alu(ALU_SUB, RSP, frame_size);
+  a.mov(RAX, (int64_t)stack_limit_addr);
+  a.load(RAX, {RAX});
+  a.alu(ALU_CMP, RSP, RAX);
+  fail(CC_B, stack_msg);
+  for (size_t k = 0; k < saved.size(); k++) a.store({RBP, (int32_t)(-8 * (k + 1))}, saved[k]);
+  for (uint32_t p = 0; p < fn->params; p++) {
+    if (location[p] != NO_REG) a.load(location[p], {RBP, (int32_t)(16 + 8 * p)});
+  }
+
+  for (ip = 0; ip < fn->code.size(); ip++) {
+    labels[ip] = a.here();
+    if (!lower(fn->code[ip])) return false;
+  }
+  labels[fn->code.size()] = a.here();
+  for (auto r : returns) a.patch(r, a.here());
+  for (size_t k = 0; k < saved.size(); k++) a.load(saved[k], {RBP, (int32_t)(-8 * (k + 1))});
+  a.mov(RSP, RBP);
+  a.pop(RBP);
+  a.ret();
+
+  for (auto& j : jumps) a.patch(j.first, labels[j.second]);
+  for (auto& t : tables) {
+    const auto& targets = fn->tables[t.second].targets;
+    for (size_t k = 0; k < targets.size(); k++) set_word(t.first + 8 * k, code_base + labels[targets[k]]);
+  }
+  for (auto& f : failures) {
+    a.patch(f.rel32, a.here());
+    a.mov(RAX, (int64_t)f.msg);
+    a.mov(RCX, f.line);
+    a.mov(RDX, (int64_t)function_names[index]);
+    a.patch(a.jmp(), rt_fail);
+  }
+  return true;
+}
+
+void NativeCompiler::emit_entry() {
+  entry = a.here();
+  a.mov(RAX, RSP);
+  a.mov(RCX, stack_reserve);
+  a.alu(ALU_SUB, RAX, RCX);
+  a.mov(RCX, (int64_t)stack_limit_addr);
+  a.store({RCX}, RAX);
+  a.mov(RAX, region_size);
+  call_rt(rt_alloc);
+  a.mov(RCX, (int64_t)region_addr);
+  a.store({RCX}, RAX);
+  a.mov(RDX, region_size);
+  a.alu(ALU_ADD, RAX, RDX);
+  a.store({RCX, 8}, RAX);
+  for (auto i : program.init) calls.push_back({a.call(), i});
+  a.mov(RAX, 1);
+  call_rt(rt_flush);
+  a.mov(RDI, 0);
+  a.mov(RAX, 60); // exit
+  a.syscall();
+}
+
+bool NativeCompiler::compile() {
+  emit_runtime();
+  function_offsets.assign(program.functions.size(), 0);
+  for (uint32_t i = 0; i < program.functions.size(); i++) {
+    if (!lower_function(i)) return false;
+  }
+  emit_entry();
+  for (auto& c : calls) a.patch(c.first, function_offsets[c.second]);
+  for (size_t i = 0; i < function_offsets.size(); i++) {
+    set_word(function_table_addr + 8 * i, code_base + function_offsets[i]);
+  }
+  return true;
+}
+
+// One segment for the headers and code, one for data and one for the
+// output buffer.
+bool NativeCompiler::write(const std::filesystem::path& out) {
+  size_t text_size = headers_size + a.code.size();
+  size_t data_offset = (text_size + page_size - 1) / page_size * page_size;
+
+  Elf64_Ehdr eh = {};
+  std::memcpy(eh.e_ident, ELFMAG, SELFMAG);
+  eh.e_ident[EI_CLASS] = ELFCLASS64;
+  eh.e_ident[EI_DATA] = ELFDATA2LSB;
+  eh.e_ident[EI_VERSION] = EV_CURRENT;
+  eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  eh.e_type = ET_EXEC;
+  eh.e_machine = EM_X86_64;
+  eh.e_version = EV_CURRENT;
+  eh.e_entry = code_base + entry;
+  eh.e_phoff = sizeof(Elf64_Ehdr);
+  eh.e_ehsize = sizeof(Elf64_Ehdr);
+  eh.e_phentsize = sizeof(Elf64_Phdr);
+  eh.e_phnum = 3;
+
+  Elf64_Phdr ph[3] = {};
+  ph[0].p_type = PT_LOAD;
+  ph[0].p_flags = PF_R | PF_X;
+  ph[0].p_offset = 0;
+  ph[0].p_vaddr = ph[0].p_paddr = text_base;
+  ph[0].p_filesz = ph[0].p_memsz = text_size;
+  ph[0].p_align = page_size;
+  ph[1].p_type = PT_LOAD;
+  ph[1].p_flags = PF_R | PF_W;
+  ph[1].p_offset = data_offset;
+  ph[1].p_vaddr = ph[1].p_paddr = data_base;
+  ph[1].p_filesz = data.size();
+  ph[1].p_memsz = data.size();
+  ph[1].p_align = page_size;
+  ph[2].p_type = PT_LOAD;
+  ph[2].p_flags = PF_R | PF_W;
+  ph[2].p_vaddr = ph[2].p_paddr = bss_base;
+  ph[2].p_memsz = out_buffer_size;
+  ph[2].p_align = page_size;
+
+  std::ofstream f(out, std::ios::binary | std::ios::trunc);
+  f.write((const char*)&eh, sizeof(eh));
+  f.write((const char*)ph, sizeof(ph));
+  f.write((const char*)a.code.data(), a.code.size());
+  std::vector<char> padding(data_offset - text_size, 0);
+  f.write(padding.data(), padding.size());
+  f.write((const char*)data.data(), data.size());
+  f.close();
+  if (!f) {
+    std::cerr << "could not write " << out << std::endl;
+    return false;
+  }
+  chmod(out.c_str(), 0755);
+  return true;
+}
+
+bool write_native(const Program& program, const std::filesystem::path& out, NativeStats& stats) {
+  auto start = std::chrono::steady_clock::now();
+  NativeCompiler native(program);
+  if (!native.compile()) return false;
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  stats.functions = program.functions.size();
+  stats.code_bytes = native.a.code.size();
+  stats.seconds = elapsed.count();
+  return native.write(out);
+}
@@ -0,0 +1,23 @@
+#ifndef __VOOM_NATIVE_H__
+#define __VOOM_NATIVE_H__
+
+#include "bytecode.h"
+
+#include <filesystem>
+
+struct NativeStats {
+  size_t functions = 0;
+  size_t code_bytes = 0;
+  // time spent lowering, not counting writing the file
+  double seconds = 0;
+};
+
+// Lowers every function to x86-64 and writes a static Linux executable
+// that runs the init functions in order. The runtime (allocation, output,
+// failures) is generated along with the program and only makes system
+// calls, so nothing is linked in.
+// Returns false, after saying why, if the program uses something the
+// native backend can't lower.
+bool write_native(const Program& program, const std::filesystem::path& out, NativeStats& stats);
+
+#endif
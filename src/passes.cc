@@ -0,0 +1,447 @@
+#include "ir.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+// Callees this small are copied into their callers.
+static const size_t max_inline_size = 16;
+
+static bool constant_bits(IrModule& module, IrFunction& f, uint32_t value, int64_t& bits) {
+  const IrInst& inst = f.insts[f.find(value)];
+  switch (inst.op) {
+  case BC_LOADI:
+    bits = inst.b;
+    return true;
+  case BC_LOADK:
+    bits = module.program.constants[inst.b].i;
+    return true;
+  case BC_LOADNULL:
+    bits = null_bits[inst.b];
+    return true;
+  default:
+    return false;
+  }
+}
+
+// turns the instruction into a load of the constant, in place
+static void make_constant(IrModule& module, IrInst& inst, int64_t bits) {
+  inst.args.clear();
+  inst.c = 0;
+  if (bits >= INT32_MIN && bits <= INT32_MAX) {
+    inst.op = BC_LOADI;
+    inst.b = bits;
+  } else {
+    Value v;
+    v.i = bits;
+    inst.op = BC_LOADK;
+    inst.b = module.program.add_constant(v);
+  }
+}
+
+static int64_t float_bits(double f) {
+  Value v;
+  v.f = f;
+  return v.i;
+}
+
+static double bits_float(int64_t i) {
+  Value v;
+  v.i = i;
+  return v.f;
+}
+
+// Computes what the interpreter would, or returns false for operations
+// that fail at runtime or have no portable result.
+static bool evaluate(const IrInst& inst, const int64_t* k, int64_t& out) {
+  uint64_t x = k[0];
+  uint64_t y = (inst.args.size() > 1 ? k[1] : 0);
+  double fx = bits_float(k[0]);
+  double fy = (inst.args.size() > 1 ? bits_float(k[1]) : 0);
+  switch (inst.op) {
+  case BC_ADDI: out = x + y; break;
+  case BC_SUBI: out = x - y; break;
+  case BC_MULI: out = x * y; break;
+  case BC_DIVI:
+    if (y == 0) return false;
+    out = ((int64_t)y == -1 ? 0 - x : (int64_t)x / (int64_t)y);
+    break;
+  case BC_MODI:
+    if (y == 0) return false;
+    out = ((int64_t)y == -1 ? 0 : (int64_t)x % (int64_t)y);
+    break;
+  case BC_ADDK: out = x + (uint64_t)(int64_t)inst.c; break;
+  case BC_SHL: out = x << (y & 63); break;
+  case BC_SHR: out = (int64_t)x >> (y & 63); break;
+  case BC_BAND: out = x & y; break;
+  case BC_BOR: out = x | y; break;
+  case BC_BXOR: out = x ^ y; break;
+  case BC_NEGI: out = 0 - x; break;
+  case BC_BNOT: out = ~x; break;
+  case BC_NOT: out = !x; break;
+  case BC_ADDF: out = float_bits(fx + fy); break;
+  case BC_SUBF: out = float_bits(fx - fy); break;
+  case BC_MULF: out = float_bits(fx * fy); break;
+  case BC_DIVF: out = float_bits(fx / fy); break;
+  case BC_MODF: out = float_bits(std::fmod(fx, fy)); break;
+  case BC_NEGF: out = float_bits(-fx); break;
+  case BC_ITOF: out = float_bits((double)(int64_t)x); break;
+  case BC_FTOI:
+    if (!(fx > -9.2e18 && fx < 9.2e18)) return false;
+    out = (int64_t)fx;
+    break;
+  case BC_EQI: out = (int64_t)x == (int64_t)y; break;
+  case BC_NEI: out = (int64_t)x != (int64_t)y; break;
+  case BC_LTI: out = (int64_t)x < (int64_t)y; break;
+  case BC_LEI: out = (int64_t)x <= (int64_t)y; break;
+  case BC_EQF: out = fx == fy; break;
+  case BC_NEF: out = fx != fy; break;
+  case BC_LTF: out = fx < fy; break;
+  case BC_LEF: out = fx <= fy; break;
+  case BC_ISNULL: out = (int64_t)x == null_bits[inst.c]; break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+// x + 0 and the like are just x
+static bool is_identity(const IrInst& inst, const int64_t* k, const bool* known) {
+  switch (inst.op) {
+  case BC_ADDK:
+    return inst.c == 0;
+  case BC_ADDI:
+  case BC_SUBI:
+  case BC_BOR:
+  case BC_BXOR:
+  case BC_SHL:
+  case BC_SHR:
+    return known[1] && k[1] == 0;
+  case BC_MULI:
+    return known[1] && k[1] == 1;
+  default:
+    return false;
+  }
+}
+
+void fold_constants(IrModule& module, IrFunction& f) {
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto b : f.reverse_postorder()) {
+      for (size_t n = 0; n < f.blocks[b].code.size(); n++) {
+        uint32_t id = f.blocks[b].code[n];
+        IrInst& inst = f.insts[id];
+        if (inst.removed) continue;
+        if (inst.op == IR_PHI) {
+          // all the same value, or the same constant
+          uint32_t same = f.find(inst.args[0]);
+          int64_t bits = 0;
+          bool constant = constant_bits(module, f, same, bits);
+          bool all_same = true;
+          for (auto arg : inst.args) {
+            arg = f.find(arg);
+            int64_t other;
+            if (arg == same || arg == id) continue;
+            all_same = false;
+            if (!constant_bits(module, f, arg, other) || other != bits) constant = false;
+          }
+          if (all_same && same != id) {
+            f.replace(id, same);
+            changed = true;
+          } else if (constant) {
+            make_constant(module, inst, bits);
+            changed = true;
+          }
+          continue;
+        }
+        if (inst.op == BC_JT) {
+          int64_t cond;
+          if (!constant_bits(module, f, inst.args[0], cond)) continue;
+          uint32_t dead = f.blocks[b].succs[cond ? 1 : 0];
+          f.remove_edge(b, dead);
+          inst.op = BC_JMP;
+          inst.args.clear();
+          changed = true;
+          continue;
+        }
+        if (inst.op == BC_JUMPTAB) {
+          int64_t value;
+          if (!constant_bits(module, f, inst.args[0], value)) continue;
+          const JumpTable& table = f.tables[inst.b];
+          uint64_t k = (uint64_t)value - (uint64_t)table.low;
+          uint32_t to = (k < table.targets.size() ? table.targets[k] : f.blocks[b].succs[0]);
+          auto succs = f.blocks[b].succs;
+          for (auto s : succs) {
+            if (s != to) f.remove_edge(b, s);
+          }
+          inst.op = BC_JMP;
+          inst.args.clear();
+          changed = true;
+          continue;
+        }
+        if (!ir_is_pure(inst.op) || inst.args.empty() || inst.args.size() > 2) continue;
+        int64_t k[2] = {0, 0};
+        bool known[2] = {false, false};
+        bool all = true;
+        for (size_t i = 0; i < inst.args.size(); i++) {
+          known[i] = constant_bits(module, f, inst.args[i], k[i]);
+          all = all && known[i];
+        }
+        int64_t result;
+        if (all && evaluate(inst, k, result)) {
+          make_constant(module, inst, result);
+          changed = true;
+        } else if (is_identity(inst, k, known)) {
+          f.replace(id, inst.args[0]);
+          changed = true;
+        }
+      }
+    }
+    f.remove_unreachable();
+    f.resolve();
+  }
+}
+
+static bool commutative(uint16_t op) {
+  switch (op) {
+  case BC_ADDI: case BC_MULI: case BC_BAND: case BC_BOR: case BC_BXOR:
+  case BC_ADDF: case BC_MULF:
+  case BC_EQI: case BC_NEI: case BC_EQF: case BC_NEF: case BC_EQS: case BC_NES:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Value numbering over the dominator tree: an expression computed in a
+// dominating block is reused instead of recomputed.
+void eliminate_common_subexpressions(IrModule&, IrFunction& f) {
+  auto order = f.reverse_postorder();
+  auto idom = f.dominators(order);
+  std::vector<std::vector<uint32_t>> children(f.blocks.size());
+  for (auto b : order) {
+    if (b != order[0]) children[idom[b]].push_back(b);
+  }
+  typedef std::vector<int64_t> Key;
+  std::map<Key, uint32_t> available;
+  // (block, keys it added) so they can be taken out again on the way up
+  std::vector<std::pair<uint32_t, std::vector<Key>>> stack;
+  stack.push_back({order[0], {}});
+  std::vector<size_t> next_child(f.blocks.size(), 0);
+  bool entered = false;
+  while (!stack.empty()) {
+    uint32_t b = stack.back().first;
+    if (!entered) {
+      for (auto id : f.blocks[b].code) {
+        IrInst& inst = f.insts[id];
+        if (inst.removed || !ir_is_pure(inst.op)) continue;
+        Key key = {inst.op, inst.b, inst.c};
+        std::vector<uint32_t> args;
+        for (auto arg : inst.args) args.push_back(f.find(arg));
+        if (commutative(inst.op)) std::sort(args.begin(), args.end());
+        key.insert(key.end(), args.begin(), args.end());
+        auto found = available.find(key);
+        if (found != available.end()) {
+          f.replace(id, found->second);
+        } else {
+          available[key] = id;
+          stack.back().second.push_back(key);
+        }
+      }
+    }
+    if (next_child[b] < children[b].size()) {
+      stack.push_back({children[b][next_child[b]++], {}});
+      entered = false;
+      continue;
+    }
+    for (auto& key : stack.back().second) available.erase(key);
+    stack.pop_back();
+    entered = true;
+  }
+  f.resolve();
+}
+
+static bool has_effect(const IrFunction& f, const IrInst& inst) {
+  switch (inst.op) {
+  case BC_JMP:
+  case BC_JT:
+  case BC_JUMPTAB:
+  case BC_RET:
+  case BC_RETV:
+  case BC_SETFIELD:
+  case BC_SETINDEX:
+  case BC_DELETE:
+  case BC_RELEASE:
+  case BC_PRINT:
+  case BC_GENSTART:
+  case BC_YIELD:
+  case BC_DONE:
+  case BC_GENFREE:
+    return true;
+  default:
+    return ir_may_fail(f, inst);
+  }
+}
+
+void eliminate_dead_code(IrModule&, IrFunction& f) {
+  f.remove_unreachable();
+  std::vector<bool> live(f.insts.size(), false);
+  std::vector<uint32_t> work;
+  for (auto& block : f.blocks) {
+    for (auto id : block.code) {
+      if (has_effect(f, f.insts[id])) {
+        live[id] = true;
+        work.push_back(id);
+      }
+    }
+  }
+  while (!work.empty()) {
+    uint32_t id = work.back();
+    work.pop_back();
+    for (auto arg : f.insts[id].args) {
+      arg = f.find(arg);
+      if (!live[arg]) {
+        live[arg] = true;
+        work.push_back(arg);
+      }
+    }
+  }
+  for (auto& block : f.blocks) {
+    for (auto id : block.code) {
+      if (!live[id] && f.insts[id].op != IR_PARAM) f.insts[id].removed = true;
+    }
+  }
+  f.resolve();
+}
+
+static bool inlinable(const IrFunction& g) {
+  if (g.size() > max_inline_size) return false;
+  for (auto& block : g.blocks) {
+    if (block.removed) continue;
+    for (auto id : block.code) {
+      uint16_t op = g.insts[id].op;
+      if (op == BC_CALL || op == BC_CALLR || op == BC_GENSTART) return false;
+    }
+  }
+  return true;
+}
+
+// Splits the caller's block at the call, copies the callee's blocks in
+// between, and makes returns jump to the rest of the split block.
+static void inline_call(IrFunction& f, uint32_t call, const IrFunction& g) {
+  uint32_t from = f.insts[call].block;
+  size_t line = f.insts[call].line;
+  std::vector<uint32_t> call_args;
+  for (auto arg : f.insts[call].args) call_args.push_back(f.find(arg));
+
+  uint32_t rest = f.blocks.size();
+  f.blocks.emplace_back();
+  auto& code = f.blocks[from].code;
+  size_t at = std::find(code.begin(), code.end(), call) - code.begin();
+  f.blocks[rest].code.assign(code.begin() + at + 1, code.end());
+  code.resize(at);
+  for (auto id : f.blocks[rest].code) f.insts[id].block = rest;
+  f.blocks[rest].succs = f.blocks[from].succs;
+  f.blocks[from].succs.clear();
+  for (auto s : f.blocks[rest].succs) {
+    for (auto& p : f.blocks[s].preds) {
+      if (p == from) p = rest;
+    }
+  }
+
+  std::vector<uint32_t> block_map(g.blocks.size(), UINT32_MAX);
+  for (uint32_t b = 0; b < g.blocks.size(); b++) {
+    if (g.blocks[b].removed) continue;
+    block_map[b] = f.blocks.size();
+    f.blocks.emplace_back();
+  }
+  std::vector<uint32_t> value_map(g.insts.size(), UINT32_MAX);
+  std::vector<std::pair<uint32_t, uint32_t>> copied;
+  // (block, returned value or UINT32_MAX)
+  std::vector<std::pair<uint32_t, uint32_t>> returns;
+  for (uint32_t b = 0; b < g.blocks.size(); b++) {
+    if (g.blocks[b].removed) continue;
+    uint32_t nb = block_map[b];
+    for (auto p : g.blocks[b].preds) f.blocks[nb].preds.push_back(block_map[p]);
+    for (auto s : g.blocks[b].succs) f.blocks[nb].succs.push_back(block_map[s]);
+    for (auto id : g.blocks[b].code) {
+      const IrInst& inst = g.insts[id];
+      if (inst.op == IR_PARAM) {
+        value_map[id] = call_args[inst.b];
+        continue;
+      }
+      if (inst.op == BC_RET || inst.op == BC_RETV) {
+        uint32_t j = f.add(nb, BC_JMP);
+        f.insts[j].line = inst.line;
+        f.blocks[nb].succs.push_back(rest);
+        returns.push_back({nb, inst.op == BC_RET ? inst.args[0] : UINT32_MAX});
+        continue;
+      }
+      uint32_t v = f.add(nb, inst.op, inst.b, inst.c);
+      f.insts[v].line = inst.line;
+      if (inst.op == BC_JUMPTAB) {
+        JumpTable table = g.tables[inst.b];
+        for (auto& t : table.targets) t = block_map[t];
+        f.insts[v].b = f.tables.size();
+        f.tables.push_back(table);
+      }
+      value_map[id] = v;
+      copied.push_back({v, id});
+    }
+  }
+  for (auto& c : copied) {
+    for (auto arg : g.insts[c.second].args) f.insts[c.first].args.push_back(value_map[arg]);
+  }
+
+  uint32_t entry = block_map[0];
+  uint32_t j = f.add(from, BC_JMP);
+  f.insts[j].line = line;
+  f.blocks[from].succs.push_back(entry);
+  f.blocks[entry].preds.push_back(from);
+
+  uint32_t result = UINT32_MAX;
+  bool any_value = false;
+  for (auto& r : returns) {
+    f.blocks[rest].preds.push_back(r.first);
+    any_value = any_value || r.second != UINT32_MAX;
+  }
+  if (returns.size() == 1 && any_value) {
+    result = value_map[returns[0].second];
+  } else if (any_value) {
+    result = f.add(rest, IR_PHI);
+    auto& rest_code = f.blocks[rest].code;
+    rest_code.pop_back();
+    rest_code.insert(rest_code.begin(), result);
+    uint32_t undef = UINT32_MAX;
+    for (auto& r : returns) {
+      if (r.second != UINT32_MAX) {
+        f.insts[result].args.push_back(value_map[r.second]);
+        continue;
+      }
+      if (undef == UINT32_MAX) {
+        undef = f.add(0, IR_UNDEF);
+        auto& entry_code = f.blocks[0].code;
+        entry_code.pop_back();
+        entry_code.insert(entry_code.begin(), undef);
+      }
+      f.insts[result].args.push_back(undef);
+    }
+  }
+  if (result != UINT32_MAX) {
+    f.replace(call, result);
+  } else {
+    f.insts[call].removed = true;
+  }
+}
+
+void inline_calls(IrModule& module, IrFunction& f) {
+  size_t count = f.insts.size();
+  for (uint32_t id = 0; id < count; id++) {
+    const IrInst& inst = f.insts[id];
+    if (inst.removed || inst.op != BC_CALL || (uint32_t)inst.b == f.index) continue;
+    const IrFunction* g = module.function(inst.b);
+    if (!g || !inlinable(*g)) continue;
+    inline_call(f, id, *g);
+  }
+  f.resolve();
+}
@@ -1,6 +1,7 @@
 #ifndef __VOOM_STRING_H__
 #define __VOOM_STRING_H__
 
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 
@@ -17,7 +18,18 @@ inline std::ostream& operator<<(std::ostream& ostr, String s) {
 }
 
 inline bool operator==(const String s, const char* c) {
-  return std::strncmp(s.data, c, s.count) == 0;
+  return std::strncmp(s.data, c, s.count) == 0 && c[s.count] == '\0';
+}
+
+// FNV-1a
+inline uint64_t hash_bytes(const void* data, size_t size,
+                           uint64_t hash = 0xcbf29ce484222325) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
 }
 
 #endif
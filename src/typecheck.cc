@@ -0,0 +1,893 @@
+#include "compilation_unit.h"
+
+std::string CompilationUnit::token_string(size_t i) {
+  return std::string(tokens[i]->text.data, tokens[i]->text.count);
+}
+
+void CompilationUnit::flatten_commas(size_t tok, std::vector<size_t>& out) {
+  // Commas associate to the left, so a long list is a long chain of
+  // child1s. That side is walked rather than recursed on.
+  std::vector<size_t> rest;
+  for (; tok && tokens[tok]->type == TOKEN_COMMA; tok = tokens[tok]->child1) {
+    rest.push_back(tokens[tok]->child2);
+  }
+  if (tok) out.push_back(tok);
+  for (size_t i = rest.size(); i-- > 0;) flatten_commas(rest[i], out);
+}
+
+const CompilationUnit::Symbol* CompilationUnit::lookup_global(const std::string& name) {
+  auto found = globals.find(name);
+  if (found != globals.end()) return &found->second;
+  for (auto& unit : imports) {
+    found = unit->globals.find(name);
+    if (found != unit->globals.end()) return &found->second;
+  }
+  return nullptr;
+}
+
+const CompilationUnit::Symbol* CompilationUnit::lookup(CheckContext& ctx, const std::string& name) {
+  for (auto it = ctx.scopes.rbegin(); it != ctx.scopes.rend(); it++) {
+    auto found = it->find(name);
+    if (found != it->end()) return &found->second;
+  }
+  return lookup_global(name);
+}
+
+void CompilationUnit::declare(CheckContext& ctx, size_t name, SymbolKind kind, TypeId type) {
+  std::string s = token_string(name);
+  auto& scope = ctx.scopes.back();
+  if (scope.find(s) != scope.end()) {
+    report_error(name, "redeclared variable");
+    return;
+  }
+  scope[s] = {kind, type, name};
+  tokens[name]->value_type = type;
+}
+
+bool CompilationUnit::assignable(TypeId from, TypeId to) {
+  // error types have already been reported
+  if (from == to || from == TypeTable::null_type || to == TypeTable::null_type) return true;
+  const Type& t = type_table.get(to);
+  if (t.kind != TYPE_NULLABLE) return false;
+  return from == TypeTable::nulltype_type || from == t.inner;
+}
+
+TypeId CompilationUnit::resolve_type(size_t i) {
+  auto tok = tokens[i];
+  switch (tok->type) {
+  case TOKEN_IDENT: {
+    std::string name = token_string(i);
+    if (name == "int") return TypeTable::int_type;
+    if (name == "float") return TypeTable::float_type;
+    if (name == "bool") return TypeTable::bool_type;
+    if (name == "str") return TypeTable::str_type;
+    if (name == "void") return TypeTable::void_type;
+    const Symbol* sym = lookup_global(name);
+    if (sym && sym->kind == SYMBOL_TYPE) return sym->type;
+    report_error(i, "unknown type");
+    return TypeTable::null_type;
+  }
+  case TOKEN_BRACKET:
+    if (tok->role == ROLE_OPERAND && tok->child1) {
+      if (tok->op == OP_PAREN) return resolve_type(tok->child1);
+      if (tok->op == OP_BRACKET) {
+        TypeId elem = resolve_type(tok->child1);
+        if (elem == TypeTable::null_type) return elem;
+        return type_table.array_of(elem);
+      }
+    }
+    break;
+  case TOKEN_OP:
+    if (tok->op == OP_CHECK_NULL && tok->role == ROLE_EXPRESSION) {
+      TypeId base = resolve_type(tok->child1);
+      if (base == TypeTable::null_type) return base;
+      return type_table.nullable(base);
+    }
+    break;
+  default:
+    break;
+  }
+  report_error(i, "invalid type");
+  return TypeTable::null_type;
+}
+
+TypeId CompilationUnit::binary_type(Operator op, TypeId a, TypeId b) {
+  if (a == TypeTable::null_type || b == TypeTable::null_type) return TypeTable::null_type;
+  const Type& ta = type_table.get(a);
+  const Type& tb = type_table.get(b);
+  switch (op) {
+  case OP_ADD:
+    if (a == b && a == TypeTable::str_type) return a;
+    [[fallthrough]];
+  case OP_MUL:
+  case OP_DIV:
+  case OP_MOD:
+  case OP_SUB:
+    if (a == b && (ta.kind == TYPE_INT || ta.kind == TYPE_FLOAT)) return a;
+    break;
+  case OP_LSHIFT:
+  case OP_RSHIFT:
+  case OP_BIT_AND:
+  case OP_BIT_OR:
+  case OP_BIT_XOR:
+    if (a == b && ta.kind == TYPE_INT) return a;
+    break;
+  case OP_LT:
+  case OP_LTE:
+  case OP_GT:
+  case OP_GTE:
+    if (a == b && (ta.kind == TYPE_INT || ta.kind == TYPE_FLOAT || ta.kind == TYPE_STR)) {
+      return TypeTable::bool_type;
+    }
+    break;
+  case OP_EQ:
+  case OP_NEQ:
+    if (assignable(a, b) || assignable(b, a)) return TypeTable::bool_type;
+    break;
+  case OP_IN:
+  case OP_NOT_IN:
+    if (tb.kind == TYPE_ARRAY && assignable(a, tb.inner)) return TypeTable::bool_type;
+    if (a == b && ta.kind == TYPE_STR) return TypeTable::bool_type;
+    break;
+  case OP_AND:
+  case OP_OR:
+  case OP_XOR:
+    if (a == b && ta.kind == TYPE_BOOL) return a;
+    break;
+  case OP_IF_NULL:
+    if (ta.kind == TYPE_NULLABLE && assignable(b, ta.inner)) return ta.inner;
+    if (ta.kind == TYPE_NULLABLE && b == a) return a;
+    break;
+  default:
+    break;
+  }
+  return TypeTable::null_type;
+}
+
+TypeId CompilationUnit::check_builtin_call(CheckContext& ctx, size_t call, const std::string& name) {
+  std::vector<size_t> args;
+  flatten_commas(tokens[call]->child2, args);
+  std::vector<TypeId> types;
+  for (auto arg : args) types.push_back(check_expression(ctx, arg, TypeTable::null_type));
+  if (name == "print") {
+    for (size_t k = 0; k < args.size(); k++) {
+      if (types[k] == TypeTable::void_type) report_error(args[k], "cannot print void");
+    }
+    return TypeTable::void_type;
+  } else if (name == "len") {
+    if (args.size() != 1) {
+      report_error(call, "len() takes one argument");
+    } else {
+      TypeKind k = type_table.get(types[0]).kind;
+      if (k != TYPE_ARRAY && k != TYPE_STR && k != TYPE_NULL) {
+        report_error(args[0], "len() of something without a length");
+      }
+    }
+    return TypeTable::int_type;
+  } else if (name == "range") {
+    if (args.empty() || args.size() > 2) report_error(call, "range() takes one or two arguments");
+    for (size_t k = 0; k < args.size(); k++) {
+      if (!assignable(types[k], TypeTable::int_type)) report_error(args[k], "range() of non-integer");
+    }
+    return type_table.array_of(TypeTable::int_type);
+  }
+  report_error(tokens[call]->child1, "undefined function");
+  return TypeTable::null_type;
+}
+
+TypeId CompilationUnit::check_call(CheckContext& ctx, size_t call) {
+  size_t callee = tokens[call]->child1;
+  std::vector<size_t> args;
+  flatten_commas(tokens[call]->child2, args);
+  TypeId ft = TypeTable::null_type;
+  if (tokens[callee]->type == TOKEN_IDENT) {
+    std::string name = token_string(callee);
+    const Symbol* sym = lookup(ctx, name);
+    if (!sym) return check_builtin_call(ctx, call, name);
+    if (sym->kind == SYMBOL_TYPE) {
+      // constructor
+      const Type& t = type_table.get(sym->type);
+      tokens[callee]->value_type = sym->type;
+      if (t.kind != TYPE_STRUCT) {
+        report_error(callee, "only structs can be constructed");
+        return TypeTable::null_type;
+      }
+      if (args.size() != t.members.size()) {
+        report_error(call, "wrong number of fields");
+      }
+      for (size_t k = 0; k < args.size(); k++) {
+        TypeId expected = (k < t.members.size() ? t.members[k] : TypeTable::null_type);
+        TypeId a = check_expression(ctx, args[k], expected);
+        if (!assignable(a, expected)) report_error(args[k], "wrong field type");
+      }
+      return sym->type;
+    }
+  }
+  ft = check_expression(ctx, callee, TypeTable::null_type);
+  if (ft == TypeTable::null_type) return ft;
+  const Type& t = type_table.get(ft);
+  if (t.kind != TYPE_FUNCTION) {
+    report_error(callee, "not a function");
+    return TypeTable::null_type;
+  }
+  if (args.size() != t.members.size()) {
+    report_error(call, "wrong number of arguments");
+  }
+  for (size_t k = 0; k < args.size(); k++) {
+    TypeId expected = (k < t.members.size() ? t.members[k] : TypeTable::null_type);
+    TypeId a = check_expression(ctx, args[k], expected);
+    if (!assignable(a, expected)) report_error(args[k], "wrong argument type");
+  }
+  if (type_table.get(t.inner).kind == TYPE_SEQUENCE && !iterated(call)) {
+    // the frame belongs to the loop, see emit_iteration()
+    report_error(call, "a generator can only be iterated by for");
+  }
+  return t.inner;
+}
+
+// whether tok is the sequence of a for loop, or the source of a pipe
+bool CompilationUnit::iterated(size_t tok) {
+  auto parent = tokens[tokens[tok]->parent];
+  if (parent->type != TOKEN_OP) return false;
+  if (parent->op == OP_PIPE) return parent->child1 == tok;
+  return parent->op == OP_IN && parent->child2 == tok && tokens[parent->parent]->type == TOKEN_FOR;
+}
+
+// xs |> map(f) |> filter(p) |> sum
+// The stages aren't values, so their names mean nothing anywhere else.
+TypeId CompilationUnit::check_pipe(CheckContext& ctx, size_t i) {
+  auto tok = tokens[i];
+  TypeId src = check_expression(ctx, tok->child1, TypeTable::null_type);
+  if (src == TypeTable::null_type) return src;
+  const Type& source = type_table.get(src);
+  TypeId elem = TypeTable::null_type;
+  if (source.kind == TYPE_ARRAY || source.kind == TYPE_SEQUENCE) elem = source.inner;
+  else if (source.kind == TYPE_STR) elem = src;
+  else {
+    report_error(tok->child1, "not iterable");
+    return TypeTable::null_type;
+  }
+  size_t stage = tok->child2;
+  auto t = tokens[stage];
+  TypeId ret = TypeTable::null_type;
+  if (t->type == TOKEN_IDENT && token_string(stage) == "sum") {
+    TypeKind k = type_table.get(elem).kind;
+    if (k == TYPE_INT || k == TYPE_FLOAT) ret = elem;
+    else report_error(stage, "sum of something that isn't a number");
+  } else if (t->type == TOKEN_IDENT && token_string(stage) == "count") {
+    ret = TypeTable::int_type;
+  } else if (t->role == ROLE_CALL && tokens[t->child1]->type == TOKEN_IDENT &&
+             (token_string(t->child1) == "map" || token_string(t->child1) == "filter")) {
+    bool map = (token_string(t->child1) == "map");
+    std::vector<size_t> args;
+    flatten_commas(t->child2, args);
+    if (args.size() != 1) {
+      report_error(stage, map ? "map() takes one function" : "filter() takes one function");
+      return TypeTable::null_type;
+    }
+    TypeId ft = check_expression(ctx, args[0], TypeTable::null_type);
+    if (ft == TypeTable::null_type) return ft;
+    const Type& f = type_table.get(ft);
+    if (f.kind != TYPE_FUNCTION || f.members.size() != 1 || !assignable(elem, f.members[0])) {
+      report_error(args[0], "expected a function of one element");
+    } else if (map && f.inner == TypeTable::void_type) {
+      report_error(args[0], "map() of a function that returns nothing");
+    } else if (!map && f.inner != TypeTable::bool_type) {
+      report_error(args[0], "filter() of a function that doesn't return bool");
+    } else {
+      ret = type_table.sequence_of(map ? f.inner : elem);
+    }
+  } else {
+    report_error(stage, "expected map(), filter(), sum or count");
+  }
+  if (type_table.get(ret).kind == TYPE_SEQUENCE && !iterated(i)) {
+    // nothing is ever collected, see emit_iteration()
+    report_error(i, "a pipe can only be iterated by for, or end in sum or count");
+  }
+  return ret;
+}
+
+TypeId CompilationUnit::check_access(CheckContext& ctx, size_t i) {
+  size_t lhs = tokens[i]->child1;
+  size_t rhs = tokens[i]->child2;
+  if (tokens[rhs]->type != TOKEN_IDENT) {
+    report_error(rhs, "expected field name");
+    return TypeTable::null_type;
+  }
+  std::string field = token_string(rhs);
+  if (tokens[lhs]->type == TOKEN_IDENT) {
+    const Symbol* sym = lookup(ctx, token_string(lhs));
+    if (sym && sym->kind == SYMBOL_TYPE) {
+      const Type& t = type_table.get(sym->type);
+      tokens[lhs]->value_type = sym->type;
+      if (t.kind == TYPE_ENUM) {
+        for (auto& name : t.names) {
+          if (name == field) return tokens[rhs]->value_type = sym->type;
+        }
+      }
+      report_error(rhs, "no such value");
+      return TypeTable::null_type;
+    }
+  }
+  TypeId base = check_expression(ctx, lhs, TypeTable::null_type);
+  if (base == TypeTable::null_type) return base;
+  // x?.y is null if x is
+  bool propagate = (tokens[lhs]->op == OP_CHECK_NULL && tokens[lhs]->role == ROLE_EXPRESSION);
+  if (propagate) base = type_table.get(base).inner;
+  const Type& t = type_table.get(base);
+  if (t.kind == TYPE_STRUCT) {
+    for (size_t k = 0; k < t.names.size(); k++) {
+      if (t.names[k] != field) continue;
+      tokens[rhs]->value_type = t.members[k];
+      if (propagate) return type_table.nullable(t.members[k]);
+      return t.members[k];
+    }
+  } else if (t.kind == TYPE_NULLABLE) {
+    report_error(i, "access to nullable value without ?");
+    return TypeTable::null_type;
+  }
+  report_error(rhs, "no such field");
+  return TypeTable::null_type;
+}
+
+TypeId CompilationUnit::check_operator_types(CheckContext& ctx, size_t i) {
+  auto tok = tokens[i];
+  switch (tok->op) {
+  case OP_ACCESS:
+    return check_access(ctx, i);
+  case OP_PIPE:
+    return check_pipe(ctx, i);
+  case OP_CAST: {
+    TypeId from = check_expression(ctx, tok->child1, TypeTable::null_type);
+    TypeId to = resolve_type(tok->child2);
+    TypeKind fk = type_table.get(from).kind;
+    TypeKind tk = type_table.get(to).kind;
+    bool numeric = ((fk == TYPE_INT || fk == TYPE_FLOAT || fk == TYPE_ENUM) &&
+                    (tk == TYPE_INT || tk == TYPE_FLOAT)) ||
+                   (fk == TYPE_INT && tk == TYPE_ENUM);
+    if (!numeric && !assignable(from, to)) report_error(i, "invalid cast");
+    return to;
+  }
+  case OP_CHECK_NULL: {
+    TypeId t = check_expression(ctx, tok->child1, TypeTable::null_type);
+    if (t != TypeTable::null_type && type_table.get(t).kind != TYPE_NULLABLE) {
+      report_error(i, "? on a value that cannot be null");
+      return TypeTable::null_type;
+    }
+    return t;
+  }
+  case OP_COLON:
+    report_error(i, "unexpected type annotation");
+    return TypeTable::null_type;
+  case OP_INC:
+  case OP_DEC:
+    report_error(i, "increment inside an expression");
+    return TypeTable::null_type;
+  default:
+    break;
+  }
+  if (!tok->child1) {
+    TypeId t = check_expression(ctx, tok->child2, TypeTable::null_type);
+    TypeKind k = type_table.get(t).kind;
+    switch (tok->op) {
+    case OP_UNARY_PLUS:
+    case OP_UNARY_MINUS:
+      if (k == TYPE_INT || k == TYPE_FLOAT) return t;
+      break;
+    case OP_UNARY_NOT:
+    case OP_NOT:
+      if (k == TYPE_BOOL) return t;
+      break;
+    case OP_BIT_NOT:
+      if (k == TYPE_INT) return t;
+      break;
+    default:
+      break;
+    }
+    if (k != TYPE_NULL) report_error(i, "invalid operand type");
+    return TypeTable::null_type;
+  }
+  TypeId a = check_expression(ctx, tok->child1, TypeTable::null_type);
+  TypeId hint = a;
+  if (tok->op == OP_IF_NULL && type_table.get(a).kind == TYPE_NULLABLE) {
+    hint = type_table.get(a).inner;
+  } else if (tok->op == OP_IN || tok->op == OP_NOT_IN) {
+    hint = type_table.array_of(a);
+  }
+  TypeId b = check_expression(ctx, tok->child2, hint);
+  TypeId ret = binary_type(tok->op, a, b);
+  if (ret == TypeTable::null_type && a != TypeTable::null_type && b != TypeTable::null_type) {
+    report_error(i, "invalid operand types");
+  }
+  return ret;
+}
+
+TypeId CompilationUnit::check_expression(CheckContext& ctx, size_t i, TypeId expected) {
+  auto tok = tokens[i];
+  if (tok->value_type != TypeTable::null_type) return tok->value_type;
+  TypeId ret = TypeTable::null_type;
+  switch (tok->type) {
+  case TOKEN_NUM:
+    if (std::memchr(tok->text.data, '.', tok->text.count)) ret = TypeTable::float_type;
+    else ret = TypeTable::int_type;
+    break;
+  case TOKEN_STR:
+    ret = TypeTable::str_type;
+    break;
+  case TOKEN_CONSTANT:
+    if (tok->text == "null") ret = TypeTable::nulltype_type;
+    else ret = TypeTable::bool_type;
+    break;
+  case TOKEN_IDENT: {
+    const Symbol* sym = lookup(ctx, token_string(i));
+    if (!sym) report_error(i, "undefined name");
+    else if (sym->kind == SYMBOL_TYPE) report_error(i, "type used as a value");
+    else ret = sym->type;
+    const Type& t = type_table.get(ret);
+    bool callee = (tokens[tok->parent]->role == ROLE_CALL && tokens[tok->parent]->child1 == i);
+    if (t.kind == TYPE_FUNCTION && type_table.get(t.inner).kind == TYPE_SEQUENCE && !callee) {
+      report_error(i, "a generator can only be called");
+    }
+  } break;
+  case TOKEN_BRACKET:
+    if (tok->role == ROLE_CALL) {
+      ret = check_call(ctx, i);
+    } else if (tok->role == ROLE_ACCESS) {
+      TypeId base = check_expression(ctx, tok->child1, TypeTable::null_type);
+      TypeId index = check_expression(ctx, tok->child2, TypeTable::int_type);
+      if (!assignable(index, TypeTable::int_type)) report_error(tok->child2, "non-integer index");
+      const Type& t = type_table.get(base);
+      if (t.kind == TYPE_ARRAY) ret = t.inner;
+      else if (t.kind == TYPE_STR) ret = base;
+      else if (t.kind != TYPE_NULL) report_error(i, "indexing something that is not an array");
+    } else if (tok->op == OP_PAREN) {
+      if (!tok->child1) report_error(i, "empty expression");
+      else ret = check_expression(ctx, tok->child1, expected);
+    } else if (tok->op == OP_BRACKET) {
+      std::vector<size_t> elems;
+      flatten_commas(tok->child1, elems);
+      const Type& e = type_table.get(expected);
+      TypeId elem = (e.kind == TYPE_ARRAY ? e.inner : TypeTable::null_type);
+      if (elems.empty() && elem == TypeTable::null_type) {
+        report_error(i, "cannot infer the type of an empty array");
+        break;
+      }
+      for (auto k : elems) {
+        TypeId t = check_expression(ctx, k, elem);
+        if (elem == TypeTable::null_type) elem = t;
+        else if (!assignable(t, elem)) report_error(k, "mismatched array element");
+      }
+      if (elem != TypeTable::null_type) ret = type_table.array_of(elem);
+    } else {
+      report_error(i, "unexpected block");
+    }
+    break;
+  case TOKEN_OP:
+    ret = check_operator_types(ctx, i);
+    break;
+  default:
+    report_error(i, "not an expression");
+  }
+  tok->value_type = ret;
+  return ret;
+}
+
+void CompilationUnit::check_assignment(CheckContext& ctx, size_t i) {
+  auto tok = tokens[i];
+  if (tok->type == TOKEN_OP && tok->op == OP_COLON) {
+    // x: type;
+    if (tokens[tok->child1]->type != TOKEN_IDENT) {
+      report_error(i, "expected variable name");
+      return;
+    }
+    TypeId t = resolve_type(tok->child2);
+    declare(ctx, tok->child1, SYMBOL_VAR, t);
+    tok->value_type = t;
+    return;
+  }
+  if (tok->type != TOKEN_STATEMENT_OP) {
+    check_expression(ctx, i, TypeTable::null_type);
+    return;
+  }
+  size_t lhs = tok->child1;
+  size_t rhs = tok->child2;
+  if (tok->op == OP_INC || tok->op == OP_DEC) {
+    TypeId t = check_expression(ctx, lhs, TypeTable::null_type);
+    if (!assignable(t, TypeTable::int_type)) report_error(i, "increment of non-integer");
+    return;
+  }
+  if (tokens[lhs]->type == TOKEN_OP && tokens[lhs]->op == OP_COLON) {
+    // x: type = value;
+    if (tok->op != OP_UNK || tokens[tokens[lhs]->child1]->type != TOKEN_IDENT) {
+      report_error(i, "invalid declaration");
+      return;
+    }
+    TypeId t = resolve_type(tokens[lhs]->child2);
+    TypeId v = check_expression(ctx, rhs, t);
+    if (!assignable(v, t)) report_error(i, "type mismatch in assignment");
+    declare(ctx, tokens[lhs]->child1, SYMBOL_VAR, t);
+    tokens[lhs]->value_type = t;
+    return;
+  }
+  if (tokens[lhs]->type == TOKEN_IDENT && tok->op == OP_UNK &&
+      !lookup(ctx, token_string(lhs))) {
+    // the first assignment to a name declares it
+    TypeId v = check_expression(ctx, rhs, TypeTable::null_type);
+    if (v == TypeTable::nulltype_type || v == TypeTable::void_type) {
+      report_error(i, "cannot infer the type of this variable");
+      v = TypeTable::null_type;
+    }
+    declare(ctx, lhs, SYMBOL_VAR, v);
+    return;
+  }
+  bool lvalue = false;
+  if (tokens[lhs]->type == TOKEN_IDENT) {
+    const Symbol* sym = lookup(ctx, token_string(lhs));
+    lvalue = (sym && sym->kind == SYMBOL_VAR);
+  } else if (tokens[lhs]->type == TOKEN_OP) {
+    lvalue = (tokens[lhs]->op == OP_ACCESS);
+  } else if (tokens[lhs]->type == TOKEN_BRACKET && tokens[lhs]->role == ROLE_ACCESS) {
+    // strs are immutable
+    TypeId base = check_expression(ctx, tokens[lhs]->child1, TypeTable::null_type);
+    lvalue = (type_table.get(base).kind != TYPE_STR);
+  }
+  if (!lvalue) {
+    report_error(i, "cannot assign to this expression");
+    return;
+  }
+  TypeId target = check_expression(ctx, lhs, TypeTable::null_type);
+  TypeId v = check_expression(ctx, rhs, target);
+  if (tok->op == OP_UNK) {
+    if (!assignable(v, target)) report_error(i, "type mismatch in assignment");
+  } else if (target != TypeTable::null_type && v != TypeTable::null_type &&
+             binary_type(tok->op, target, v) != target) {
+    report_error(i, "invalid operand types");
+  }
+}
+
+void CompilationUnit::check_block(CheckContext& ctx, size_t block) {
+  ctx.scopes.emplace_back();
+  for (size_t s = tokens[block]->child1; s; s = tokens[s]->next) {
+    check_statement(ctx, s);
+  }
+  ctx.scopes.pop_back();
+}
+
+// Whether the statements from stmt on never fall off their end: one of
+// them returns on every path through it, or loops forever.
+bool CompilationUnit::always_returns(size_t stmt) {
+  for (size_t s = stmt; s; s = tokens[s]->next) {
+    auto tok = tokens[s];
+    switch (tok->type) {
+    case TOKEN_RETURN:
+      return true;
+    case TOKEN_BRACKET:
+      if (always_returns(tok->child1)) return true;
+      break;
+    case TOKEN_IF: {
+      // every branch does, and there is an else
+      bool all = always_returns(tokens[tok->child2]->child1);
+      bool otherwise = false;
+      while (!otherwise && tokens[s]->next &&
+             (tokens[tokens[s]->next]->type == TOKEN_ELIF || tokens[tokens[s]->next]->type == TOKEN_ELSE)) {
+        s = tokens[s]->next;
+        all = all && always_returns(tokens[tokens[s]->child2]->child1);
+        otherwise = (tokens[s]->type == TOKEN_ELSE);
+      }
+      if (all && otherwise) return true;
+    } break;
+    case TOKEN_SWITCH: {
+      bool all = true;
+      bool otherwise = false;
+      for (size_t c = tokens[tok->child2]->child1; c; c = tokens[c]->next) {
+        all = all && always_returns(tokens[tokens[c]->child2]->child1);
+        otherwise = otherwise || tokens[c]->type == TOKEN_ELSE;
+      }
+      if (all && otherwise) return true;
+    } break;
+    case TOKEN_DO:
+      if (always_returns(tokens[tok->child2]->child1)) return true;
+      [[fallthrough]];
+    case TOKEN_WHILE:
+      if (tokens[tok->child1]->type == TOKEN_CONSTANT && token_string(tok->child1) == "true" &&
+          !breaks_out(tokens[tok->child2]->child1)) {
+        return true;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  return false;
+}
+
+// Whether a break in the statements from stmt on, and not in a loop of
+// their own, leaves the loop they are in.
+bool CompilationUnit::breaks_out(size_t stmt) {
+  for (size_t s = stmt; s; s = tokens[s]->next) {
+    auto tok = tokens[s];
+    switch (tok->type) {
+    case TOKEN_BREAK:
+      return true;
+    case TOKEN_BRACKET:
+      if (breaks_out(tok->child1)) return true;
+      break;
+    case TOKEN_IF:
+    case TOKEN_ELIF:
+    case TOKEN_ELSE:
+      if (breaks_out(tokens[tok->child2]->child1)) return true;
+      break;
+    case TOKEN_SWITCH:
+      for (size_t c = tokens[tok->child2]->child1; c; c = tokens[c]->next) {
+        if (breaks_out(tokens[tokens[c]->child2]->child1)) return true;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  return false;
+}
+
+void CompilationUnit::check_statement(CheckContext& ctx, size_t s) {
+  auto tok = tokens[s];
+  switch (tok->type) {
+  case TOKEN_BRACKET:
+    check_block(ctx, s);
+    break;
+  case TOKEN_SEMICOLON:
+    if (tok->child1) check_assignment(ctx, tok->child1);
+    break;
+  case TOKEN_BREAK:
+  case TOKEN_CONTINUE:
+    if (!ctx.loop_depth) report_error(s, "not in a loop");
+    break;
+  case TOKEN_RETURN: {
+    if (ctx.deferred) report_error(s, "return in defer");
+    TypeId t = TypeTable::void_type;
+    if (tok->child1) t = check_expression(ctx, tok->child1, ctx.return_type);
+    if (!assignable(t, ctx.return_type)) report_error(s, "wrong return type");
+  } break;
+  case TOKEN_YIELD: {
+    if (ctx.deferred) report_error(s, "yield in defer");
+    if (ctx.yield_type == TypeTable::null_type) {
+      report_error(s, "yield outside a function");
+      break;
+    }
+    TypeId t = TypeTable::void_type;
+    if (tok->child1) t = check_expression(ctx, tok->child1, ctx.yield_type);
+    // a void one was reported with the signature
+    if (ctx.yield_type != TypeTable::void_type && !assignable(t, ctx.yield_type)) {
+      report_error(s, "wrong yield type");
+    }
+  } break;
+  case TOKEN_IF:
+  case TOKEN_ELIF:
+  case TOKEN_WHILE: {
+    TypeId t = check_expression(ctx, tok->child1, TypeTable::bool_type);
+    if (!assignable(t, TypeTable::bool_type)) report_error(tok->child1, "condition is not a bool");
+    if (tok->type == TOKEN_WHILE) ctx.loop_depth++;
+    check_block(ctx, tok->child2);
+    if (tok->type == TOKEN_WHILE) ctx.loop_depth--;
+  } break;
+  case TOKEN_DO: {
+    ctx.loop_depth++;
+    check_block(ctx, tok->child2);
+    ctx.loop_depth--;
+    TypeId t = check_expression(ctx, tok->child1, TypeTable::bool_type);
+    if (!assignable(t, TypeTable::bool_type)) report_error(tok->child1, "condition is not a bool");
+  } break;
+  case TOKEN_ELSE:
+    check_block(ctx, tok->child2);
+    break;
+  case TOKEN_FOR: {
+    // for x in expression
+    size_t in = tok->child1;
+    if (tokens[in]->op != OP_IN || tokens[tokens[in]->child1]->type != TOKEN_IDENT) {
+      report_error(s, "expected `name in expression`");
+      break;
+    }
+    TypeId t = check_expression(ctx, tokens[in]->child2, TypeTable::null_type);
+    const Type& seq = type_table.get(t);
+    TypeId elem = TypeTable::null_type;
+    if (seq.kind == TYPE_ARRAY || seq.kind == TYPE_SEQUENCE) elem = seq.inner;
+    else if (seq.kind == TYPE_STR) elem = t;
+    else if (seq.kind != TYPE_NULL) report_error(tokens[in]->child2, "not iterable");
+    ctx.scopes.emplace_back();
+    declare(ctx, tokens[in]->child1, SYMBOL_VAR, elem);
+    ctx.loop_depth++;
+    check_block(ctx, tok->child2);
+    ctx.loop_depth--;
+    ctx.scopes.pop_back();
+  } break;
+  case TOKEN_SWITCH: {
+    TypeId t = check_expression(ctx, tok->child1, TypeTable::null_type);
+    for (size_t c = tokens[tok->child2]->child1; c; c = tokens[c]->next) {
+      if (tokens[c]->type == TOKEN_ELSE) {
+        check_block(ctx, tokens[c]->child2);
+        continue;
+      } else if (tokens[c]->type != TOKEN_CASE) {
+        report_error(c, "expected case");
+        continue;
+      }
+      std::vector<size_t> values;
+      flatten_commas(tokens[c]->child1, values);
+      for (auto v : values) {
+        TypeId vt = check_expression(ctx, v, t);
+        if (!assignable(vt, t)) report_error(v, "case of the wrong type");
+      }
+      check_block(ctx, tokens[c]->child2);
+    }
+  } break;
+  case TOKEN_CASE:
+    report_error(s, "case outside of switch");
+    break;
+  case TOKEN_DEFER: {
+    // It runs on the way out of the block, so it can't leave some other
+    // way, and nothing it declares is there afterwards.
+    int loop_depth = ctx.loop_depth;
+    bool deferred = ctx.deferred;
+    ctx.loop_depth = 0;
+    ctx.deferred = true;
+    ctx.scopes.emplace_back();
+    check_statement(ctx, tok->child1);
+    ctx.scopes.pop_back();
+    ctx.loop_depth = loop_depth;
+    ctx.deferred = deferred;
+  } break;
+  case TOKEN_DELETE: {
+    TypeId t = check_expression(ctx, tok->child1, TypeTable::null_type);
+    const Type& type = type_table.get(t);
+    // only what the heap gives out, which a str may not be
+    TypeKind k = (type.kind == TYPE_NULLABLE ? type_table.get(type.inner).kind : type.kind);
+    if (k != TYPE_STRUCT && k != TYPE_ARRAY && k != TYPE_NULL) {
+      report_error(s, "delete of a value");
+    }
+  } break;
+  case TOKEN_ENUM:
+  case TOKEN_FUNCTION:
+  case TOKEN_IMPORT:
+  case TOKEN_STRUCT:
+    report_error(s, "declarations are only allowed at the top level");
+    break;
+  default:
+    report_error(s, "unexpected statement");
+  }
+}
+
+void CompilationUnit::declare_types() {
+  if (status != UNIT_PARSE) return;
+  for (size_t s = tokens[0]->child1; s; s = tokens[s]->next) {
+    auto tok = tokens[s];
+    if (tok->type != TOKEN_STRUCT && tok->type != TOKEN_ENUM) continue;
+    std::string name = token_string(tok->child1);
+    TypeKind kind = (tok->type == TOKEN_STRUCT ? TYPE_STRUCT : TYPE_ENUM);
+    TypeId id = type_table.declare_named(kind, filename.string(), name);
+    if (type_table.get(id).kind != kind) report_error(s, "conflicting definitions");
+    if (globals.find(name) != globals.end()) report_error(s, "duplicate definition");
+    globals[name] = {SYMBOL_TYPE, id, s, this};
+  }
+}
+
+void CompilationUnit::check_signatures() {
+  if (status != UNIT_PARSE) return;
+  functions.push_back(0);
+  for (size_t s = tokens[0]->child1; s; s = tokens[s]->next) {
+    auto tok = tokens[s];
+    switch (tok->type) {
+    case TOKEN_STRUCT: {
+      std::vector<std::string> names;
+      std::vector<TypeId> members;
+      for (size_t f = tokens[tok->child2]->child1; f; f = tokens[f]->next) {
+        size_t decl = tokens[f]->child1;
+        if (tokens[f]->type != TOKEN_SEMICOLON || !decl || tokens[decl]->op != OP_COLON ||
+            tokens[tokens[decl]->child1]->type != TOKEN_IDENT) {
+          report_error(f, "expected field declaration");
+          continue;
+        }
+        std::string name = token_string(tokens[decl]->child1);
+        for (auto& n : names) {
+          if (n == name) report_error(f, "duplicate field");
+        }
+        names.push_back(name);
+        members.push_back(resolve_type(tokens[decl]->child2));
+      }
+      if (!type_table.define_struct(globals[token_string(tok->child1)].type, names, members)) {
+        report_error(s, "conflicting definitions of struct");
+      }
+    } break;
+    case TOKEN_ENUM: {
+      std::vector<size_t> values;
+      flatten_commas(tokens[tok->child2]->child1, values);
+      std::vector<std::string> names;
+      for (auto v : values) {
+        if (tokens[v]->type != TOKEN_IDENT) report_error(v, "expected enum value");
+        else names.push_back(token_string(v));
+      }
+      if (!type_table.define_enum(globals[token_string(tok->child1)].type, names)) {
+        report_error(s, "conflicting definitions of enum");
+      }
+    } break;
+    case TOKEN_FUNCTION: {
+      size_t name = tok->child1;
+      std::vector<size_t> params;
+      flatten_commas(tokens[tokens[name]->child1]->child1, params);
+      std::vector<TypeId> types;
+      for (auto p : params) {
+        if (tokens[p]->op != OP_COLON || tokens[tokens[p]->child1]->type != TOKEN_IDENT) {
+          report_error(p, "expected `name: type`");
+          types.push_back(TypeTable::null_type);
+        } else {
+          types.push_back(resolve_type(tokens[p]->child2));
+        }
+      }
+      TypeId ret = TypeTable::void_type;
+      if (tokens[name]->child2) ret = resolve_type(tokens[name]->child2);
+      // any yield makes it a generator, with the return type as what it yields
+      size_t body = tok->child2;
+      for (size_t k = body + 1; body && k < tokens[body]->child2; k++) {
+        if (tokens[k]->type != TOKEN_YIELD) continue;
+        if (ret == TypeTable::void_type) report_error(k, "a generator needs the type it yields");
+        ret = type_table.sequence_of(ret);
+        break;
+      }
+      tok->value_type = type_table.function(ret, types);
+      std::string n = token_string(name);
+      if (globals.find(n) != globals.end()) report_error(s, "duplicate definition");
+      globals[n] = {SYMBOL_FUNCTION, tok->value_type, s, this};
+      functions.push_back(s);
+    } break;
+    default:
+      break;
+    }
+  }
+}
+
+size_t CompilationUnit::function_count() {
+  return functions.size();
+}
+
+void CompilationUnit::check_function(size_t index) {
+  size_t fn = functions[index];
+  CheckContext ctx;
+  ctx.scopes.emplace_back();
+  if (!fn) {
+    // top-level statements
+    for (size_t s = tokens[0]->child1; s; s = tokens[s]->next) {
+      switch (tokens[s]->type) {
+      case TOKEN_ENUM:
+      case TOKEN_FUNCTION:
+      case TOKEN_IMPORT:
+      case TOKEN_STRUCT:
+        break;
+      default:
+        check_statement(ctx, s);
+      }
+    }
+    return;
+  }
+  auto tok = tokens[fn];
+  if (!parse_body(fn)) return;
+  const Type& t = type_table.get(tok->value_type);
+  std::vector<size_t> params;
+  flatten_commas(tokens[tokens[tok->child1]->child1]->child1, params);
+  for (size_t k = 0; k < params.size(); k++) {
+    if (tokens[params[k]]->op != OP_COLON) continue;
+    declare(ctx, tokens[params[k]]->child1, SYMBOL_VAR, t.members[k]);
+  }
+  ctx.return_type = t.inner;
+  if (type_table.get(t.inner).kind == TYPE_SEQUENCE) {
+    // generators only end by returning nothing
+    ctx.yield_type = type_table.get(t.inner).inner;
+    ctx.return_type = TypeTable::void_type;
+  }
+  check_block(ctx, tok->child2);
+  if (ctx.return_type != TypeTable::void_type && ctx.return_type != TypeTable::null_type &&
+      !always_returns(tokens[tok->child2]->child1)) {
+    report_error(tokens[tok->child2]->child2, "missing return");
+  }
+}
+
+void CompilationUnit::finish_typecheck() {
+  if (status == UNIT_PARSE && !errors) status = UNIT_TYPED;
+}
@@ -0,0 +1,150 @@
+#include "types.h"
+
+#include <mutex>
+
+TypeTable type_table;
+
+static void append_id(std::string& key, TypeId id) {
+  key.append((const char*)&id, sizeof(id));
+}
+
+TypeTable::TypeTable() {
+  const TypeKind builtins[] = {
+    TYPE_NULL, TYPE_VOID, TYPE_BOOL, TYPE_INT, TYPE_FLOAT, TYPE_STR,
+    TYPE_NULLTYPE,
+  };
+  for (auto kind : builtins) {
+    Type t;
+    t.kind = kind;
+    intern(std::string(1, (char)kind), std::move(t));
+  }
+}
+
+TypeId TypeTable::intern(const std::string& key, Type&& type) {
+  {
+    std::shared_lock<std::shared_mutex> l(lock);
+    auto it = index.find(key);
+    if (it != index.end()) return it->second;
+  }
+  std::unique_lock<std::shared_mutex> l(lock);
+  auto it = index.find(key);
+  if (it != index.end()) return it->second;
+  TypeId id = types.size();
+  types.push_back(std::move(type));
+  index[key] = id;
+  return id;
+}
+
+const Type& TypeTable::get(TypeId id) const {
+  std::shared_lock<std::shared_mutex> l(lock);
+  return types[id];
+}
+
+size_t TypeTable::size() const {
+  std::shared_lock<std::shared_mutex> l(lock);
+  return types.size();
+}
+
+TypeId TypeTable::array_of(TypeId elem) {
+  std::string key(1, (char)TYPE_ARRAY);
+  append_id(key, elem);
+  Type t;
+  t.kind = TYPE_ARRAY;
+  t.inner = elem;
+  return intern(key, std::move(t));
+}
+
+TypeId TypeTable::nullable(TypeId base) {
+  TypeKind k = get(base).kind;
+  if (k == TYPE_NULLABLE || k == TYPE_NULLTYPE || k == TYPE_NULL) return base;
+  std::string key(1, (char)TYPE_NULLABLE);
+  append_id(key, base);
+  Type t;
+  t.kind = TYPE_NULLABLE;
+  t.inner = base;
+  return intern(key, std::move(t));
+}
+
+TypeId TypeTable::sequence_of(TypeId elem) {
+  std::string key(1, (char)TYPE_SEQUENCE);
+  append_id(key, elem);
+  Type t;
+  t.kind = TYPE_SEQUENCE;
+  t.inner = elem;
+  return intern(key, std::move(t));
+}
+
+TypeId TypeTable::function(TypeId ret, const std::vector<TypeId>& params) {
+  std::string key(1, (char)TYPE_FUNCTION);
+  append_id(key, ret);
+  for (auto p : params) append_id(key, p);
+  Type t;
+  t.kind = TYPE_FUNCTION;
+  t.inner = ret;
+  t.members = params;
+  return intern(key, std::move(t));
+}
+
+TypeId TypeTable::declare_named(TypeKind kind, const std::string& unit, const std::string& name) {
+  // structs and enums share a namespace
+  std::string key(1, 'N');
+  key += unit;
+  key += '\0';
+  key += name;
+  Type t;
+  t.kind = kind;
+  t.name = name;
+  t.unit = unit;
+  t.complete = false;
+  return intern(key, std::move(t));
+}
+
+bool TypeTable::define_struct(TypeId id, const std::vector<std::string>& names,
+                              const std::vector<TypeId>& members) {
+  std::unique_lock<std::shared_mutex> l(lock);
+  Type& t = types[id];
+  if (t.kind != TYPE_STRUCT) return false;
+  if (t.complete) return t.names == names && t.members == members;
+  t.names = names;
+  t.members = members;
+  t.complete = true;
+  return true;
+}
+
+bool TypeTable::define_enum(TypeId id, const std::vector<std::string>& names) {
+  std::unique_lock<std::shared_mutex> l(lock);
+  Type& t = types[id];
+  if (t.kind != TYPE_ENUM) return false;
+  if (t.complete) return t.names == names;
+  t.names = names;
+  t.complete = true;
+  return true;
+}
+
+std::string TypeTable::name(TypeId id) const {
+  const Type& t = get(id);
+  switch (t.kind) {
+  case TYPE_NULL: return "<error>";
+  case TYPE_VOID: return "void";
+  case TYPE_BOOL: return "bool";
+  case TYPE_INT: return "int";
+  case TYPE_FLOAT: return "float";
+  case TYPE_STR: return "str";
+  case TYPE_NULLTYPE: return "null";
+  case TYPE_ARRAY: return "[" + name(t.inner) + "]";
+  case TYPE_NULLABLE: return name(t.inner) + "?";
+  case TYPE_SEQUENCE: return "seq[" + name(t.inner) + "]";
+  case TYPE_FUNCTION: {
+    std::string ret = "fn(";
+    for (size_t i = 0; i < t.members.size(); i++) {
+      if (i) ret += ", ";
+      ret += name(t.members[i]);
+    }
+    return ret + "): " + name(t.inner);
+  }
+  case TYPE_STRUCT:
+  case TYPE_ENUM:
+    return t.name;
+  }
+  return "<error>";
+}
@@ -0,0 +1,84 @@
+#ifndef __VOOM_TYPES_H__
+#define __VOOM_TYPES_H__
+
+#include "string.h"
+
+#include <cstdint>
+#include <deque>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+typedef uint32_t TypeId;
+
+enum TypeKind {
+  TYPE_NULL, // unknown, or the result of an error
+  TYPE_VOID,
+  TYPE_BOOL,
+  TYPE_INT,
+  TYPE_FLOAT,
+  TYPE_STR,
+  TYPE_NULLTYPE, // the type of the constant `null`
+  TYPE_ARRAY,
+  TYPE_NULLABLE,
+  TYPE_FUNCTION,
+  TYPE_STRUCT,
+  TYPE_ENUM,
+  TYPE_SEQUENCE, // what calling a generator gives, only `for` can use it
+};
+
+struct Type {
+  TypeKind kind = TYPE_NULL;
+  // element type of arrays, nullables and sequences, return type of functions
+  TypeId inner = 0;
+  // parameter types of functions, field types of structs
+  std::vector<TypeId> members;
+  // field names of structs, value names of enums
+  std::vector<std::string> names;
+  // structs and enums are nominal, and distinct in each file that
+  // declares one, named by its path
+  std::string name;
+  std::string unit;
+  // structs and enums are interned by name before their body is known
+  bool complete = true;
+};
+
+// Every type is interned here exactly once, so two types are equal
+// if and only if their ids are equal.
+// Lookups and inserts may come from several checker threads at once.
+class TypeTable {
+private:
+  std::deque<Type> types;
+  std::unordered_map<std::string, TypeId> index;
+  mutable std::shared_mutex lock;
+
+  TypeId intern(const std::string& key, Type&& type);
+public:
+  static constexpr TypeId null_type = 0;
+  static constexpr TypeId void_type = 1;
+  static constexpr TypeId bool_type = 2;
+  static constexpr TypeId int_type = 3;
+  static constexpr TypeId float_type = 4;
+  static constexpr TypeId str_type = 5;
+  static constexpr TypeId nulltype_type = 6;
+
+  TypeTable();
+  const Type& get(TypeId id) const;
+  size_t size() const;
+  TypeId array_of(TypeId elem);
+  TypeId nullable(TypeId base);
+  TypeId sequence_of(TypeId elem);
+  TypeId function(TypeId ret, const std::vector<TypeId>& params);
+  // returns the existing type if unit has declared one of this name
+  TypeId declare_named(TypeKind kind, const std::string& unit, const std::string& name);
+  // returns false if a different definition was already given
+  bool define_struct(TypeId id, const std::vector<std::string>& names,
+                     const std::vector<TypeId>& members);
+  bool define_enum(TypeId id, const std::vector<std::string>& names);
+  std::string name(TypeId id) const;
+};
+
+extern TypeTable type_table;
+
+#endif
@@ -0,0 +1,320 @@
+#include "x86.h"
+
+static bool is_int8(int64_t v) {
+  return v >= -128 && v <= 127;
+}
+
+void Assembler::imm32(int32_t v) {
+  for (int i = 0; i < 4; i++) byte((uint32_t)v >> (8 * i));
+}
+
+void Assembler::imm64(int64_t v) {
+  for (int i = 0; i < 8; i++) byte((uint64_t)v >> (8 * i));
+}
+
+void Assembler::rex(bool w, int reg, const Mem& m, bool force) {
+  uint8_t r = (w << 3) | ((reg >> 3) << 2) | (m.base >> 3);
+  if (m.index != NO_REG) r |= (m.index >> 3) << 1;
+  if (r || force) byte(0x40 | r);
+}
+
+void Assembler::rex_rr(bool w, int reg, int rm) {
+  uint8_t r = (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+  if (r) byte(0x40 | r);
+}
+
+void Assembler::modrm(int reg, const Mem& m) {
+  // rbp and r13 have no disp-less form, rsp and r12 always need a SIB
+  int mod = 2;
+  if (m.disp == 0 && (m.base & 7) != RBP) mod = 0;
+  else if (is_int8(m.disp)) mod = 1;
+  if (m.index == NO_REG && (m.base & 7) != RSP) {
+    byte((mod << 6) | ((reg & 7) << 3) | (m.base & 7));
+  } else {
+    int scale = (m.scale == 8 ? 3 : m.scale == 4 ? 2 : m.scale == 2 ? 1 : 0);
+    int index = (m.index == NO_REG ? RSP : m.index & 7);
+    byte((mod << 6) | ((reg & 7) << 3) | RSP);
+    byte((scale << 6) | (index << 3) | (m.base & 7));
+  }
+  if (mod == 1) byte(m.disp);
+  else if (mod == 2) imm32(m.disp);
+}
+
+void Assembler::modrm_rr(int reg, int rm) {
+  byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void Assembler::mov(Reg dst, Reg src) {
+  if (dst == src) return;
+  rex_rr(true, src, dst);
+  byte(0x89);
+  modrm_rr(src, dst);
+}
+
+void Assembler::mov(Reg dst, int64_t imm) {
+  if (imm == (int32_t)imm) {
+    // sign extended
+    rex_rr(true, 0, dst);
+    byte(0xC7);
+    modrm_rr(0, dst);
+    imm32(imm);
+  } else if (imm == (uint32_t)imm) {
+    // zero extended
+    rex_rr(false, 0, dst);
+    byte(0xB8 + (dst & 7));
+    imm32(imm);
+  } else {
+    rex_rr(true, 0, dst);
+    byte(0xB8 + (dst & 7));
+    imm64(imm);
+  }
+}
+
+void Assembler::load(Reg dst, const Mem& m) {
+  rex(true, dst, m);
+  byte(0x8B);
+  modrm(dst, m);
+}
+
+void Assembler::store(const Mem& m, Reg src) {
+  rex(true, src, m);
+  byte(0x89);
+  modrm(src, m);
+}
+
+void Assembler::load_byte(Reg dst, const Mem& m) {
+  rex(true, dst, m);
+  byte(0x0F);
+  byte(0xB6);
+  modrm(dst, m);
+}
+
+void Assembler::store_byte(const Mem& m, Reg src) {
+  // any REX prefix turns 4-7 into sil/dil rather than ah/bh
+  rex(false, src, m, true);
+  byte(0x88);
+  modrm(src, m);
+}
+
+void Assembler::lea(Reg dst, const Mem& m) {
+  rex(true, dst, m);
+  byte(0x8D);
+  modrm(dst, m);
+}
+
+void Assembler::alu(AluOp op, Reg dst, Reg src) {
+  rex_rr(true, src, dst);
+  byte((op << 3) | 1);
+  modrm_rr(src, dst);
+}
+
+void Assembler::alu(AluOp op, Reg dst, int32_t imm) {
+  rex_rr(true, 0, dst);
+  if (is_int8(imm)) {
+    byte(0x83);
+    modrm_rr(op, dst);
+    byte(imm);
+  } else {
+    byte(0x81);
+    modrm_rr(op, dst);
+    imm32(imm);
+  }
+}
+
+void Assembler::cmp(const Mem& m, Reg src) {
+  rex(true, src, m);
+  byte(0x39);
+  modrm(src, m);
+}
+
+void Assembler::test(Reg a, Reg b) {
+  rex_rr(true, b, a);
+  byte(0x85);
+  modrm_rr(b, a);
+}
+
+void Assembler::imul(Reg dst, Reg src) {
+  rex_rr(true, dst, src);
+  byte(0x0F);
+  byte(0xAF);
+  modrm_rr(dst, src);
+}
+
+void Assembler::bsr(Reg dst, Reg src) {
+  rex_rr(true, dst, src);
+  byte(0x0F);
+  byte(0xBD);
+  modrm_rr(dst, src);
+}
+
+void Assembler::cqo() {
+  byte(0x48);
+  byte(0x99);
+}
+
+void Assembler::idiv(Reg src) {
+  rex_rr(true, 0, src);
+  byte(0xF7);
+  modrm_rr(7, src);
+}
+
+void Assembler::div(Reg src) {
+  rex_rr(true, 0, src);
+  byte(0xF7);
+  modrm_rr(6, src);
+}
+
+void Assembler::neg(Reg r) {
+  rex_rr(true, 0, r);
+  byte(0xF7);
+  modrm_rr(3, r);
+}
+
+void Assembler::not_(Reg r) {
+  rex_rr(true, 0, r);
+  byte(0xF7);
+  modrm_rr(2, r);
+}
+
+void Assembler::shl_cl(Reg r) {
+  rex_rr(true, 0, r);
+  byte(0xD3);
+  modrm_rr(4, r);
+}
+
+void Assembler::sar_cl(Reg r) {
+  rex_rr(true, 0, r);
+  byte(0xD3);
+  modrm_rr(7, r);
+}
+
+void Assembler::shr(Reg r, uint8_t count) {
+  rex_rr(true, 0, r);
+  byte(0xC1);
+  modrm_rr(5, r);
+  byte(count);
+}
+
+void Assembler::setcc(Condition cc, Reg r) {
+  if (r >= 4) byte(0x40 | (r >> 3));
+  byte(0x0F);
+  byte(0x90 + cc);
+  modrm_rr(0, r);
+}
+
+void Assembler::cmov(Condition cc, Reg dst, Reg src) {
+  rex_rr(true, dst, src);
+  byte(0x0F);
+  byte(0x40 + cc);
+  modrm_rr(dst, src);
+}
+
+void Assembler::movzx_byte(Reg dst, Reg src) {
+  byte(0x48 | ((dst >> 3) << 2) | (src >> 3));
+  byte(0x0F);
+  byte(0xB6);
+  modrm_rr(dst, src);
+}
+
+void Assembler::push(Reg r) {
+  if (r >= 8) byte(0x41);
+  byte(0x50 + (r & 7));
+}
+
+void Assembler::pop(Reg r) {
+  if (r >= 8) byte(0x41);
+  byte(0x58 + (r & 7));
+}
+
+void Assembler::ret() {
+  byte(0xC3);
+}
+
+void Assembler::syscall() {
+  byte(0x0F);
+  byte(0x05);
+}
+
+void Assembler::movq_to_xmm(int xmm, Reg src) {
+  byte(0x66);
+  rex_rr(true, xmm, src);
+  byte(0x0F);
+  byte(0x6E);
+  modrm_rr(xmm, src);
+}
+
+void Assembler::movq_from_xmm(Reg dst, int xmm) {
+  byte(0x66);
+  rex_rr(true, xmm, dst);
+  byte(0x0F);
+  byte(0x7E);
+  modrm_rr(xmm, dst);
+}
+
+void Assembler::sse(SseOp op, int dst, int src) {
+  byte(0xF2);
+  rex_rr(false, dst, src);
+  byte(0x0F);
+  byte(op);
+  modrm_rr(dst, src);
+}
+
+void Assembler::ucomisd(int a, int b) {
+  byte(0x66);
+  rex_rr(false, a, b);
+  byte(0x0F);
+  byte(0x2E);
+  modrm_rr(a, b);
+}
+
+void Assembler::cvtsi2sd(int xmm, Reg src) {
+  byte(0xF2);
+  rex_rr(true, xmm, src);
+  byte(0x0F);
+  byte(0x2A);
+  modrm_rr(xmm, src);
+}
+
+void Assembler::cvttsd2si(Reg dst, int xmm) {
+  byte(0xF2);
+  rex_rr(true, dst, xmm);
+  byte(0x0F);
+  byte(0x2C);
+  modrm_rr(dst, xmm);
+}
+
+size_t Assembler::jmp() {
+  byte(0xE9);
+  imm32(0);
+  return here() - 4;
+}
+
+void Assembler::jmp(Reg r) {
+  if (r >= 8) byte(0x41);
+  byte(0xFF);
+  modrm_rr(4, r);
+}
+
+size_t Assembler::jcc(Condition cc) {
+  byte(0x0F);
+  byte(0x80 + cc);
+  imm32(0);
+  return here() - 4;
+}
+
+size_t Assembler::call() {
+  byte(0xE8);
+  imm32(0);
+  return here() - 4;
+}
+
+void Assembler::call(Reg r) {
+  if (r >= 8) byte(0x41);
+  byte(0xFF);
+  modrm_rr(2, r);
+}
+
+void Assembler::patch(size_t rel32, size_t target) {
+  int32_t rel = (int64_t)target - (int64_t)(rel32 + 4);
+  for (int i = 0; i < 4; i++) code[rel32 + i] = (uint32_t)rel >> (8 * i);
+}
@@ -0,0 +1,107 @@
+#ifndef __VOOM_X86_H__
+#define __VOOM_X86_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Just enough of an x86-64 encoder for the native backend.
+// Every integer operation is 64 bits wide.
+enum Reg {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+  NO_REG = -1,
+};
+
+enum Condition {
+  CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+  CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G,
+};
+
+// the /digit of the 0x81 group, and (<< 3 | 1) the register form
+enum AluOp {
+  ALU_ADD = 0,
+  ALU_OR  = 1,
+  ALU_AND = 4,
+  ALU_SUB = 5,
+  ALU_XOR = 6,
+  ALU_CMP = 7,
+};
+
+enum SseOp {
+  SSE_ADD = 0x58,
+  SSE_MUL = 0x59,
+  SSE_SUB = 0x5C,
+  SSE_DIV = 0x5E,
+};
+
+// A memory operand: [base + index * scale + disp]
+struct Mem {
+  Reg base;
+  int32_t disp = 0;
+  Reg index = NO_REG;
+  uint8_t scale = 1;
+};
+
+class Assembler {
+private:
+  void rex(bool w, int reg, const Mem& m, bool force = false);
+  void rex_rr(bool w, int reg, int rm);
+  void modrm(int reg, const Mem& m);
+  void modrm_rr(int reg, int rm);
+public:
+  std::vector<uint8_t> code;
+
+  size_t here() const { return code.size(); }
+  void byte(uint8_t b) { code.push_back(b); }
+  void imm32(int32_t v);
+  void imm64(int64_t v);
+
+  void mov(Reg dst, Reg src);
+  void mov(Reg dst, int64_t imm);
+  void load(Reg dst, const Mem& m);
+  void store(const Mem& m, Reg src);
+  void load_byte(Reg dst, const Mem& m);
+  void store_byte(const Mem& m, Reg src);
+  void lea(Reg dst, const Mem& m);
+  void alu(AluOp op, Reg dst, Reg src);
+  void alu(AluOp op, Reg dst, int32_t imm);
+  void cmp(const Mem& m, Reg src);
+  void test(Reg a, Reg b);
+  void imul(Reg dst, Reg src);
+  // index of the highest set bit
+  void bsr(Reg dst, Reg src);
+  void cqo();
+  void idiv(Reg src);
+  void div(Reg src);
+  void neg(Reg r);
+  void not_(Reg r);
+  void shl_cl(Reg r);
+  void sar_cl(Reg r);
+  void shr(Reg r, uint8_t count);
+  void setcc(Condition cc, Reg r);
+  void cmov(Condition cc, Reg dst, Reg src);
+  void movzx_byte(Reg dst, Reg src);
+  void push(Reg r);
+  void pop(Reg r);
+  void ret();
+  void syscall();
+
+  // xmm registers are only used as scratch, so they are plain numbers
+  void movq_to_xmm(int xmm, Reg src);
+  void movq_from_xmm(Reg dst, int xmm);
+  void sse(SseOp op, int dst, int src);
+  void ucomisd(int a, int b);
+  void cvtsi2sd(int xmm, Reg src);
+  void cvttsd2si(Reg dst, int xmm);
+
+  // Branches return the offset of their rel32 for patch().
+  size_t jmp();
+  void jmp(Reg r);
+  size_t jcc(Condition cc);
+  size_t call();
+  void call(Reg r);
+  void patch(size_t rel32, size_t target);
+};
+
+#endif
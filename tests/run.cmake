@@ -0,0 +1,33 @@
+# Runs NAME.voom with `voom run` and, if NATIVE, as the executable from
+# `voom build`, failing unless each prints NAME.out. A program that doesn't
+# build is checked by what the build prints instead.
+# Invoked by ctest; see CMakeLists.txt.
+file(READ ${DIR}/${NAME}.out expected)
+# built here rather than next to the sources, and run from here so
+# messages name the file the same way on every machine
+file(COPY ${DIR}/${NAME}.voom DESTINATION ${OUT})
+
+function(check label)
+	execute_process(COMMAND ${ARGN}
+		WORKING_DIRECTORY ${OUT}
+		OUTPUT_VARIABLE output
+		ERROR_VARIABLE output
+		RESULT_VARIABLE result)
+	if(NOT "${output}exit ${result}\n" STREQUAL "${expected}")
+		message(SEND_ERROR "${NAME} ${label}: expected\n${expected}got\n${output}exit ${result}")
+	endif()
+endfunction()
+
+check(bytecode ${VOOM} run ${NAME}.voom)
+if(NOT NATIVE)
+	return()
+endif()
+execute_process(COMMAND ${VOOM} build ${NAME}.voom
+	WORKING_DIRECTORY ${OUT}
+	OUTPUT_QUIET
+	RESULT_VARIABLE result)
+if(result EQUAL 0)
+	check(native ${OUT}/${NAME})
+else()
+	check("native build" ${VOOM} build ${NAME}.voom)
+endif()